@@ -70,6 +70,10 @@ int main(int argc,char **argv)
   ierr = MatShellSetContext(A,&matctx);CHKERRQ(ierr);
   ierr = MatShellSetOperation(A,MATOP_MULT,(void (*)(void))JacobianVectorProductIDMass);CHKERRQ(ierr);
   ierr = MatShellSetOperation(A,MATOP_MULT_TRANSPOSE,(void (*)(void))JacobianTransposeVectorProductIDMass);CHKERRQ(ierr);
+#if PETSC_VERSION_GE(3,14,0)
+  ierr = MatShellSetMatProductOperation(A,MATPRODUCT_AB,NULL,JacobianMatMultIDMass,NULL,MATDENSE,MATDENSE);CHKERRQ(ierr);
+  ierr = MatShellSetMatProductOperation(A,MATPRODUCT_AtB,NULL,JacobianTransposeMatMultIDMass,NULL,MATDENSE,MATDENSE);CHKERRQ(ierr);
+#endif
   ierr = VecDuplicate(x,&matctx.X);CHKERRQ(ierr);
   ierr = VecDuplicate(x,&matctx.Xdot);CHKERRQ(ierr);
 
@@ -94,11 +98,9 @@ int main(int argc,char **argv)
           It is also important to deconstruct and free memory appropriately.
      - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
   ierr = DMDAGetGhostCorners(da,NULL,&gys,NULL,&gxm,&gym,NULL);CHKERRQ(ierr);
-  matctx.m = 2*gxm*gym;
-  matctx.n = 2*gxm*gym;
-  matctx.flg = PETSC_FALSE;
   matctx.tag1 = 1;
   matctx.tag2 = 2;
+  ierr = MatFreeSetUp(da,&matctx);CHKERRQ(ierr);
 
   // Create contiguous 1-arrays of AFields
   u_c = new AField[gxm*gym];
@@ -178,6 +180,7 @@ int main(int argc,char **argv)
   ierr = VecDestroy(&r);CHKERRQ(ierr);
   ierr = VecDestroy(&matctx.X);CHKERRQ(ierr);
   ierr = VecDestroy(&matctx.Xdot);CHKERRQ(ierr);
+  ierr = MatFreeDestroy(&matctx);CHKERRQ(ierr);
   ierr = MatDestroy(&A);CHKERRQ(ierr);
   ierr = VecDestroy(&x);CHKERRQ(ierr);
   ierr = TSDestroy(&ts);CHKERRQ(ierr);
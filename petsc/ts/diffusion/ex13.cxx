@@ -20,6 +20,23 @@ static char help[] = "Demonstrates automatic Jacobian computation using ADOL-C f
                           drivers and PETSc colouring routines.
    -adolc_sparse_view   : Print the matrices involved in the sparse
                           Jacobian computation.
+   -adolc_sparsity_pattern <dm|tape> : Generate the sparsity pattern from
+                          the DMDA stencil (default) or the tape.
+   -adolc_sparsity_check : Check the DMDA sparsity pattern contains that
+                          of the tape.
+   -adolc_coloring <name|auto> : Colour the Jacobian columns with the
+                          named backend, or try each and keep the one
+                          with the fewest colours.
+   -adolc_coloring_tile <file> : Colour by tiling a small periodic tile,
+                          read from (or written to) a file, which may
+                          be reused on refined or rebalanced grids.
+   -adolc_cache <prefix> : Read the sparsity pattern, colouring and
+                          recovery plan from a per-rank cache file, or
+                          write one if it does not yet exist.
+   -adolc_matfree_check : Check that the matrix-free Jacobian vector
+                          product (see utils/matfree.cxx) on this single
+                          dof, non-periodic DMDA agrees with the
+                          assembled Jacobian at the initial condition.
    -jacobian_by_hand    : Use the hand-coded Jacobian of ex13.c, rather
                           than generating it automatically.
    -no_annotation       : Do not annotate ADOL-C active variables.
@@ -32,6 +49,7 @@ static char help[] = "Demonstrates automatic Jacobian computation using ADOL-C f
 #include <adolc/adolc.h>	// Include ADOL-C
 #include <adolc/adolc_sparse.h>
 #include "utils/jacobian.cxx"
+#include "../../utils/matfree.cxx"
 
 
 int main(int argc,char **argv)
@@ -39,28 +57,31 @@ int main(int argc,char **argv)
   TS             ts;                    /* nonlinear solver */
   Vec            u,r;                   /* solution, residual vector */
   Mat            J;                     /* Jacobian matrix */
-  PetscInt       steps,gxs,gys,gxm,gym,i,ctrl[3] = {0,0,0};
+  PetscInt       steps,gxs,gys,gxm,gym;
   PetscErrorCode ierr;
   DM             da;
   PetscReal      ftime,dt;
   AppCtx         user;                  /* user-defined work context */
   AdolcCtx       *adctx;
   adouble        **u_a = NULL,**f_a = NULL,*u_c = NULL,*f_c = NULL;  /* active variables */
-  PetscScalar    **Seed = NULL,**Rec = NULL,*u_vec;
-  unsigned int   **JP = NULL;
-  ISColoring     iscoloring;
-  PetscBool      byhand = PETSC_FALSE;
+  PetscBool      byhand = PETSC_FALSE,matfree_check = PETSC_FALSE;
+  MatCtx         matctx;                /* matrix-free context, for -adolc_matfree_check */
+  Mat            A;
+  Vec            v,y,yA;
+  PetscInt       nloc;
+  PetscRandom    rand;
+  PetscReal      nrm,nrmy;
   MPI_Comm       comm = MPI_COMM_WORLD;
 
   ierr = PetscInitialize(&argc,&argv,"petscoptions",help);if (ierr) return ierr;
-  ierr = PetscMalloc1(1,&adctx);CHKERRQ(ierr);
+  ierr = PetscNew(&adctx);CHKERRQ(ierr);
   adctx->no_an = PETSC_FALSE;adctx->zos = PETSC_FALSE;adctx->zos_view = PETSC_FALSE;adctx->sparse = PETSC_FALSE;adctx->sparse_view = PETSC_FALSE;
   ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_test_zos",&adctx->zos,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_test_zos_view",&adctx->zos_view,NULL);CHKERRQ(ierr);
-  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse",&adctx->sparse,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse_view",&adctx->sparse_view,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-jacobian_by_hand",&byhand,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-no_annotation",&adctx->no_an,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_matfree_check",&matfree_check,NULL);CHKERRQ(ierr);
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      Create distributed array (DMDA) to manage parallel grid and vectors
@@ -124,50 +145,13 @@ int main(int argc,char **argv)
     ierr = RHSFunctionActive(ts,1.0,u,r,&user);CHKERRQ(ierr);
 
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-      In the case where ADOL-C generates the Jacobian in compressed format,
-      seed and recovery matrices are required. Since the sparsity structure
-      of the Jacobian does not change over the course of the time
-      integration, we can save computational effort by only generating
-      these objects once.
+      Compute the sparsity pattern and decide whether to generate the
+      Jacobian in compressed format. If so, seed matrix and recovery plan
+      are required. Since the sparsity structure of the Jacobian does not
+      change over the course of the time integration, we can save
+      computational effort by only generating these objects once.
        - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-    if (adctx->sparse) {
-
-      // Generate sparsity pattern and create an associated colouring
-      ierr = PetscMalloc1(adctx->n,&u_vec);CHKERRQ(ierr);
-      JP = (unsigned int **) malloc(adctx->m*sizeof(unsigned int*));
-      jac_pat(1,adctx->m,adctx->n,u_vec,JP,ctrl);
-      if (user.adctx->sparse_view) {
-        ierr = PrintSparsity(comm,adctx->m,JP);CHKERRQ(ierr);
-      }
-
-      // Extract colouring
-      ierr = GetColoring(da,&iscoloring);CHKERRQ(ierr);
-      ierr = CountColors(iscoloring,&adctx->p);CHKERRQ(ierr);
-
-      // Generate seed matrix
-      Seed = myalloc2(adctx->n,adctx->p);
-      ierr = GenerateSeedMatrix(iscoloring,Seed);CHKERRQ(ierr);
-      ierr = ISColoringDestroy(&iscoloring);CHKERRQ(ierr);
-      if (user.adctx->sparse_view) {
-        ierr = PrintMat(comm,"Seed matrix:",adctx->n,adctx->p,Seed);CHKERRQ(ierr);
-      }
-
-      // Generate recovery matrix
-      Rec = myalloc2(adctx->m,adctx->p);
-      ierr = GetRecoveryMatrix(Seed,JP,adctx->m,adctx->p,Rec);CHKERRQ(ierr);
-
-      // Store results and free workspace
-      adctx->Rec = Rec;
-      for (i=0;i<adctx->m;i++)
-        free(JP[i]);
-      free(JP);
-      ierr = PetscFree(u_vec);CHKERRQ(ierr);
-    } else {
-      adctx->p = adctx->n;
-      Seed = myalloc2(adctx->n,adctx->p);
-      ierr = Subidentity(adctx->n,0,Seed);CHKERRQ(ierr);
-    }
-    adctx->Seed = Seed;
+    ierr = AdolcJacobianSetUp(da,1,adctx);CHKERRQ(ierr);
 
     if (adctx->zos)
       PetscPrintf(comm,"    If ||F_zos(x) - F_rhs(x)||_2/||F_rhs(x)||_2 is O(1.e-8), ADOL-C function evaluation\n      is probably correct.\n");
@@ -193,6 +177,52 @@ int main(int argc,char **argv)
   dt   = .01;
   ierr = TSSetTimeStep(ts,dt);CHKERRQ(ierr);
 
+  /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     Optionally compare the matrix-free Jacobian vector product with the
+     assembled Jacobian at the initial condition, applied to a random
+     vector. The tape is in local numbering on a DMDA with one degree of
+     freedom and non-periodic boundaries, so this exercises the run map
+     of MatFreeSetUp away from the two dof, periodic Gray-Scott case.
+   - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  if ((matfree_check) && (!adctx->no_an)) {
+    ierr = PetscLogEventRegister("df/dx forward",MAT_CLASSID,&matctx.event1);CHKERRQ(ierr);
+    ierr = PetscLogEventRegister("df/d(xdot) forward",MAT_CLASSID,&matctx.event2);CHKERRQ(ierr);
+    matctx.tag1  = 1;
+    matctx.shift = 0.;
+    matctx.ts    = ts;
+    matctx.X     = u;
+    ierr = MatFreeSetUp(da,&matctx);CHKERRQ(ierr);
+    ierr = DMGetLocalVector(da,&matctx.localX0);CHKERRQ(ierr);
+    ierr = MatFreeSetBasePoint(da,&matctx);CHKERRQ(ierr);
+    ierr = VecDuplicate(u,&v);CHKERRQ(ierr);
+    ierr = VecDuplicate(u,&y);CHKERRQ(ierr);
+    ierr = VecDuplicate(u,&yA);CHKERRQ(ierr);
+    ierr = VecGetLocalSize(u,&nloc);CHKERRQ(ierr);
+    ierr = MatCreateShell(comm,nloc,nloc,PETSC_DETERMINE,PETSC_DETERMINE,&matctx,&A);CHKERRQ(ierr);
+    ierr = MatShellSetOperation(A,MATOP_MULT,(void (*)(void))JacobianVectorProductIDMass);CHKERRQ(ierr);
+    ierr = RHSJacobianAdolc(ts,0.,u,J,J,&user);CHKERRQ(ierr);
+    ierr = PetscRandomCreate(comm,&rand);CHKERRQ(ierr);
+    ierr = PetscRandomSetFromOptions(rand);CHKERRQ(ierr);
+    ierr = VecSetRandom(v,rand);CHKERRQ(ierr);
+    ierr = PetscRandomDestroy(&rand);CHKERRQ(ierr);
+    ierr = MatMult(J,v,y);CHKERRQ(ierr);
+    ierr = VecNorm(y,NORM_2,&nrmy);CHKERRQ(ierr);
+    ierr = MatMult(A,v,yA);CHKERRQ(ierr);
+    ierr = VecAXPY(y,-1.,yA);CHKERRQ(ierr);
+    ierr = VecNorm(y,NORM_2,&nrm);CHKERRQ(ierr);
+    if (nrm > 1.e-10*nrmy) {
+      ierr = PetscPrintf(comm,"Matrix-free and assembled Jacobian products differ by %g\n",(double)(nrm/nrmy));CHKERRQ(ierr);
+    } else {
+      ierr = PetscPrintf(comm,"Matrix-free and assembled Jacobian products agree\n");CHKERRQ(ierr);
+    }
+    ierr = MatDestroy(&A);CHKERRQ(ierr);
+    ierr = VecDestroy(&yA);CHKERRQ(ierr);
+    ierr = VecDestroy(&y);CHKERRQ(ierr);
+    ierr = VecDestroy(&v);CHKERRQ(ierr);
+    ierr = DMRestoreLocalVector(da,&matctx.localX0);CHKERRQ(ierr);
+    ierr = MatFreeDestroy(&matctx);CHKERRQ(ierr);
+  }
+
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      Set runtime options
    - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
@@ -211,9 +241,7 @@ int main(int argc,char **argv)
   ierr = MatDestroy(&J);CHKERRQ(ierr);
   ierr = TSDestroy(&ts);CHKERRQ(ierr);
   if (!adctx->no_an) {
-    if (adctx->sparse)
-      myfree2(Rec);
-    myfree2(Seed);
+    ierr = AdolcJacobianDestroy(adctx);CHKERRQ(ierr);
     f_a += gys;
     u_a += gys;
     delete[] f_a;
@@ -244,5 +272,14 @@ int main(int argc,char **argv)
       suffix: 3
       args: -ts_max_steps 5 -snes_fd_color -ts_monitor
 
+    test:
+      suffix: 4
+      args: -ts_max_steps 5 -ts_monitor -adolc_sparsity_check
+
+    test:
+      suffix: matfree_check
+      nsize: {{1 2}}
+      args: -ts_max_steps 1 -adolc_matfree_check
+
 TEST*/
 
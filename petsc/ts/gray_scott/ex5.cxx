@@ -26,6 +26,35 @@ static char help[] = "Demonstrates automatic Jacobian generation using ADOL-C fo
                              drivers and PETSc colouring routines.
       -adolc_sparse_view   : Print the matrices involved in the sparse
                              Jacobian computation.
+      -adolc_sparsity_pattern <dm|tape> : Generate the sparsity pattern from
+                             the DMDA stencil (default) or the tape.
+      -adolc_sparsity_check : Check the DMDA sparsity pattern contains that
+                             of the tape.
+      -adolc_coloring <name|auto> : Colour the Jacobian columns with the
+                             named backend, or try each and keep the one
+                             with the fewest colours.
+      -adolc_coloring_tile <file> : Colour by tiling a small periodic tile,
+                             read from (or written to) a file, which may
+                             be reused on refined or rebalanced grids.
+      -adolc_seed_block <b> : Generate the seed matrix from the colours in
+                             blocks of b directions, rather than storing it.
+      -adolc_cache <prefix> : Read the sparsity pattern, colouring and
+                             recovery plan from a per-rank cache file, or
+                             write one if it does not yet exist.
+      -adolc_cache_reread  : With -adolc_cache, set up a second context
+                             from the cache file just written (or read)
+                             and check that it matches the first.
+      -adolc_owned_only    : Only mark owned points as dependent, so that
+                             ghost points do not contribute rows to the
+                             compressed Jacobian.
+      -adolc_block_recovery : Recover the Jacobian in 2 x 2 blocks, inserted
+                             with MatSetValuesBlockedLocal. This is the
+                             default with -dm_mat_type baij (sbaij also
+                             requires -adolc_symmetric, so does not apply
+                             to this non-symmetric Jacobian).
+      -adolc_coo           : Freeze the matrix nonzero pattern at the first
+                             Jacobian evaluation and scatter values with
+                             MatSetValuesCOO thereafter (PETSc 3.16+).
       -jacobian_by_hand    : Use the hand-coded Jacobian of ex13.c, rather
                              than generating it automatically.
       -no_annotation       : Do not annotate ADOL-C active variables.
@@ -49,6 +78,47 @@ static char help[] = "Demonstrates automatic Jacobian generation using ADOL-C fo
 #include <adolc/adolc_sparse.h> // Include ADOL-C sparse drivers
 #include "utils/jacobian.cxx"
 
+/*
+  Set up a second ADOL-C context for the same tape, which reads the compression objects from the
+  cache file written (or read) by the first, and check that the two agree
+
+  Input parameters:
+  da    - distributed array upon which the tape is defined
+  adctx - ADOL-C context, as set up by AdolcJacobianSetUp with -adolc_cache
+  owned - whether only owned points are dependent
+  n     - number of independent (and local) variables
+*/
+static PetscErrorCode CheckCacheReadBack(DM da,AdolcCtx *adctx,PetscBool owned,PetscInt n)
+{
+  PetscErrorCode ierr;
+  AdolcCtx       *adctx2;
+  PetscBool      match,eq;
+
+  PetscFunctionBeginUser;
+  ierr = PetscNew(&adctx2);CHKERRQ(ierr);
+  adctx2->m = n;
+  adctx2->n = n;
+  if (owned) {
+    ierr = AdolcSetOwnedDependents(da,adctx2);CHKERRQ(ierr);
+  }
+  ierr = AdolcJacobianSetUp(da,1,adctx2);CHKERRQ(ierr);
+  match = ((adctx2->sparse == adctx->sparse) && (adctx2->reverse == adctx->reverse) && (adctx2->bidirectional == adctx->bidirectional) && (adctx2->p == adctx->p)) ? PETSC_TRUE : PETSC_FALSE;
+  if ((match) && (adctx->plan)) {
+    match = ((adctx2->plan) && (adctx2->plan->m == adctx->plan->m) && (adctx2->plan->nnz == adctx->plan->nnz)) ? PETSC_TRUE : PETSC_FALSE;
+    if (match) {
+      ierr = PetscMemcmp(adctx2->plan->cols,adctx->plan->cols,adctx->plan->nnz*sizeof(PetscInt),&eq);CHKERRQ(ierr);
+      match = eq;
+      ierr = PetscMemcmp(adctx2->plan->offsets,adctx->plan->offsets,adctx->plan->nnz*sizeof(PetscInt),&eq);CHKERRQ(ierr);
+      match = (PetscBool) (match && eq);
+    }
+  }
+  ierr = MPI_Allreduce(MPI_IN_PLACE,&match,1,MPIU_BOOL,MPI_LAND,PETSC_COMM_WORLD);CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD,"Cached compression objects %s\n",match ? "match" : "do not match");CHKERRQ(ierr);
+  ierr = AdolcJacobianDestroy(adctx2);CHKERRQ(ierr);
+  ierr = PetscFree(adctx2);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
 int main(int argc,char **argv)
 {
   TS             ts;                    /* ODE integrator */
@@ -57,12 +127,9 @@ int main(int argc,char **argv)
   DM             da;
   AppCtx         appctx;
   AdolcCtx       *adctx;
-  PetscInt       gxs,gys,gxm,gym,i,dofs = 2,ctrl[3] = {0,0,0};
+  PetscInt       gxs,gys,gxm,gym,dofs = 2;
   AField         **u_a = NULL,**f_a = NULL,*u_c = NULL,*f_c = NULL;
-  PetscScalar    **Seed = NULL,**Rec = NULL,*u_vec;
-  unsigned int   **JP = NULL;
-  ISColoring     iscoloring;
-  PetscBool      byhand = PETSC_FALSE;
+  PetscBool      byhand = PETSC_FALSE,owned = PETSC_FALSE,reread = PETSC_FALSE;
   MPI_Comm       comm = MPI_COMM_WORLD;
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -74,9 +141,10 @@ int main(int argc,char **argv)
   adctx->zos = PETSC_FALSE;adctx->zos_view = PETSC_FALSE;adctx->no_an = PETSC_FALSE;adctx->sparse = PETSC_FALSE;adctx->sparse_view = PETSC_FALSE;adctx->sparse_view_done = PETSC_FALSE;
   ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_test_zos",&adctx->zos,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_test_zos_view",&adctx->zos_view,NULL);CHKERRQ(ierr);
-  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse",&adctx->sparse,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse_view",&adctx->sparse_view,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-jacobian_by_hand",&byhand,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_cache_reread",&reread,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_owned_only",&owned,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-no_annotation",&adctx->no_an,NULL);CHKERRQ(ierr);
   appctx.D1     = 8.0e-5;
   appctx.D2     = 4.0e-5;
@@ -126,6 +194,9 @@ int main(int argc,char **argv)
     ierr = DMDAGetGhostCorners(da,&gxs,&gys,NULL,&gxm,&gym,NULL);CHKERRQ(ierr);
     adctx->m = dofs*gxm*gym;  // Number of dependent variables
     adctx->n = dofs*gxm*gym;  // Number of independent variables
+    if (owned) {
+      ierr = AdolcSetOwnedDependents(da,adctx);CHKERRQ(ierr);  // Only owned points are dependent
+    }
 
     // Create contiguous 1-arrays of AFields
     u_c = new AField[gxm*gym];
@@ -149,57 +220,16 @@ int main(int argc,char **argv)
     ierr = RHSFunctionActive(ts,1.0,x,r,&appctx);CHKERRQ(ierr);
 
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-      In the case where ADOL-C generates the Jacobian in compressed format,
-      seed and recovery matrices are required. Since the sparsity structure
-      of the Jacobian does not change over the course of the time
-      integration, we can save computational effort by only generating
-      these objects once.
+      Compute the sparsity pattern and decide whether to generate the
+      Jacobian in compressed format. If so, seed matrix and recovery plan
+      are required. Since the sparsity structure of the Jacobian does not
+      change over the course of the time integration, we can save
+      computational effort by only generating these objects once.
        - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-    if (adctx->sparse) {
-
-      // Extract colouring
-      ierr = GetColoring(da,&iscoloring);CHKERRQ(ierr);
-      ierr = CountColors(iscoloring,&adctx->p);CHKERRQ(ierr);
-
-      // Generate sparsity pattern and create an associated colouring
-      ierr = PetscMalloc1(adctx->n,&u_vec);CHKERRQ(ierr);
-      JP = (unsigned int **) malloc(adctx->m*sizeof(unsigned int*));
-      printf("m = %d, n = %d\n",adctx->m,adctx->n);
-      jac_pat(1,adctx->m,adctx->n,u_vec,JP,ctrl);
-
-      ierr = DMGetSparsity(da,JP);CHKERRQ(ierr);
-
-      // TODO: Avoid need for adolc_sparse using the below
-      //ierr = GenerateSparsityPattern(iscoloring,JP);CHKERRQ(ierr);
-
-      if (adctx->sparse_view) {
-        ierr = PrintSparsity(comm,adctx->m,JP);CHKERRQ(ierr);
-      }
-
-      // Generate seed matrix
-      ierr = AdolcMalloc2(adctx->n,adctx->p,&Seed);CHKERRQ(ierr);
-      ierr = GenerateSeedMatrix(iscoloring,Seed);CHKERRQ(ierr);
-      ierr = ISColoringDestroy(&iscoloring);CHKERRQ(ierr);
-      if (adctx->sparse_view) {
-        ierr = PrintMat(comm,"Seed matrix:",adctx->n,adctx->p,Seed);CHKERRQ(ierr);
-      }
-
-      // Generate recovery matrix
-      ierr = AdolcMalloc2(adctx->m,adctx->p,&Rec);
-      ierr = GetRecoveryMatrix(Seed,JP,adctx->m,adctx->p,Rec);CHKERRQ(ierr);
-
-      // Store results and free workspace
-      adctx->Rec = Rec;
-      for (i=0;i<adctx->m;i++)
-        free(JP[i]);
-      free(JP);
-      ierr = PetscFree(u_vec);CHKERRQ(ierr);
-    } else {
-      adctx->p = adctx->n;
-      ierr = AdolcMalloc2(adctx->n,adctx->p,&Seed);CHKERRQ(ierr);
-      ierr = Identity(adctx->n,Seed);CHKERRQ(ierr);
+    ierr = AdolcJacobianSetUp(da,1,adctx);CHKERRQ(ierr);
+    if (reread) {
+      ierr = CheckCacheReadBack(da,adctx,owned,dofs*gxm*gym);CHKERRQ(ierr);
     }
-    adctx->Seed = Seed;
 
     /*
       Printing for ZOS test
@@ -243,9 +273,7 @@ int main(int argc,char **argv)
   ierr = VecDestroy(&x);CHKERRQ(ierr);
   ierr = TSDestroy(&ts);CHKERRQ(ierr);
   if (!adctx->no_an) {
-    if (adctx->sparse)
-      ierr = AdolcFree2(Rec);CHKERRQ(ierr);
-    ierr = AdolcFree2(Seed);CHKERRQ(ierr);
+    ierr = AdolcJacobianDestroy(adctx);CHKERRQ(ierr);
     f_a += gys;
     u_a += gys;
     delete[] f_a;
@@ -274,4 +302,51 @@ int main(int argc,char **argv)
       output_file: output/ex5_1.out
       timeoutfactor: 3
 
+   test:
+      suffix: sparse
+      nsize: {{1 2}}
+      args: -ts_monitor -ts_max_steps 5 -adolc_sparse
+      requires: double
+
+   test:
+      suffix: owned
+      nsize: {{1 2}}
+      args: -ts_monitor -ts_max_steps 5 -adolc_sparse -adolc_owned_only
+      requires: double
+
+   test:
+      suffix: tile
+      nsize: {{1 2}}
+      args: -ts_monitor -ts_max_steps 5 -adolc_sparse -adolc_coloring tile
+      requires: double
+
+   test:
+      suffix: seed_block
+      args: -ts_monitor -ts_max_steps 5 -adolc_sparse -adolc_sparse_mode forward -adolc_seed_block 4
+      requires: double
+
+   test:
+      suffix: baij
+      nsize: {{1 2}}
+      args: -ts_monitor -ts_max_steps 5 -adolc_sparse -dm_mat_type baij -adolc_coloring block
+      requires: double
+
+   test:
+      suffix: coo
+      nsize: {{1 2}}
+      args: -ts_monitor -ts_max_steps 5 -adolc_sparse -adolc_owned_only -adolc_coo
+      requires: double
+
+   test:
+      suffix: reverse
+      nsize: {{1 2}}
+      args: -ts_monitor -ts_max_steps 5 -adolc_sparse -adolc_sparse_mode reverse
+      requires: double
+
+   test:
+      suffix: cache
+      nsize: {{1 2}}
+      args: -ts_monitor -ts_max_steps 5 -adolc_sparse -adolc_cache ex5cache -adolc_cache_reread
+      requires: double
+
 TEST*/
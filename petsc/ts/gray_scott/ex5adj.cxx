@@ -32,12 +32,8 @@ int main(int argc,char **argv)
   AdolcCtx       *adctx;
   Vec            lambda[1];
   PetscBool      forwardonly=PETSC_FALSE,implicitform=PETSC_FALSE,byhand=PETSC_FALSE;
-  PetscInt       gxs,gys,gxm,gym,i,dofs = 2,ctrl[3] = {0,0,0};
+  PetscInt       gxs,gys,gxm,gym,dofs = 2;
   AField         **u_a = NULL,**f_a = NULL,*u_c = NULL,*f_c = NULL,**udot_a = NULL,*udot_c = NULL;
-  PetscScalar    **Seed = NULL,**Rec = NULL,*u_vec;
-  unsigned int   **JP = NULL;
-  ISColoring     iscoloring;
-  MPI_Comm       comm = MPI_COMM_WORLD;
 
   ierr = PetscInitialize(&argc,&argv,"petscoptions",help);if (ierr) return ierr;
   ierr = PetscNew(&adctx);CHKERRQ(ierr);
@@ -45,7 +41,6 @@ int main(int argc,char **argv)
   ierr = PetscOptionsGetBool(NULL,NULL,"-implicitform",&implicitform,NULL);CHKERRQ(ierr);
   appctx.aijpc = PETSC_FALSE,adctx->no_an = PETSC_FALSE,adctx->sparse = PETSC_FALSE,adctx->sparse_view = PETSC_FALSE;adctx->sparse_view_done = PETSC_FALSE;
   ierr = PetscOptionsGetBool(NULL,NULL,"-aijpc",&appctx.aijpc,NULL);CHKERRQ(ierr);
-  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse",&adctx->sparse,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse_view",&adctx->sparse_view,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-no_annotation",&adctx->no_an,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-jacobian_by_hand",&byhand,NULL);CHKERRQ(ierr);
@@ -133,7 +128,6 @@ int main(int argc,char **argv)
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
        Trace function(s) just once
      - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-    ierr = PetscMalloc1(adctx->n,&u_vec);CHKERRQ(ierr);
     if (!implicitform) {
       ierr = RHSFunctionActive(ts,1.0,x,r,&appctx);CHKERRQ(ierr);
     } else {
@@ -142,54 +136,13 @@ int main(int argc,char **argv)
     }
 
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-      In the case where ADOL-C generates the Jacobian in compressed format,
-      seed and recovery matrices are required. Since the sparsity structure
-      of the Jacobian does not change over the course of the time
-      integration, we can save computational effort by only generating
-      these objects once.
+      Compute the sparsity pattern and decide whether to generate the
+      Jacobian in compressed format. If so, seed matrix and recovery plan
+      are required. Since the sparsity structure of the Jacobian does not
+      change over the course of the time integration, we can save
+      computational effort by only generating these objects once.
        - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-    if (adctx->sparse) {
-
-      // Generate sparsity pattern
-      ierr = PetscMalloc1(adctx->n,&u_vec);CHKERRQ(ierr);
-      JP = (unsigned int **) malloc(adctx->m*sizeof(unsigned int*));
-      ierr = PetscLogEventBegin(adctx->event2,0,0,0,0);CHKERRQ(ierr);
-      jac_pat(1,adctx->m,adctx->n,u_vec,JP,ctrl);
-      ierr = PetscLogEventEnd(adctx->event2,0,0,0,0);CHKERRQ(ierr);
-      if (adctx->sparse_view) {
-        ierr = PrintSparsity(comm,adctx->m,JP);CHKERRQ(ierr);
-      }
-
-      // Extract coloring
-      ierr = PetscLogEventBegin(adctx->event3,0,0,0,0);CHKERRQ(ierr);
-      ierr = DMCreateColoring(da,IS_COLORING_LOCAL,&iscoloring);CHKERRQ(ierr);
-      ierr = ISColoringGetIS(iscoloring,&adctx->p,NULL);CHKERRQ(ierr);
-
-      // Generate seed matrix
-      ierr = AdolcMalloc2(adctx->n,adctx->p,&Seed);CHKERRQ(ierr);
-      ierr = GenerateSeedMatrix(iscoloring,Seed);CHKERRQ(ierr);
-      ierr = ISColoringDestroy(&iscoloring);CHKERRQ(ierr);
-      if (adctx->sparse_view) {
-        ierr = PrintMat(comm,"Seed matrix:",adctx->n,adctx->p,Seed);CHKERRQ(ierr);
-      }
-
-      // Generate recovery matrix
-      ierr = AdolcMalloc2(adctx->m,adctx->p,&Rec);CHKERRQ(ierr);
-      ierr = GetRecoveryMatrix(Seed,JP,adctx->m,adctx->p,Rec);CHKERRQ(ierr);
-      ierr = PetscLogEventEnd(adctx->event3,0,0,0,0);CHKERRQ(ierr);
-
-      // Store results and free workspace
-      adctx->Rec = Rec;
-      for (i=0;i<adctx->m;i++)
-        free(JP[i]);
-      free(JP);
-      ierr = PetscFree(u_vec);CHKERRQ(ierr);
-    } else {
-      adctx->p = adctx->n;
-      ierr = AdolcMalloc2(adctx->n,adctx->p,&Seed);CHKERRQ(ierr);
-      ierr = Identity(adctx->n,Seed);CHKERRQ(ierr);
-    }
-    adctx->Seed = Seed;
+    ierr = AdolcJacobianSetUp(da,1,adctx);CHKERRQ(ierr);
   }
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -270,9 +223,7 @@ int main(int argc,char **argv)
   ierr = VecDestroy(&x);CHKERRQ(ierr);
   ierr = TSDestroy(&ts);CHKERRQ(ierr);
   if (!adctx->no_an) {
-    if (adctx->sparse)
-      ierr = AdolcFree2(Rec);CHKERRQ(ierr);
-    ierr = AdolcFree2(Seed);CHKERRQ(ierr);
+    ierr = AdolcJacobianDestroy(adctx);CHKERRQ(ierr);
     udot_a += gys;
     f_a += gys;
     u_a += gys;
@@ -9,6 +9,9 @@ static char help[] = "Demonstrates automatic Jacobian generation using ADOL-C fo
   DMTSSetIFunctionLocal and DMTSSetIJacobianLocal.
 
   Credit for the non-AD implementation to Hong Zhang.
+
+  Use -adolc_owned_only to only mark owned points as dependent when tracing, so that ghost points
+  do not contribute rows to the compressed Jacobian.
 */
 
 #include <petscdm.h>
@@ -26,13 +29,9 @@ int main(int argc,char **argv)
   DM             da;
   AppCtx         appctx;
   AdolcCtx       *adctx;
-  PetscInt       gxs,gys,gxm,gym,dofs = 2,i,ctrl[3] = {0,0,0};
+  PetscInt       gxs,gys,gxm,gym,dofs = 2;
   AField         **u_a = NULL,**f_a = NULL,*u_c = NULL,*f_c = NULL,**udot_a = NULL,*udot_c = NULL;
-  PetscScalar    **Seed = NULL,**Rec = NULL,*u_vec;
-  unsigned int   **JP = NULL;
-  ISColoring     iscoloring;
-  PetscBool      byhand = PETSC_FALSE;
-  MPI_Comm       comm = MPI_COMM_WORLD;
+  PetscBool      byhand = PETSC_FALSE,owned = PETSC_FALSE;
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      Initialize program
@@ -41,9 +40,9 @@ int main(int argc,char **argv)
   PetscFunctionBeginUser;
   ierr = PetscNew(&adctx);CHKERRQ(ierr);
   adctx->no_an = PETSC_FALSE;adctx->sparse = PETSC_FALSE;adctx->sparse_view = PETSC_FALSE;adctx->sparse_view_done = PETSC_FALSE;
-  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse",&adctx->sparse,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse_view",&adctx->sparse_view,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-jacobian_by_hand",&byhand,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_owned_only",&owned,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-no_annotation",&adctx->no_an,NULL);CHKERRQ(ierr);
   appctx.D1    = 8.0e-5;
   appctx.D2    = 4.0e-5;
@@ -101,6 +100,9 @@ int main(int argc,char **argv)
     ierr = DMDAGetGhostCorners(da,&gxs,&gys,NULL,&gxm,&gym,NULL);CHKERRQ(ierr);
     adctx->m = dofs*gxm*gym;  // Number of dependent variables
     adctx->n = dofs*gxm*gym;  // Number of independent variables
+    if (owned) {
+      ierr = AdolcSetOwnedDependents(da,adctx);CHKERRQ(ierr);  // Only owned points are dependent
+    }
 
     // Create contiguous 1-arrays of AFields
     u_c = new AField[gxm*gym];
@@ -129,50 +131,13 @@ int main(int argc,char **argv)
     ierr = IFunction2(ts,0.,x,xdot,r,&appctx);CHKERRQ(ierr);
 
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-      In the case where ADOL-C generates the Jacobian in compressed format,
-      seed and recovery matrices are required. Since the sparsity structure
-      of the Jacobian does not change over the course of the time
-      integration, we can save computational effort by only generating
-      these objects once.
+      Compute the sparsity pattern and decide whether to generate the
+      Jacobian in compressed format. If so, seed matrix and recovery plan
+      are required. Since the sparsity structure of the Jacobian does not
+      change over the course of the time integration, we can save
+      computational effort by only generating these objects once.
        - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-    if (adctx->sparse) { // TODO: Different sparsity patterns for x and xdot
-
-      // Generate sparsity pattern and create an associated colouring
-      ierr = PetscMalloc1(adctx->n,&u_vec);CHKERRQ(ierr);
-      JP = (unsigned int **) malloc(adctx->m*sizeof(unsigned int*));
-      jac_pat(1,adctx->m,adctx->n,u_vec,JP,ctrl);
-      if (adctx->sparse_view) {
-        ierr = PrintSparsity(comm,adctx->m,JP);CHKERRQ(ierr);
-      }
-
-      // Extract colouring
-      ierr = GetColoring(da,&iscoloring);CHKERRQ(ierr);
-      ierr = CountColors(iscoloring,&adctx->p);CHKERRQ(ierr);
-
-      // Generate seed matrix
-      ierr = AdolcMalloc2(adctx->n,adctx->p,&Seed);CHKERRQ(ierr);
-      ierr = GenerateSeedMatrix(iscoloring,Seed);CHKERRQ(ierr);
-      ierr = ISColoringDestroy(&iscoloring);CHKERRQ(ierr);
-      if (adctx->sparse_view) {
-        ierr = PrintMat(comm,"Seed matrix:",adctx->n,adctx->p,Seed);CHKERRQ(ierr);
-      }
-
-      // Generate recovery matrix
-      ierr = AdolcMalloc2(adctx->m,adctx->p,&Rec);CHKERRQ(ierr);
-      ierr = GetRecoveryMatrix(Seed,JP,adctx->m,adctx->p,Rec);CHKERRQ(ierr);
-
-      // Store results and free workspace
-      adctx->Rec = Rec;
-      for (i=0;i<adctx->m;i++)
-        free(JP[i]);
-      free(JP);
-      ierr = PetscFree(u_vec);CHKERRQ(ierr);
-    } else {
-      adctx->p = adctx->n;
-      ierr = AdolcMalloc2(adctx->n,adctx->p,&Seed);CHKERRQ(ierr);
-      ierr = Identity(adctx->n,Seed);CHKERRQ(ierr);
-    }
-    adctx->Seed = Seed;
+    ierr = AdolcJacobianSetUp(da,1,adctx);CHKERRQ(ierr);
   }
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -211,9 +176,7 @@ int main(int argc,char **argv)
   ierr = VecDestroy(&x);CHKERRQ(ierr);
   ierr = TSDestroy(&ts);CHKERRQ(ierr);
   if (!adctx->no_an) {
-    if (adctx->sparse)
-      ierr = AdolcFree2(Rec);CHKERRQ(ierr);
-    ierr = AdolcFree2(Seed);CHKERRQ(ierr);
+    ierr = AdolcJacobianDestroy(adctx);CHKERRQ(ierr);
     udot_a += gys;
     f_a += gys;
     u_a += gys;
@@ -9,7 +9,12 @@ static char help[] = "Demonstrates automatic, matrix-free Jacobian generation us
   using DMTSSetIFunctionLocal. The Jacobian is generated matrix-free using JacobianVectorProduct,
   which overloads the MatMult operation. For the adjoint solve, the Jacobian transpose is generated
   matrix-free using JacobianTransposeVectorProduct. The function IJacobian acts to pass TS context
-  information to the matrix-free context.
+  information to the matrix-free context. With -adolc_fused, JacobianVectorProductFused is used
+  instead, which applies the implicit Jacobian in a single forward sweep of a tape in both u and
+  udot. With -adolc_matmult_check <k>, the block products used by MatMatMult and
+  MatTransposeMatMult are checked against k separate products, once the solve is complete. Since
+  the block products always use the two tapes, combining the two options also checks the fused
+  product.
 */
 
 #include <petscsys.h>
@@ -30,9 +35,13 @@ int main(int argc,char **argv)
   MatCtx         matctx;              /* Matrix (free) context */
   AdolcCtx       *adctx;
   Vec            lambda[1];
-  PetscBool      forwardonly=PETSC_FALSE;
+  PetscBool      forwardonly=PETSC_FALSE,fused=PETSC_FALSE,jacobi;
+  SNES           snes;
+  KSP            ksp;
+  PC             pc;
   Mat            A;                   /* (Matrix free) Jacobian matrix */
-  PetscInt       gys,gxm,gym;
+  PetscInt       gys,gxm,gym,kcheck = 0;
+  PetscReal      err;
   AField         **u_a = NULL,**f_a = NULL,**udot_a = NULL,*u_c = NULL,*f_c = NULL,*udot_c = NULL;
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -40,6 +49,8 @@ int main(int argc,char **argv)
      - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
   ierr = PetscInitialize(&argc,&argv,"petscoptions",help);if (ierr) return ierr;
   ierr = PetscOptionsGetBool(NULL,NULL,"-forwardonly",&forwardonly,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_fused",&fused,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetInt(NULL,NULL,"-adolc_matmult_check",&kcheck,NULL);CHKERRQ(ierr);
   PetscFunctionBeginUser;
   appctx.D1     = 8.0e-5;
   appctx.D2     = 4.0e-5;
@@ -74,6 +85,10 @@ int main(int argc,char **argv)
   ierr = MatShellSetContext(A,&matctx);CHKERRQ(ierr);
   ierr = MatShellSetOperation(A,MATOP_MULT,(void (*)(void))JacobianVectorProductIDMass);CHKERRQ(ierr);
   ierr = MatShellSetOperation(A,MATOP_MULT_TRANSPOSE,(void (*)(void))JacobianTransposeVectorProductIDMass);CHKERRQ(ierr);
+#if PETSC_VERSION_GE(3,14,0)
+  ierr = MatShellSetMatProductOperation(A,MATPRODUCT_AB,NULL,JacobianMatMultIDMass,NULL,MATDENSE,MATDENSE);CHKERRQ(ierr);
+  ierr = MatShellSetMatProductOperation(A,MATPRODUCT_AtB,NULL,JacobianTransposeMatMultIDMass,NULL,MATDENSE,MATDENSE);CHKERRQ(ierr);
+#endif
   ierr = VecDuplicate(x,&matctx.X);CHKERRQ(ierr);
   ierr = VecDuplicate(x,&matctx.Xdot);CHKERRQ(ierr);
   ierr = DMGetLocalVector(da,&matctx.localX0);CHKERRQ(ierr);
@@ -99,11 +114,9 @@ int main(int argc,char **argv)
           It is also important to deconstruct and free memory appropriately.
      - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
   ierr = DMDAGetGhostCorners(da,NULL,&gys,NULL,&gxm,&gym,NULL);CHKERRQ(ierr);
-  matctx.m = 2*gxm*gym;
-  matctx.n = 2*gxm*gym;
-  matctx.flg = PETSC_FALSE;
   matctx.tag1 = 1;
   matctx.tag2 = 2;
+  ierr = MatFreeSetUp(da,&matctx);CHKERRQ(ierr);
 
   // Create contiguous 1-arrays of AFields
   u_c = new AField[gxm*gym];
@@ -132,7 +145,17 @@ int main(int argc,char **argv)
   adctx->no_an = PETSC_FALSE;appctx.adctx = adctx;
   ierr = IFunction(ts,1.,x,matctx.Xdot,r,&appctx);CHKERRQ(ierr);
   ierr = IFunction2(ts,1.,x,matctx.Xdot,r,&appctx);CHKERRQ(ierr);
-  ierr = PetscFree(adctx);CHKERRQ(ierr);
+
+  /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     Optionally also trace a single tape in both u and udot, so that each
+     Jacobian vector product takes one forward sweep rather than two. This
+     applies to a general mass matrix, so replaces the identity mass one.
+   - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  if (fused) {
+    ierr = IFunctionFused(ts,1.,x,matctx.Xdot,r,&appctx);CHKERRQ(ierr);
+    ierr = MatFreeFusedSetUp(3,&matctx);CHKERRQ(ierr);
+    ierr = MatShellSetOperation(A,MATOP_MULT,(void (*)(void))JacobianVectorProductFused);CHKERRQ(ierr);
+  }
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      Set Jacobian. In this case, IJacobian simply acts to pass context
@@ -161,10 +184,39 @@ int main(int argc,char **argv)
   ierr = TSSetExactFinalTime(ts,TS_EXACTFINALTIME_STEPOVER);CHKERRQ(ierr);
   ierr = TSSetFromOptions(ts);CHKERRQ(ierr);
 
+  /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     If Jacobi preconditioning is used (-pc_type jacobi), colour for
+     Jacobian diagonal recovery just once, so that the diagonal is
+     available at a fraction of the cost of the full Jacobian.
+   - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  ierr = TSGetSNES(ts,&snes);CHKERRQ(ierr);
+  ierr = SNESGetKSP(snes,&ksp);CHKERRQ(ierr);
+  ierr = KSPGetPC(ksp,&pc);CHKERRQ(ierr);
+  ierr = PetscObjectTypeCompare((PetscObject)pc,PCJACOBI,&jacobi);CHKERRQ(ierr);
+  matctx.adctx = adctx;
+  if (jacobi) {
+    adctx->m = matctx.m;
+    adctx->n = matctx.n;
+    ierr = AdolcDiagonalSetUp(matctx.tag1,-1,adctx);CHKERRQ(ierr);
+    ierr = MatShellSetOperation(A,MATOP_GET_DIAGONAL,(void (*)(void))JacobianDiagonalIDMass);CHKERRQ(ierr);
+  }
+
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      Solve ODE system
      - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
   ierr = TSSolve(ts,x);CHKERRQ(ierr);
+  if (kcheck > 0) {
+#if PETSC_VERSION_GE(3,14,0)
+    ierr = MatFreeCheckBlock(A,kcheck,&err);CHKERRQ(ierr);
+    if (err > 1.e-10) {
+      ierr = PetscPrintf(PETSC_COMM_WORLD,"Block and column-wise Jacobian products differ by %g\n",(double)err);CHKERRQ(ierr);
+    } else {
+      ierr = PetscPrintf(PETSC_COMM_WORLD,"Block and column-wise Jacobian products agree\n");CHKERRQ(ierr);
+    }
+#else
+    SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"Block Jacobian products require PETSc 3.14 or later");
+#endif
+  }
   if (!forwardonly) {
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
        Start the Adjoint model
@@ -185,6 +237,9 @@ int main(int argc,char **argv)
   ierr = VecDestroy(&r);CHKERRQ(ierr);
   ierr = VecDestroy(&matctx.X);CHKERRQ(ierr);
   ierr = VecDestroy(&matctx.Xdot);CHKERRQ(ierr);
+  ierr = MatFreeDestroy(&matctx);CHKERRQ(ierr);
+  ierr = AdolcJacobianDestroy(adctx);CHKERRQ(ierr);
+  ierr = PetscFree(adctx);CHKERRQ(ierr);
   ierr = MatDestroy(&A);CHKERRQ(ierr);
   ierr = VecDestroy(&x);CHKERRQ(ierr);
   ierr = TSDestroy(&ts);CHKERRQ(ierr);
@@ -202,3 +257,25 @@ int main(int argc,char **argv)
   ierr = PetscFinalize();
   return ierr;
 }
+
+/*TEST
+
+   test:
+      suffix: matmult_check
+      nsize: {{1 2}}
+      args: -forwardonly -ts_max_steps 2 -adolc_matmult_check 4
+      requires: double
+
+   test:
+      suffix: fused
+      nsize: {{1 2}}
+      args: -forwardonly -ts_max_steps 2 -adolc_fused -adolc_matmult_check 4
+      requires: double
+
+   test:
+      suffix: jacobi
+      nsize: {{1 2}}
+      args: -forwardonly -ts_max_steps 2 -ts_monitor -pc_type jacobi
+      requires: double
+
+TEST*/
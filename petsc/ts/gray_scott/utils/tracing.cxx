@@ -6,7 +6,7 @@ PetscErrorCode TestZOS2d(DM da,Field **f,Field **u,void *ctx)
 {
   AppCtx         *appctx = (AppCtx*)ctx;
   PetscErrorCode ierr;
-  PetscInt       gxs,gys,gxm,gym,i,j,k = 0;
+  PetscInt       gxs,gys,gxm,gym,xs,ys,xm,ym,i,j,k = 0;
   PetscScalar    diff = 0,norm = 0,*u_vec,*fz;
   MPI_Comm       comm = MPI_COMM_WORLD;
 
@@ -24,11 +24,18 @@ PetscErrorCode TestZOS2d(DM da,Field **f,Field **u,void *ctx)
   }
   k = 0;
 
+  /* Dependents are either the owned points or the whole local patch */
+  if (appctx->adctx->rows) {
+    ierr = DMDAGetCorners(da,&xs,&ys,NULL,&xm,&ym,NULL);CHKERRQ(ierr);
+  } else {
+    xs = gxs;ys = gys;xm = gxm;ym = gym;
+  }
+
   /* Zero order scalar evaluation vs. calling RHS function */
   ierr = PetscMalloc1(appctx->adctx->m,&fz);CHKERRQ(ierr);
   zos_forward(1,appctx->adctx->m,appctx->adctx->n,0,u_vec,fz);
-  for (j=gys; j<gys+gym; j++) {
-    for (i=gxs; i<gxs+gxm; i++) {
+  for (j=ys; j<ys+ym; j++) {
+    for (i=xs; i<xs+xm; i++) {
       if ((appctx->adctx->zos_view) && ((fabs(f[j][i].u) > 1.e-16) || (fabs(fz[k]) > 1.e-16)))
         PetscPrintf(comm,"(%2d,%2d, u): F_rhs = %+.4e, F_zos = %+.4e\n",j,i,f[j][i].u,fz[k]);
       diff += (f[j][i].u-fz[k])*(f[j][i].u-fz[k]);k++;
@@ -129,17 +136,29 @@ PetscErrorCode IFunctionLocalActive(DMDALocalInfo *info,PetscReal t,Field**u,Fie
 
   /*
     Mark dependence
+
+    NOTE: If a row map is set (see AdolcSetOwnedDependents) then only owned points are marked as
+          dependent, since the corresponding Jacobian rows of ghost points are empty.
   */
-  for (j=gys; j<gys+gym; j++) {
-    for (i=gxs; i<gxs+gxm; i++) {
-      if ((i < xs) || (i >= xs+xm) || (j < ys) || (j >= ys+ym)) {
-        f_a[j][i].u >>= dummy;
-        f_a[j][i].v >>= dummy;
-      } else {
+  if (appctx->adctx->rows) {
+    for (j=ys; j<ys+ym; j++) {
+      for (i=xs; i<xs+xm; i++) {
         f_a[j][i].u >>= f[j][i].u;
         f_a[j][i].v >>= f[j][i].v;
       }
     }
+  } else {
+    for (j=gys; j<gys+gym; j++) {
+      for (i=gxs; i<gxs+gxm; i++) {
+        if ((i < xs) || (i >= xs+xm) || (j < ys) || (j >= ys+ym)) {
+          f_a[j][i].u >>= dummy;
+          f_a[j][i].v >>= dummy;
+        } else {
+          f_a[j][i].u >>= f[j][i].u;
+          f_a[j][i].v >>= f[j][i].v;
+        }
+      }
+    }
   }
   trace_off();  // ----------------------------------------------- End of active section
   ierr = PetscLogFlops(16*xm*ym);CHKERRQ(ierr);
@@ -195,17 +214,114 @@ PetscErrorCode IFunctionLocalActive2(DMDALocalInfo *info,PetscReal t,Field**u,Fi
 
   /*
     Mark dependence
+
+    NOTE: If a row map is set (see AdolcSetOwnedDependents) then only owned points are marked as
+          dependent, since the corresponding Jacobian rows of ghost points are empty.
+  */
+  if (appctx->adctx->rows) {
+    for (j=ys; j<ys+ym; j++) {
+      for (i=xs; i<xs+xm; i++) {
+        f_a[j][i].u >>= f[j][i].u;
+        f_a[j][i].v >>= f[j][i].v;
+      }
+    }
+  } else {
+    for (j=gys; j<gys+gym; j++) {
+      for (i=gxs; i<gxs+gxm; i++) {
+        if ((i < xs) || (i >= xs+xm) || (j < ys) || (j >= ys+ym)) {
+          f_a[j][i].u >>= dummy;
+          f_a[j][i].v >>= dummy;
+        } else {
+          f_a[j][i].u >>= f[j][i].u;
+          f_a[j][i].v >>= f[j][i].v;
+        }
+      }
+    }
+  }
+  trace_off();  // ----------------------------------------------- End of active section
+  ierr = PetscLogFlops(16*xm*ym);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+PetscErrorCode IFunctionLocalActiveFused(DMDALocalInfo *info,PetscReal t,Field**u,Field**udot,Field**f,void *ptr)
+{
+  AppCtx         *appctx = (AppCtx*)ptr;
+  PetscInt       i,j,xs,ys,xm,ym,gxs,gys,gxm,gym;
+  PetscReal      hx,hy,sx,sy;
+  adouble        uc,uxx,uyy,vc,vxx,vyy;
+  PetscErrorCode ierr;
+  AField         **f_a = appctx->f_a,**u_a = appctx->u_a,**udot_a = appctx->udot_a;
+  PetscScalar    dummy;
+
+  PetscFunctionBegin;
+  hx = 2.50/(PetscReal)(info->mx); sx = 1.0/(hx*hx);
+  hy = 2.50/(PetscReal)(info->my); sy = 1.0/(hy*hy);
+  xs = info->xs; xm = info->xm; gxs = info->gxs; gxm = info->gxm;
+  ys = info->ys; ym = info->ym; gys = info->gys; gym = info->gym;
+
+  trace_on(3);  // ----------------------------------------------- Start of active section
+
+  /*
+    Mark independence, first of the state and then of its time derivative, so that a single
+    forward sweep with seed (x1,a*x1) gives the implicit Jacobian vector product
+
+    NOTE: Ghost points are marked as independent, in place of the points they represent on
+          other processors / on other boundaries.
   */
   for (j=gys; j<gys+gym; j++) {
     for (i=gxs; i<gxs+gxm; i++) {
-      if ((i < xs) || (i >= xs+xm) || (j < ys) || (j >= ys+ym)) {
-        f_a[j][i].u >>= dummy;
-        f_a[j][i].v >>= dummy;
-      } else {
+      u_a[j][i].u <<= u[j][i].u;
+      u_a[j][i].v <<= u[j][i].v;
+    }
+  }
+  for (j=gys; j<gys+gym; j++) {
+    for (i=gxs; i<gxs+gxm; i++) {
+      udot_a[j][i].u <<= udot[j][i].u;
+      udot_a[j][i].v <<= udot[j][i].v;
+    }
+  }
+
+  /*
+     Compute function over the locally owned part of the grid
+  */
+  for (j=ys; j<ys+ym; j++) {
+    for (i=xs; i<xs+xm; i++) {
+      uc        = u_a[j][i].u;
+      uxx       = (-2.0*uc + u_a[j][i-1].u + u_a[j][i+1].u)*sx;
+      uyy       = (-2.0*uc + u_a[j-1][i].u + u_a[j+1][i].u)*sy;
+      vc        = u_a[j][i].v;
+      vxx       = (-2.0*vc + u_a[j][i-1].v + u_a[j][i+1].v)*sx;
+      vyy       = (-2.0*vc + u_a[j-1][i].v + u_a[j+1][i].v)*sy;
+      f_a[j][i].u = udot_a[j][i].u - appctx->D1*(uxx + uyy) + uc*vc*vc - appctx->gamma*(1.0 - uc);
+      f_a[j][i].v = udot_a[j][i].v - appctx->D2*(vxx + vyy) - uc*vc*vc + (appctx->gamma + appctx->kappa)*vc;
+    }
+  }
+
+  /*
+    Mark dependence
+
+    NOTE: If a row map is set (see AdolcSetOwnedDependents) then only owned points are marked as
+          dependent, since the corresponding Jacobian rows of ghost points are empty.
+  */
+  if (appctx->adctx->rows) {
+    for (j=ys; j<ys+ym; j++) {
+      for (i=xs; i<xs+xm; i++) {
         f_a[j][i].u >>= f[j][i].u;
         f_a[j][i].v >>= f[j][i].v;
       }
     }
+  } else {
+    for (j=gys; j<gys+gym; j++) {
+      for (i=gxs; i<gxs+gxm; i++) {
+        if ((i < xs) || (i >= xs+xm) || (j < ys) || (j >= ys+ym)) {
+          f_a[j][i].u >>= dummy;
+          f_a[j][i].v >>= dummy;
+        } else {
+          f_a[j][i].u >>= f[j][i].u;
+          f_a[j][i].v >>= f[j][i].v;
+        }
+      }
+    }
   }
   trace_off();  // ----------------------------------------------- End of active section
   ierr = PetscLogFlops(16*xm*ym);CHKERRQ(ierr);
@@ -307,6 +423,57 @@ PetscErrorCode IFunction2(TS ts,PetscReal ftime,Vec U,Vec Udot,Vec F,void *ptr)
   PetscFunctionReturn(0);
 }
 
+PetscErrorCode IFunctionFused(TS ts,PetscReal ftime,Vec U,Vec Udot,Vec F,void *ptr)
+{
+  AppCtx         *appctx = (AppCtx*)ptr;
+  DM             da;
+  DMDALocalInfo  info;
+  PetscErrorCode ierr;
+  Field          **u,**f,**udot;
+  Vec            localU,localUdot;
+
+  PetscFunctionBegin;
+
+  ierr = TSGetDM(ts,&da);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(da,&localU);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(da,&localUdot);CHKERRQ(ierr);
+
+  /*
+     Scatter ghost points to local vector,using the 2-step process
+        DMGlobalToLocalBegin(),DMGlobalToLocalEnd().
+     By placing code between these two statements, computations can be
+     done while messages are in transition.
+  */
+  ierr = DMGlobalToLocalBegin(da,U,INSERT_VALUES,localU);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd(da,U,INSERT_VALUES,localU);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalBegin(da,Udot,INSERT_VALUES,localUdot);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd(da,Udot,INSERT_VALUES,localUdot);CHKERRQ(ierr);
+
+  /*
+     Get pointers to vector data
+  */
+  ierr = DMDAVecGetArrayRead(da,localU,&u);CHKERRQ(ierr);
+  ierr = DMDAVecGetArray(da,F,&f);CHKERRQ(ierr);
+  ierr = DMDAVecGetArrayRead(da,localUdot,&udot);CHKERRQ(ierr);
+
+  if (!appctx->adctx->no_an) {
+    ierr = IFunctionLocalActiveFused(&info,ftime,u,udot,f,appctx);CHKERRQ(ierr);
+  } else {
+    ierr = IFunctionLocalPassive(&info,ftime,u,udot,f,appctx);CHKERRQ(ierr);
+  }
+
+  /*
+     Restore vectors
+  */
+  ierr = DMDAVecRestoreArray(da,F,&f);CHKERRQ(ierr);
+  ierr = DMDAVecRestoreArrayRead(da,localU,&u);CHKERRQ(ierr);
+  ierr = DMDAVecRestoreArrayRead(da,localUdot,&udot);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(da,&localUdot);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(da,&localU);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
 /* ------------------------------------------------------------------- */
 /*
    RHSFunction - Evaluates nonlinear function, F(x).
@@ -482,13 +649,22 @@ PetscErrorCode RHSFunctionActive(TS ts,PetscReal ftime,Vec U,Vec F,void *ptr)
   /*
     Mark dependence
 
-    NOTE: Ghost points are marked as dependent in order to vastly simplify index notation
-          during Jacobian assembly.
+    NOTE: Unless a row map is set (see AdolcSetOwnedDependents), ghost points are marked as
+          dependent in order to vastly simplify index notation during Jacobian assembly.
   */
-  for (j=gys; j<gys+gym; j++) {
-    for (i=gxs; i<gxs+gxm; i++) {
-      f_a[j][i].u >>= f[j][i].u;
-      f_a[j][i].v >>= f[j][i].v;
+  if (appctx->adctx->rows) {
+    for (j=ys; j<ys+ym; j++) {
+      for (i=xs; i<xs+xm; i++) {
+        f_a[j][i].u >>= f[j][i].u;
+        f_a[j][i].v >>= f[j][i].v;
+      }
+    }
+  } else {
+    for (j=gys; j<gys+gym; j++) {
+      for (i=gxs; i<gxs+gxm; i++) {
+        f_a[j][i].u >>= f[j][i].u;
+        f_a[j][i].v >>= f[j][i].v;
+      }
     }
   }
   trace_off();  // ----------------------------------------------- End of active section
@@ -43,8 +43,8 @@ in current balance form using rectangular coordiantes.\n\n";
 #include <petscdmda.h>
 #include <petscdmcomposite.h>
 #include <adolc/adolc.h>
-#include "utils/monitor.cxx"
 #include "utils/jacobian.cxx"
+#include "utils/monitor.cxx"
 
 
 int main(int argc,char **argv)
@@ -81,7 +81,6 @@ int main(int argc,char **argv)
   user.adctx = adctx;
   adctx->m = user.neqs_pgrid;
   adctx->n = user.neqs_pgrid;
-  adctx->p = user.neqs_pgrid;
 
   /* Create indices for differential and algebraic equations */
   ierr = PetscMalloc1(7*ngen,&idx2);CHKERRQ(ierr);
@@ -130,6 +129,10 @@ int main(int argc,char **argv)
     user.no_an     = PETSC_FALSE;
     ierr           = PetscOptionsBool("-no_annotation","","",user.no_an,&user.no_an,NULL);CHKERRQ(ierr);
     ierr           = PetscOptionsBool("-jacobian_by_hand","","",byhand,&byhand,NULL);CHKERRQ(ierr);
+    user.network_by_hand = PETSC_FALSE;
+    ierr           = PetscOptionsBool("-adolc_network_by_hand","","",user.network_by_hand,&user.network_by_hand,NULL);CHKERRQ(ierr);
+    user.jacobian_check = PETSC_FALSE;
+    ierr           = PetscOptionsBool("-adolc_jacobian_check","Compare ADOL-C and hand-coded Jacobians","",user.jacobian_check,&user.jacobian_check,NULL);CHKERRQ(ierr);
   }
   ierr = PetscOptionsEnd();CHKERRQ(ierr);
 
@@ -198,6 +201,17 @@ int main(int argc,char **argv)
       ierr = IFunctionActive(ts,0.,X,Xdot,R,&user);CHKERRQ(ierr);
     }
     ierr = VecDestroy(&R);CHKERRQ(ierr);
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+       Generate the sparsity pattern, colouring and recovery plans. The
+       network block couples all buses, so the pattern of the combined
+       system benefits from compression from both sides.
+       - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+    if (user.semiexplicit) {
+      ierr = AdolcJacobianSetUp(NULL,1,adctx);CHKERRQ(ierr);
+    } else {
+      ierr = AdolcIJacobianSetUp(NULL,1,2,adctx);CHKERRQ(ierr);
+    }
   }
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -348,6 +362,9 @@ int main(int argc,char **argv)
   if(user.setisdiff) {
     ierr = VecDestroy(&vatol);CHKERRQ(ierr);
   }
+  if (!user.no_an) {
+    ierr = AdolcJacobianDestroy(adctx);CHKERRQ(ierr);
+  }
   ierr = PetscFree(adctx);CHKERRQ(ierr);
   ierr = PetscFinalize();
   return ierr;
@@ -373,4 +390,14 @@ int main(int argc,char **argv)
       args: -ts_monitor -snes_monitor_short -ts_type arkimex
       localrunfiles: petscoptions X.bin Ybus.bin
 
+   test:
+      suffix: network_by_hand
+      args: -ts_monitor -snes_monitor_short -adolc_network_by_hand -adolc_jacobian_check
+      localrunfiles: petscoptions X.bin Ybus.bin
+
+   test:
+      suffix: traced_check
+      args: -ts_monitor -snes_monitor_short -adolc_sparse -adolc_sparse_mode {{auto bidirectional}} -adolc_jacobian_check
+      localrunfiles: petscoptions X.bin Ybus.bin
+
 TEST*/
@@ -53,7 +53,6 @@ int main(int argc,char **argv)
   user.adctx = adctx;
   adctx->m = user.neqs_pgrid;
   adctx->n = user.neqs_pgrid;
-  adctx->p = user.neqs_pgrid;
 
   /* Create indices for differential and algebraic equations */
   ierr = PetscMalloc1(7*ngen,&idx2);CHKERRQ(ierr);
@@ -98,6 +97,8 @@ int main(int argc,char **argv)
     user.no_an     = PETSC_FALSE;
     ierr           = PetscOptionsBool("-no_annotation","","",user.no_an,&user.no_an,NULL);CHKERRQ(ierr);
     ierr           = PetscOptionsBool("-jacobian_by_hand","","",byhand,&byhand,NULL);CHKERRQ(ierr);
+    user.network_by_hand = PETSC_FALSE;
+    ierr           = PetscOptionsBool("-adolc_network_by_hand","","",user.network_by_hand,&user.network_by_hand,NULL);CHKERRQ(ierr);
   }
   ierr = PetscOptionsEnd();CHKERRQ(ierr);
 
@@ -159,6 +160,11 @@ int main(int argc,char **argv)
     ierr = VecDuplicate(X,&R);CHKERRQ(ierr);
     ierr = IFunctionActive(ts,0.,X,Xdot,R,&user);CHKERRQ(ierr);
     ierr = VecDestroy(&R);CHKERRQ(ierr);
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+       Generate the sparsity pattern, colouring and recovery plans
+       - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+    ierr = AdolcIJacobianSetUp(NULL,1,2,adctx);CHKERRQ(ierr);
   }
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -220,6 +226,7 @@ int main(int argc,char **argv)
 
   ierr = MatAssemblyBegin(user.Ybus,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
   ierr = MatAssemblyEnd(user.Ybus,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  ierr = RetraceNetwork(X,&user);CHKERRQ(ierr);
 
   user.alg_flg = PETSC_TRUE;
   /* Solve the algebraic equations */
@@ -242,6 +249,7 @@ int main(int argc,char **argv)
 
   ierr = MatAssemblyBegin(user.Ybus,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
   ierr = MatAssemblyEnd(user.Ybus,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  ierr = RetraceNetwork(X,&user);CHKERRQ(ierr);
 
   ierr = MatZeroEntries(J);CHKERRQ(ierr);
 
@@ -292,6 +300,9 @@ int main(int argc,char **argv)
   ierr = ISDestroy(&user.is_diff);CHKERRQ(ierr);
   ierr = ISDestroy(&user.is_alg);CHKERRQ(ierr);
   ierr = TSDestroy(&ts);CHKERRQ(ierr);
+  if (!user.no_an) {
+    ierr = AdolcJacobianDestroy(adctx);CHKERRQ(ierr);
+  }
   ierr = PetscFree(adctx);CHKERRQ(ierr);
   ierr = PetscFinalize();
   return ierr;
@@ -98,6 +98,8 @@ typedef struct {
 
   /* Additional members for ADOL-C implementation */
   PetscBool   no_an;
+  PetscBool   network_by_hand; /* Differentiate the Ybus block by hand, rather than tracing it */
+  PetscBool   jacobian_check;  /* Compare the ADOL-C Jacobian against the hand-coded one */
   adouble     *xgen_a,*xnet_a,*fgen_a,*fnet_a,*xdot_a;
   AdolcCtx    *adctx;
   PetscInt    m,n;
@@ -376,28 +376,33 @@ PetscErrorCode ResidualJacobianAdolc(Vec X,Mat J,Mat B,void *ctx)
   PetscFunctionBegin;
   ierr = MatSetOption(J,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_FALSE);CHKERRQ(ierr);
   ierr = VecGetArray(X,&x_vec);CHKERRQ(ierr);
+  /* The Ybus block is added to the traced entries below, so clear stale values
+     first, else repeated calls accumulate multiples of Ybus */
+  if (user->network_by_hand) {ierr = MatZeroEntries(J);CHKERRQ(ierr);}
   ierr = AdolcComputeRHSJacobian(1,J,x_vec,user->adctx);CHKERRQ(ierr);
 
-  // Manual differentiation of MatMult:
-
-  for (i=0; i<nbus; i++) {
-    ierr   = MatGetRow(user->Ybus,2*i,&ncols,&cols,&yvals);CHKERRQ(ierr);
-    row[0] = net_start + 2*i;
-    for (k=0; k<ncols; k++) {
-      col[k] = net_start + cols[k];
-      val[k] = yvals[k];
+  /* Manual differentiation of MatMult. By default, Y*V is traced so that its
+     contribution is already included by the driver above */
+  if (user->network_by_hand) {
+    for (i=0; i<nbus; i++) {
+      ierr   = MatGetRow(user->Ybus,2*i,&ncols,&cols,&yvals);CHKERRQ(ierr);
+      row[0] = net_start + 2*i;
+      for (k=0; k<ncols; k++) {
+        col[k] = net_start + cols[k];
+        val[k] = yvals[k];
+      }
+      ierr = MatSetValues(J,1,row,ncols,col,val,ADD_VALUES);CHKERRQ(ierr);
+      ierr = MatRestoreRow(user->Ybus,2*i,&ncols,&cols,&yvals);CHKERRQ(ierr);
+
+      ierr   = MatGetRow(user->Ybus,2*i+1,&ncols,&cols,&yvals);CHKERRQ(ierr);
+      row[0] = net_start + 2*i+1;
+      for (k=0; k<ncols; k++) {
+        col[k] = net_start + cols[k];
+        val[k] = yvals[k];
+      }
+      ierr = MatSetValues(J,1,row,ncols,col,val,ADD_VALUES);CHKERRQ(ierr);
+      ierr = MatRestoreRow(user->Ybus,2*i+1,&ncols,&cols,&yvals);CHKERRQ(ierr);
     }
-    ierr = MatSetValues(J,1,row,ncols,col,val,INSERT_VALUES);CHKERRQ(ierr);
-    ierr = MatRestoreRow(user->Ybus,2*i,&ncols,&cols,&yvals);CHKERRQ(ierr);
-
-    ierr   = MatGetRow(user->Ybus,2*i+1,&ncols,&cols,&yvals);CHKERRQ(ierr);
-    row[0] = net_start + 2*i+1;
-    for (k=0; k<ncols; k++) {
-      col[k] = net_start + cols[k];
-      val[k] = yvals[k];
-    }
-    ierr = MatSetValues(J,1,row,ncols,col,val,INSERT_VALUES);CHKERRQ(ierr);
-    ierr = MatRestoreRow(user->Ybus,2*i+1,&ncols,&cols,&yvals);CHKERRQ(ierr);
   }
   ierr = MatAssemblyBegin(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
   ierr = MatAssemblyEnd(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
@@ -435,34 +440,55 @@ PetscErrorCode IJacobianAdolc(TS ts,PetscReal t,Vec X,Vec Xdot,PetscReal a,Mat A
   ierr = VecCopy(X,Xcopy);CHKERRQ(ierr);        // Copy values over
   ierr = VecGetArray(Xcopy,&x_vec);CHKERRQ(ierr);
   ierr = MatSetOption(A,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_FALSE);CHKERRQ(ierr); // FIXME
+  /* The Ybus block is added to the traced entries below, so clear stale values
+     first, else repeated calls accumulate multiples of Ybus */
+  if (user->network_by_hand) {ierr = MatZeroEntries(A);CHKERRQ(ierr);}
   ierr = AdolcComputeIJacobian(1,2,A,x_vec,a,user->adctx);CHKERRQ(ierr);
 
-  // Manual differentiation of MatMult
-  // TODO: Trace with external and use that
-
-  for (i=0; i<nbus; i++) {
-    ierr   = MatGetRow(user->Ybus,2*i,&ncols,&cols,&yvals);CHKERRQ(ierr);
-    row[0] = net_start + 2*i;
-    for (k=0; k<ncols; k++) {
-      col[k] = net_start + cols[k];
-      val[k] = yvals[k];
-    }
-    ierr = MatSetValues(A,1,row,ncols,col,val,INSERT_VALUES);CHKERRQ(ierr);
-    ierr = MatRestoreRow(user->Ybus,2*i,&ncols,&cols,&yvals);CHKERRQ(ierr);
-
-    ierr   = MatGetRow(user->Ybus,2*i+1,&ncols,&cols,&yvals);CHKERRQ(ierr);
-    row[0] = net_start + 2*i+1;
-    for (k=0; k<ncols; k++) {
-      col[k] = net_start + cols[k];
-      val[k] = yvals[k];
+  /* Manual differentiation of MatMult. By default, Y*V is traced so that its
+     contribution is already included by the driver above */
+  if (user->network_by_hand) {
+    for (i=0; i<nbus; i++) {
+      ierr   = MatGetRow(user->Ybus,2*i,&ncols,&cols,&yvals);CHKERRQ(ierr);
+      row[0] = net_start + 2*i;
+      for (k=0; k<ncols; k++) {
+        col[k] = net_start + cols[k];
+        val[k] = yvals[k];
+      }
+      ierr = MatSetValues(A,1,row,ncols,col,val,ADD_VALUES);CHKERRQ(ierr);
+      ierr = MatRestoreRow(user->Ybus,2*i,&ncols,&cols,&yvals);CHKERRQ(ierr);
+
+      ierr   = MatGetRow(user->Ybus,2*i+1,&ncols,&cols,&yvals);CHKERRQ(ierr);
+      row[0] = net_start + 2*i+1;
+      for (k=0; k<ncols; k++) {
+        col[k] = net_start + cols[k];
+        val[k] = yvals[k];
+      }
+      ierr = MatSetValues(A,1,row,ncols,col,val,ADD_VALUES);CHKERRQ(ierr);
+      ierr = MatRestoreRow(user->Ybus,2*i+1,&ncols,&cols,&yvals);CHKERRQ(ierr);
     }
-    ierr = MatSetValues(A,1,row,ncols,col,val,INSERT_VALUES);CHKERRQ(ierr);
-    ierr = MatRestoreRow(user->Ybus,2*i+1,&ncols,&cols,&yvals);CHKERRQ(ierr);
   }
   ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
   ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
 
   ierr = VecRestoreArray(Xcopy,&x_vec);CHKERRQ(ierr);
   ierr = VecDestroy(&Xcopy);CHKERRQ(ierr);
+
+  /* Check agreement with the hand-coded Jacobian */
+  if (user->jacobian_check) {
+    Mat       Abh;
+    PetscReal nrm,nrmbh;
+
+    ierr = MatDuplicate(A,MAT_DO_NOT_COPY_VALUES,&Abh);CHKERRQ(ierr);
+    ierr = MatSetOption(Abh,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_FALSE);CHKERRQ(ierr);
+    ierr = IJacobianByHand(ts,t,X,Xdot,a,Abh,Abh,user);CHKERRQ(ierr);
+    ierr = MatNorm(Abh,NORM_FROBENIUS,&nrmbh);CHKERRQ(ierr);
+    ierr = MatAXPY(Abh,-1.0,A,DIFFERENT_NONZERO_PATTERN);CHKERRQ(ierr);
+    ierr = MatNorm(Abh,NORM_FROBENIUS,&nrm);CHKERRQ(ierr);
+    if (nrm > 1.e-8*nrmbh) {
+      ierr = PetscPrintf(PETSC_COMM_WORLD,"Jacobian mismatch at t = %g: ||J_adolc - J_byhand|| = %g\n",(double)t,(double)nrm);CHKERRQ(ierr);
+    }
+    ierr = MatDestroy(&Abh);CHKERRQ(ierr);
+  }
   PetscFunctionReturn(0);
 }
@@ -91,6 +91,7 @@ PetscErrorCode PostEventFunction(TS ts,PetscInt nevents,PetscInt event_list[],Pe
 
       ierr = MatAssemblyBegin(user->Ybus,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
       ierr = MatAssemblyEnd(user->Ybus,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+      ierr = RetraceNetwork(X,user);CHKERRQ(ierr);
 
       /* Solve the algebraic equations */
       ierr = SNESSolve(user->snes_alg,NULL,X);CHKERRQ(ierr);
@@ -105,6 +106,7 @@ PetscErrorCode PostEventFunction(TS ts,PetscInt nevents,PetscInt event_list[],Pe
 
       ierr = MatAssemblyBegin(user->Ybus,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
       ierr = MatAssemblyEnd(user->Ybus,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+      ierr = RetraceNetwork(X,user);CHKERRQ(ierr);
 
       /* Solve the algebraic equations */
       ierr = SNESSolve(user->snes_alg,NULL,X);CHKERRQ(ierr);
@@ -139,6 +139,9 @@ PetscErrorCode ResidualFunctionActive(SNES snes,Vec X, Vec F, Userctx *user)
   adouble        PD,QD,Vm0;
   PetscScalar    *v0;
   PetscInt       k;
+  PetscInt          ncols;
+  const PetscInt    *cols;
+  const PetscScalar *yvals;
   adouble        *xgen = user->xgen_a,*xnet = user->xnet_a,*fgen = user->fgen_a,*fnet = user->fnet_a;
 
   PetscFunctionBegin;
@@ -156,8 +159,6 @@ PetscErrorCode ResidualFunctionActive(SNES snes,Vec X, Vec F, Userctx *user)
      Thus imaginary current contribution goes in location 2*i, and
      real current contribution in 2*i+1
   */
-  ierr = MatMult(user->Ybus,Xnet,Fnet);CHKERRQ(ierr);
-
   ierr = VecGetArray(Xgen,&xgen_p);CHKERRQ(ierr);
   ierr = VecGetArray(Xnet,&xnet_p);CHKERRQ(ierr);
   ierr = VecGetArray(Fgen,&fgen_p);CHKERRQ(ierr);
@@ -171,6 +172,18 @@ PetscErrorCode ResidualFunctionActive(SNES snes,Vec X, Vec F, Userctx *user)
   for (i=0; i<user->neqs_net; i++)
     xnet[i] <<= xnet_p[i];
 
+  /* Network subsystem: Y*V. Unless differentiated by hand, this is traced so
+     that the Ybus block of the Jacobian is generated by ADOL-C, too */
+  for (i=0; i<user->neqs_net; i++) {
+    fnet[i] = 0.;
+    if (!user->network_by_hand) {
+      ierr = MatGetRow(user->Ybus,i,&ncols,&cols,&yvals);CHKERRQ(ierr);
+      for (k=0; k<ncols; k++)
+        fnet[i] += yvals[k]*xnet[cols[k]];
+      ierr = MatRestoreRow(user->Ybus,i,&ncols,&cols,&yvals);CHKERRQ(ierr);
+    }
+  }
+
   /* Generator subsystem */
   for (i=0; i < ngen; i++) {
     Eqp   = xgen[idx];
@@ -261,6 +274,28 @@ PetscErrorCode ResidualFunctionActive(SNES snes,Vec X, Vec F, Userctx *user)
   PetscFunctionReturn(0);
 }
 
+/*
+  Ybus is recorded on tape 1 as constant values, so the tape needs regenerating whenever
+  Ybus is modified, i.e. when a fault is applied or removed. The sparsity pattern does not
+  change, so the seed matrices and recovery plans generated at setup remain valid.
+
+  Input parameters:
+  X    - state vector to retrace at
+  user - user-defined application context
+*/
+PetscErrorCode RetraceNetwork(Vec X,Userctx *user)
+{
+  PetscErrorCode ierr;
+  Vec            F;
+
+  PetscFunctionBegin;
+  if (user->no_an || user->network_by_hand) PetscFunctionReturn(0);
+  ierr = VecDuplicate(X,&F);CHKERRQ(ierr);
+  ierr = ResidualFunctionActive(NULL,X,F,user);CHKERRQ(ierr);
+  ierr = VecDestroy(&F);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
 /* \dot{x} - f(x,y)
      g(x,y) = 0
 
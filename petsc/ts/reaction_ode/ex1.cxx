@@ -241,6 +241,7 @@ int main(int argc,char **argv)
   if (size > 1) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"Only for sequential runs");
   ierr = PetscNew(&adctx);CHKERRQ(ierr);
   adctx->m = n;adctx->n = n;adctx->p = n;
+  ierr = AdolcWorkspaceSetUp(adctx);CHKERRQ(ierr);
   ctx.adctx = adctx;
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -330,6 +331,7 @@ int main(int argc,char **argv)
   ierr = MatDestroy(&A);CHKERRQ(ierr);
   ierr = VecDestroy(&U);CHKERRQ(ierr);
   ierr = TSDestroy(&ts);CHKERRQ(ierr);
+  ierr = AdolcWorkspaceDestroy(adctx);CHKERRQ(ierr);
   ierr = PetscFree(adctx);CHKERRQ(ierr);
   ierr = PetscFinalize();
   return ierr;
@@ -1,6 +1,7 @@
 static char help[] = "Illustrates automatic Jacobian generation using ADOL-C for an adjoint sensitivity analysis of the van der Pol equation.\n\
 Input parameters include:\n\
-      -mu : stiffness parameter\n\n";
+      -mu : stiffness parameter\n\
+      -adolc_sparse_p : compress the Jacobian w.r.t. the parameter\n\n";
 
 /*
    Concepts: TS^time-dependent nonlinear problems
@@ -134,7 +135,7 @@ static PetscErrorCode RHSJacobianP(TS ts,PetscReal t,Vec X,Mat A,void *ctx)
 
   PetscFunctionBeginUser;
   ierr = VecGetArray(X,&x);CHKERRQ(ierr);
-  ierr = AdolcComputeRHSJacobianP(A,x,&user->mu,3,user->adctx);CHKERRQ(ierr);
+  ierr = AdolcComputeRHSJacobianP(A,x,1,&user->mu,3,user->adctx);CHKERRQ(ierr);
   ierr = VecRestoreArray(X,&x);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
@@ -168,7 +169,7 @@ int main(int argc,char **argv)
   Mat            Jacp;          /* JacobianP matrix */
   PetscInt       steps;
   PetscReal      ftime   = 0.5;
-  PetscBool      monitor = PETSC_FALSE;
+  PetscBool      monitor = PETSC_FALSE,sparse_p = PETSC_FALSE;
   PetscScalar    *x_ptr;
   PetscMPIInt    size;
   struct _n_User user;
@@ -190,10 +191,12 @@ int main(int argc,char **argv)
   user.mu          = 1;
   user.next_output = 0.0;
   adctx->m = 2;adctx->n = 2;adctx->p = 2;
+  ierr = AdolcWorkspaceSetUp(adctx);CHKERRQ(ierr);
   user.adctx = adctx;
 
   ierr = PetscOptionsGetReal(NULL,NULL,"-mu",&user.mu,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-monitor",&monitor,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse_p",&sparse_p,NULL);CHKERRQ(ierr);
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     Create necessary matrix and vectors, solve same ODE on every process
@@ -229,6 +232,9 @@ int main(int argc,char **argv)
   ierr = VecDuplicate(x,&r);CHKERRQ(ierr);
   ierr = RHSFunctionActive(ts,0.,x,r,&user);CHKERRQ(ierr);
   ierr = RHSFunctionActiveP(ts,0.,x,r,&user);CHKERRQ(ierr);
+  if (sparse_p) {
+    ierr = AdolcJacobianPSetUp(3,1,adctx);CHKERRQ(ierr);
+  }
   ierr = VecSet(r,0);CHKERRQ(ierr);
   ierr = MatDiagonalSet(A,r,INSERT_VALUES);CHKERRQ(ierr);
   ierr = VecDestroy(&r);CHKERRQ(ierr);
@@ -309,6 +315,7 @@ int main(int argc,char **argv)
   ierr = VecDestroy(&mu[0]);CHKERRQ(ierr);
   ierr = VecDestroy(&mu[1]);CHKERRQ(ierr);
   ierr = TSDestroy(&ts);CHKERRQ(ierr);
+  ierr = AdolcJacobianDestroy(adctx);CHKERRQ(ierr);
   ierr = PetscFree(adctx);CHKERRQ(ierr);
   ierr = PetscFinalize();
   return ierr;
@@ -323,5 +330,9 @@ int main(int argc,char **argv)
       suffix: 2
       args: -monitor 0 -ts_trajectory_type memory
 
+    test:
+      suffix: sparse_p
+      args: -monitor 0 -ts_trajectory_type memory -adolc_sparse_p -adolc_strategy_view
+
 TEST*/
 
@@ -1,6 +1,7 @@
 static char help[] = "Illustrates automatic Jacobian generation using ADOL-C for an ODE-constrained optimization problem.\n\
 Input parameters include:\n\
-      -mu : stiffness parameter\n\n";
+      -mu : stiffness parameter\n\
+      -adolc_hessian : provide TAO with a Gauss-Newton Hessian, using the ADOL-C sparse Hessian driver\n\n";
 
 /*
    Concepts: TS^time-dependent nonlinear problems
@@ -26,13 +27,18 @@ struct _n_User {
   /* Sensitivity analysis support */
   PetscReal ftime,x_ob[2];
   Mat       A;             /* Jacobian matrix */
-  Vec       x,lambda[2];   /* adjoint variables */
+  Mat       H,Hg;          /* Hessian of objective and of cost w.r.t. final state */
+  Vec       x,lambda[3];   /* adjoint variables */
+  PetscBool hessian;       /* whether the rows of J are computed along with the gradient */
+  PetscBool cached;        /* whether J, xT are valid for the initial condition ic */
+  PetscReal ic[2],xT[2],J[2][2]; /* initial condition, final state and Jacobian of the latter */
 
   /* Automatic differentiation support */
-  AdolcCtx  *adctx;
+  AdolcCtx  *adctx,*hctx;
 };
 
 PetscErrorCode FormFunctionGradient(Tao,Vec,PetscReal*,Vec,void*);
+PetscErrorCode FormHessian(Tao,Vec,Mat,Mat,void*);
 
 /*
   'Passive' RHS function, used in residual evaluations during the time integration.
@@ -85,6 +91,32 @@ static PetscErrorCode RHSFunctionActive(TS ts,PetscReal t,Vec X,Vec F,void *ctx)
   PetscFunctionReturn(0);
 }
 
+/*
+  Trace the cost function on tape 2, as a function of the final state. This tape is used in
+  generating the Hessian of the cost w.r.t. the final state.
+*/
+static PetscErrorCode CostFunctionActive(Vec X,User user)
+{
+  PetscErrorCode    ierr;
+  const PetscScalar *x;
+  PetscScalar       f;
+
+  adouble           f_a;			/* adouble for dependent variable */
+  adouble           x_a[2];			/* adouble for independent variables */
+
+  PetscFunctionBeginUser;
+  ierr = VecGetArrayRead(X,&x);CHKERRQ(ierr);
+
+  trace_on(2);                  		/* Start of active section */
+  x_a[0] <<= x[0]; x_a[1] <<= x[1];     	/* Mark as independent */
+  f_a = (x_a[0]-user->x_ob[0])*(x_a[0]-user->x_ob[0])+(x_a[1]-user->x_ob[1])*(x_a[1]-user->x_ob[1]);
+  f_a >>= f;                            	/* Mark as dependent */
+  trace_off(2);                 		/* End of active section */
+
+  ierr = VecRestoreArrayRead(X,&x);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
 /*
   Compute the Jacobian w.r.t. x using ADOL-C.
 */
@@ -126,7 +158,7 @@ int main(int argc,char **argv)
 {
   TS                 ts;          /* nonlinear solver */
   Vec                ic,r;
-  PetscBool          monitor = PETSC_FALSE;
+  PetscBool          monitor = PETSC_FALSE,hessian = PETSC_FALSE;
   PetscScalar        *x_ptr;
   PetscMPIInt        size;
   struct _n_User     user;
@@ -152,10 +184,14 @@ int main(int argc,char **argv)
   user.steps       = 0;
   user.ftime       = 0.5;
   adctx->m = 2;adctx->n = 2;adctx->p = 2;
+  ierr = AdolcWorkspaceSetUp(adctx);CHKERRQ(ierr);
   user.adctx = adctx;
 
   ierr = PetscOptionsGetReal(NULL,NULL,"-mu",&user.mu,NULL);CHKERRQ(ierr);
   ierr = PetscOptionsGetBool(NULL,NULL,"-monitor",&monitor,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_hessian",&hessian,NULL);CHKERRQ(ierr);
+  user.hessian = hessian;
+  user.cached  = PETSC_FALSE;
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     Create necessary matrix and vectors, solve same ODE on every process
@@ -223,6 +259,20 @@ int main(int argc,char **argv)
 
   ierr = MatCreateVecs(user.A,&user.lambda[0],NULL);CHKERRQ(ierr);
 
+  /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     Trace the cost function and set up the sparse Hessian driver
+   - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  if (hessian) {
+    ierr = PetscNew(&user.hctx);CHKERRQ(ierr);
+    user.hctx->m = 1;user.hctx->n = 2;
+    ierr = CostFunctionActive(user.x,&user);CHKERRQ(ierr);
+    ierr = AdolcHessianSetUp(2,user.hctx);CHKERRQ(ierr);
+    ierr = MatCreateVecs(user.A,&user.lambda[1],NULL);CHKERRQ(ierr);
+    ierr = MatCreateVecs(user.A,&user.lambda[2],NULL);CHKERRQ(ierr);
+    ierr = MatCreateSeqAIJ(PETSC_COMM_SELF,2,2,2,NULL,&user.Hg);CHKERRQ(ierr);
+    ierr = MatCreateSeqAIJ(PETSC_COMM_SELF,2,2,2,NULL,&user.H);CHKERRQ(ierr);
+  }
+
   /* Create TAO solver and set desired solution method */
   ierr = TaoCreate(PETSC_COMM_WORLD,&tao);CHKERRQ(ierr);
   ierr = TaoSetType(tao,TAOCG);CHKERRQ(ierr);
@@ -238,6 +288,9 @@ int main(int argc,char **argv)
 
   /* Set routine for function and gradient evaluation */
   ierr = TaoSetObjectiveAndGradientRoutine(tao,FormFunctionGradient,(void *)&user);CHKERRQ(ierr);
+  if (hessian) {
+    ierr = TaoSetHessianRoutine(tao,user.H,user.H,FormHessian,(void *)&user);CHKERRQ(ierr);
+  }
 
   /* Check for any TAO command line options */
   ierr = TaoSetFromOptions(tao);CHKERRQ(ierr);
@@ -262,8 +315,17 @@ int main(int argc,char **argv)
   ierr = MatDestroy(&user.A);CHKERRQ(ierr);
   ierr = VecDestroy(&user.x);CHKERRQ(ierr);
   ierr = VecDestroy(&user.lambda[0]);CHKERRQ(ierr);
+  if (hessian) {
+    ierr = MatDestroy(&user.H);CHKERRQ(ierr);
+    ierr = MatDestroy(&user.Hg);CHKERRQ(ierr);
+    ierr = VecDestroy(&user.lambda[1]);CHKERRQ(ierr);
+    ierr = VecDestroy(&user.lambda[2]);CHKERRQ(ierr);
+    ierr = AdolcJacobianDestroy(user.hctx);CHKERRQ(ierr);
+    ierr = PetscFree(user.hctx);CHKERRQ(ierr);
+  }
   ierr = TSDestroy(&ts);CHKERRQ(ierr);
   ierr = VecDestroy(&ic);CHKERRQ(ierr);
+  ierr = AdolcWorkspaceDestroy(adctx);CHKERRQ(ierr);
   ierr = PetscFree(adctx);CHKERRQ(ierr);
   ierr = PetscFinalize();
   return ierr;
@@ -271,7 +333,9 @@ int main(int argc,char **argv)
 
 /* ------------------------------------------------------------------ */
 /*
-   FormFunctionGradient - Evaluates the function and corresponding gradient.
+   FormFunctionGradient - Evaluates the function and corresponding gradient. If the Hessian is
+   requested, the rows of the Jacobian of the final state w.r.t. the initial condition are also
+   computed, as two further cost gradients of the same adjoint solve, and cached for FormHessian.
 
    Input Parameters:
    tao - the Tao context
@@ -287,6 +351,8 @@ PetscErrorCode FormFunctionGradient(Tao tao,Vec IC,PetscReal *f,Vec G,void *ctx)
   User              user = (User)ctx;
   TS                ts;
   PetscScalar       *x_ptr,*y_ptr;
+  const PetscScalar *ic_ptr;
+  PetscInt          k;
   PetscErrorCode    ierr;
 
   PetscFunctionBeginUser;
@@ -338,18 +404,102 @@ PetscErrorCode FormFunctionGradient(Tao tao,Vec IC,PetscReal *f,Vec G,void *ctx)
   y_ptr[0] = 2.*(x_ptr[0]-user->x_ob[0]);
   y_ptr[1] = 2.*(x_ptr[1]-user->x_ob[1]);
   ierr = VecRestoreArray(user->lambda[0],&y_ptr);CHKERRQ(ierr);
+  if (user->hessian) {
+    user->xT[0] = x_ptr[0];user->xT[1] = x_ptr[1];
+    for (k=1; k<3; k++) {
+      ierr = VecGetArray(user->lambda[k],&y_ptr);CHKERRQ(ierr);
+      y_ptr[0] = (k == 1) ? 1. : 0.;
+      y_ptr[1] = (k == 2) ? 1. : 0.;
+      ierr = VecRestoreArray(user->lambda[k],&y_ptr);CHKERRQ(ierr);
+    }
+  }
   ierr = VecRestoreArray(user->x,&x_ptr);CHKERRQ(ierr);
-  ierr = TSSetCostGradients(ts,1,user->lambda,NULL);CHKERRQ(ierr);
+  ierr = TSSetCostGradients(ts,user->hessian ? 3 : 1,user->lambda,NULL);CHKERRQ(ierr);
 
 
   ierr = TSAdjointSolve(ts);CHKERRQ(ierr);
 
   ierr = VecCopy(user->lambda[0],G);CHKERRQ(ierr);
+  if (user->hessian) {
+    for (k=1; k<3; k++) {
+      ierr = VecGetArray(user->lambda[k],&y_ptr);CHKERRQ(ierr);
+      user->J[k-1][0] = y_ptr[0];user->J[k-1][1] = y_ptr[1];
+      ierr = VecRestoreArray(user->lambda[k],&y_ptr);CHKERRQ(ierr);
+    }
+    ierr = VecGetArrayRead(IC,&ic_ptr);CHKERRQ(ierr);
+    user->ic[0] = ic_ptr[0];user->ic[1] = ic_ptr[1];
+    ierr = VecRestoreArrayRead(IC,&ic_ptr);CHKERRQ(ierr);
+    user->cached = PETSC_TRUE;
+  }
 
   ierr = TSDestroy(&ts);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
 
+/* ------------------------------------------------------------------ */
+/*
+   FormHessian - Evaluates a Gauss-Newton approximation of the Hessian of the objective
+   f(ic) = g(x(T;ic)), i.e. J^T H_g J, where J is the Jacobian of the final state w.r.t. the
+   initial condition and H_g is the Hessian of the cost w.r.t. the final state. The rows of J are
+   computed alongside the gradient in FormFunctionGradient, so no further solves are needed unless
+   the Hessian is requested at a point where the gradient was not last evaluated. H_g is computed
+   from tape 2 using the ADOL-C sparse Hessian driver. The neglected term involves second
+   derivatives of the flow, which vanish with the residual at the optimum.
+
+   Input Parameters:
+   tao - the Tao context
+   IC  - the input vector
+   ctx - optional user-defined context, as set by TaoSetHessianRoutine()
+
+   Output Parameters:
+   H    - Hessian matrix
+   Hpre - optionally different preconditioning matrix
+*/
+PetscErrorCode FormHessian(Tao tao,Vec IC,Mat H,Mat Hpre,void *ctx)
+{
+  User              user = (User)ctx;
+  PetscInt          i,j,k,l,idx[2] = {0,1};
+  PetscScalar       hg[4],Hf[4];
+  PetscReal         f;
+  const PetscScalar *ic_ptr;
+  PetscBool         match;
+  Vec               G;
+  PetscErrorCode    ierr;
+
+  PetscFunctionBeginUser;
+  ierr = VecGetArrayRead(IC,&ic_ptr);CHKERRQ(ierr);
+  match = ((user->cached) && (ic_ptr[0] == user->ic[0]) && (ic_ptr[1] == user->ic[1])) ? PETSC_TRUE : PETSC_FALSE;
+  ierr = VecRestoreArrayRead(IC,&ic_ptr);CHKERRQ(ierr);
+  if (!match) {
+    ierr = VecDuplicate(IC,&G);CHKERRQ(ierr);
+    ierr = FormFunctionGradient(tao,IC,&f,G,ctx);CHKERRQ(ierr);
+    ierr = VecDestroy(&G);CHKERRQ(ierr);
+  }
+
+  /* Hessian of the cost w.r.t. the final state */
+  ierr = AdolcComputeHessian(2,user->Hg,user->xT,user->hctx);CHKERRQ(ierr);
+  ierr = MatGetValues(user->Hg,2,idx,2,idx,hg);CHKERRQ(ierr);
+
+  /* Assemble J^T H_g J */
+  for (i=0; i<2; i++) {
+    for (j=0; j<2; j++) {
+      Hf[2*i+j] = 0.;
+      for (k=0; k<2; k++) {
+        for (l=0; l<2; l++) Hf[2*i+j] += user->J[k][i]*hg[2*k+l]*user->J[l][j];
+      }
+    }
+  }
+  ierr = MatSetValues(H,2,idx,2,idx,Hf,INSERT_VALUES);CHKERRQ(ierr);
+  ierr = MatAssemblyBegin(H,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  ierr = MatAssemblyEnd(H,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  if (Hpre != H) {
+    ierr = MatSetValues(Hpre,2,idx,2,idx,Hf,INSERT_VALUES);CHKERRQ(ierr);
+    ierr = MatAssemblyBegin(Hpre,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(Hpre,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
 /*TEST
     build:
       requires: !single !complex
@@ -362,4 +512,8 @@ PetscErrorCode FormFunctionGradient(Tao tao,Vec IC,PetscReal *f,Vec G,void *ctx)
       suffix: 2
       args: -ts_rhs_jacobian_test_mult_transpose -mat_shell_test_mult_transpose_view -tao_max_it 1 -ts_rhs_jacobian_test_mult -mat_shell_test_mult_view
 
+    test:
+      suffix: hessian
+      args: -monitor 0 -adolc_hessian -adolc_hessian_coloring greedy -tao_type nls -tao_monitor -tao_gttol 1.e-5 -ts_trajectory_dirname ex16opt_icdir
+
 TEST*/
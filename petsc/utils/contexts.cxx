@@ -3,6 +3,71 @@
 #include <adolc/adolc.h>
 
 
+/* Recovery plan for de-compression, stored in compressed sparse row (CSR) format */
+#ifndef RECPLAN
+#define RECPLAN
+typedef struct {
+  PetscInt    m,nnz;    /* Number of rows and of nonzeros */
+  PetscInt    *rowptr;  /* Row pointers, of length m+1 */
+  PetscInt    *cols;    /* Column indices of nonzeros, of length nnz */
+  PetscInt    *offsets; /* Offsets of nonzeros in the contiguous compressed buffer, of length nnz */
+  PetscScalar *vals;    /* Workspace for the values of a single row */
+  const PetscInt *rows; /* Local row index of each row, or NULL if these coincide (not owned) */
+  PetscInt    bs;       /* Block size, if rows and columns are blocks (see GetBlockRecoveryPlan), or 0 */
+} RecPlan;
+#endif
+
+/* Colouring of a periodic tile of a structured grid, which is valid for any DMDA with the same
+   dimension, degrees of freedom and stencil when tiled over it (see StencilTileCreate) */
+#ifndef STENCILTILE
+#define STENCILTILE
+typedef struct {
+  PetscInt dim,dof,sw,st; /* Dimension, degrees of freedom, stencil width and stencil type */
+  PetscInt tx,ty,tz;      /* Period of the tile in each direction */
+  PetscInt p;             /* Number of colours */
+  PetscInt *colours;      /* Colour of each entry of the tile, of length tx*ty*tz*dof */
+} StencilTile;
+#endif
+
+/* Column colouring backend, selected by name at setup (see GetColumnColoring) */
+#ifndef COLORINGBACKEND
+#define COLORINGBACKEND
+typedef PetscErrorCode (*ColoringFunction)(DM,unsigned int**,PetscInt,PetscInt,PetscInt*,PetscInt*);
+typedef struct {
+  const char       *name;     /* Name, as used with -adolc_coloring */
+  ColoringFunction colour;    /* Colouring routine, taking DM, pattern, m, n, colours and p */
+  PetscBool        needs_dm;  /* Whether a DMDA is required */
+  PetscBool        local;     /* Whether the tape must be in local (ghosted) numbering of the DMDA */
+} ColoringBackend;
+#endif
+
+/* Persistent workspace for Jacobian computation, reallocated only if dimensions change */
+#ifndef ADOLCWORK
+#define ADOLCWORK
+typedef struct {
+  PetscScalar **J;          /* Compressed Jacobian */
+  PetscScalar **J2;         /* Compressed Jacobian of second tape, for implicit TS */
+  PetscScalar **JR;         /* Row-compressed part of a bidirectionally compressed Jacobian */
+  PetscScalar **JR2;        /* Row-compressed part of second tape, for implicit TS */
+  PetscScalar **JP;         /* (Compressed) Jacobian w.r.t. parameters */
+  PetscScalar **SP;         /* Identity seed matrix for parameter directions */
+  PetscScalar *concat;      /* Concatenation of independent variables and parameters */
+  PetscScalar *y;           /* Dependent values, from the forward sweep preceding reverse mode */
+  PetscScalar **SB;         /* Block of the column seed matrix, generated from the colours */
+  PetscScalar **Y;          /* Row pointers into a block of columns of J */
+  PetscInt    Jm,Jn;        /* Dimensions of J */
+  PetscInt    J2m,J2n;      /* Dimensions of J2 */
+  PetscInt    JRm,JRn;      /* Dimensions of JR */
+  PetscInt    JR2m,JR2n;    /* Dimensions of JR2 */
+  PetscInt    JPm,JPn;      /* Dimensions of JP */
+  PetscInt    SPm,SPn;      /* Dimensions of SP */
+  PetscInt    concatn;      /* Length of concat */
+  PetscInt    yn;           /* Length of y */
+  PetscInt    SBm,SBn;      /* Dimensions of SB */
+  PetscInt    Ym;           /* Length of Y */
+} AdolcWork;
+#endif
+
 #ifndef ADOLCCTX
 #define ADOLCCTX
 typedef struct {
@@ -12,14 +77,65 @@ typedef struct {
   /* No ADOL-C annotation */
   PetscBool   no_an;
 
-  /* Compressed Jacobian computation */
-  PetscBool   sparse,sparse_view,sparse_view_done;
-  PetscScalar **Seed,**Rec,*rec;
+  /* Compressed Jacobian computation, either by columns (p x n seed, propagated in vector forward
+     mode) or by rows (p x m seed, propagated in vector reverse mode) */
+  PetscBool   sparse,sparse_view,sparse_view_done,reverse;
+  PetscScalar **Seed;
+  PetscInt    *colours;  /* Colour of each column (or row), which defines Seed */
+  RecPlan     *plan;
   PetscInt    p;
 
+  /* If positive, the column seed matrix is not stored, but generated from the colours in blocks
+     of this many directions during propagation (see AdolcPropagateBlocked) */
+  PetscInt    seed_block;
+
+  /* Bidirectional compression, where the above holds the column-compressed part and the below
+     holds the row-compressed part (pR x m seed, propagated in vector reverse mode) */
+  PetscBool   bidirectional;
+  PetscScalar **SeedR;
+  PetscInt    *coloursR; /* Colour of each row (or -1 if uncoloured), which defines SeedR */
+  RecPlan     *planR;
+  PetscInt    pR;
+
+  /* Diagonal-only compression, with recovery vector holding the colour of each diagonal entry */
+  PetscScalar **SeedD;
+  PetscInt    *rec;
+  PetscInt    pD;
+
+  /* Compressed Jacobian w.r.t. parameters (optional) */
+  PetscScalar **SeedP;
+  RecPlan     *planP;
+  PetscInt    q;
+
+  /* Compressed Hessian of a scalar function, propagated in second order vector mode and
+     recovered using symmetry (see AdolcHessianSetUp) */
+  PetscScalar ***XH,***YH,***ZH; /* Taylor (n x pH x 1, 1 x pH x 1) and adjoint (pH x n x 2) tensors */
+  PetscScalar **UH;              /* Adjoint weight, of dimension 1 x 2 */
+  RecPlan     *planH;
+  PetscInt    pH;
+
   /* Matrix dimensions */
   PetscInt    m,n;
 
+  /* Block size, if the recovery plans have been grouped into blocks for insertion into BAIJ or
+     SBAIJ matrices, or 0 otherwise */
+  PetscInt    bs;
+  PetscBool   symmetric; /* Whether the Jacobian is asserted to be symmetric, as SBAIJ requires */
+
+  /* Frozen-pattern assembly, where the recovered entries are scattered straight into the values
+     of a matrix preallocated in COO format (see AdolcRecoverCOO) */
+  PetscBool   coo;
+  PetscInt    cooid;     /* Identifier of the pattern, composed with each matrix for which it has been set */
+  PetscScalar *coov;     /* Values, in the order of the recovery plan, followed by the diagonal */
+  PetscInt    ncoo;
+
+  /* Local (ghosted) row of each dependent, if only owned points are marked as dependents (see
+     AdolcSetOwnedDependents), or NULL if every local point is a dependent */
+  PetscInt    *rows;
+
+  /* Persistent workspace */
+  AdolcWork   work;
+
   /* Event logging */
   PetscLogEvent event1,event2,event3,event4,event5;
 } AdolcCtx;
@@ -35,9 +151,18 @@ typedef struct {
   Vec           localX0;
   PetscReal     shift;
   PetscInt      m,n;
+  PetscScalar   *action;        /* Persistent action vector, of length max(m,n) */
+  PetscInt      nruns,runlen;   /* Number and length of contiguous runs of owned entries */
+  PetscInt      *runs;          /* Offset of each run in local (ghosted) ordering */
+  AdolcCtx      *adctx;         /* ADOL-C context, for diagonal extraction */
   PetscInt      tag1,tag2;
+  PetscInt      tagc;           /* Tape of F(x,xdot) in both arguments, for the fused product, or -1 */
+  PetscScalar   *xc,*dxc;       /* Base point (x0,xdot0) and seed (x1,a*x1) of the fused tape, of length 2n */
+  PetscScalar   **S,**T;        /* Persistent seed and result blocks of the block products */
+  PetscInt      Scap[2],Tcap[2];/* Number of rows and entries allocated for S and T */
   TS            ts;
-  PetscBool     flg;
+  PetscObjectState tstate[2];   /* State of localX0 at the last zero order sweep of tag1 and tag2 */
   PetscLogEvent event1,event2,event3,event4;
+  PetscLogEvent taylorhit,taylormiss;
 } MatCtx;
 #endif
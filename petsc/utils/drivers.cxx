@@ -1,8 +1,494 @@
+#ifndef ADOLCDRIVERS
+#define ADOLCDRIVERS
+#include <algorithm>
+#include <adolc/adolc_sparse.h>
 #include "contexts.cxx"
 #include "sparse.cxx"
 #include "init.cxx"
 
 
+/* --------------------------------------------------------------------------------
+   Policies for the Jacobian driver template
+
+   The driver template below is specialised at compile time on three policies:
+     * Insertion   - whether matrix entries are set using global or local indices;
+     * Mass        - whether the Jacobian is that of an explicit TS, an implicit TS with
+                     identity mass matrix, or an implicit TS with a general mass matrix;
+     * Compression - whether the Jacobian is propagated in column-compressed format (vector
+                     forward mode), row-compressed format (vector reverse mode) or both
+                     (bidirectional) and recovered using recovery plans, or propagated densely.
+   The public drivers select an instantiation once, based on the ADOL-C context, so that
+   no mode checks are required within the propagation and recovery loops.
+   ----------------------------------------------------------------------------- */
+
+struct BlockedGlobalInsertion;
+struct BlockedLocalInsertion;
+
+/* Insertion using global indices */
+struct GlobalInsertion {
+  static const bool blocked = false;
+  typedef BlockedGlobalInsertion Blocked; /* Counterpart for blocked recovery plans */
+  static inline PetscErrorCode SetValue(Mat A,PetscInt i,PetscInt j,const PetscScalar *v,InsertMode mode)
+  {
+    return MatSetValues(A,1,&i,1,&j,v,mode);
+  }
+  static inline PetscErrorCode Recover(Mat A,InsertMode mode,RecPlan *plan,PetscScalar **C,PetscReal *a)
+  {
+    return RecoverJacobian(A,mode,plan,C,a);
+  }
+#if PETSC_VERSION_GE(3,16,0)
+  static inline PetscErrorCode SetPreallocationCOO(Mat A,PetscInt ncoo,PetscInt *coo_i,PetscInt *coo_j)
+  {
+    return MatSetPreallocationCOO(A,ncoo,coo_i,coo_j);
+  }
+#endif
+};
+
+/* Insertion using local (ghosted) indices */
+struct LocalInsertion {
+  static const bool blocked = false;
+  typedef BlockedLocalInsertion Blocked;
+  static inline PetscErrorCode SetValue(Mat A,PetscInt i,PetscInt j,const PetscScalar *v,InsertMode mode)
+  {
+    return MatSetValuesLocal(A,1,&i,1,&j,v,mode);
+  }
+  static inline PetscErrorCode Recover(Mat A,InsertMode mode,RecPlan *plan,PetscScalar **C,PetscReal *a)
+  {
+    return RecoverJacobianLocal(A,mode,plan,C,a);
+  }
+#if PETSC_VERSION_GE(3,16,0)
+  static inline PetscErrorCode SetPreallocationCOO(Mat A,PetscInt ncoo,PetscInt *coo_i,PetscInt *coo_j)
+  {
+    return MatSetPreallocationCOOLocal(A,ncoo,coo_i,coo_j);
+  }
+#endif
+};
+
+/* Insertion of blocks using global block indices, for BAIJ and SBAIJ (see GetBlockRecoveryPlan) */
+struct BlockedGlobalInsertion {
+  static const bool blocked = true;
+  typedef BlockedGlobalInsertion Blocked;
+  static inline PetscErrorCode SetValue(Mat A,PetscInt i,PetscInt j,const PetscScalar *v,InsertMode mode)
+  {
+    return MatSetValues(A,1,&i,1,&j,v,mode);
+  }
+  static inline PetscErrorCode Recover(Mat A,InsertMode mode,RecPlan *plan,PetscScalar **C,PetscReal *a)
+  {
+    return RecoverJacobianBlocked(A,mode,plan,C,a);
+  }
+#if PETSC_VERSION_GE(3,16,0)
+  static inline PetscErrorCode SetPreallocationCOO(Mat A,PetscInt ncoo,PetscInt *coo_i,PetscInt *coo_j)
+  {
+    return GlobalInsertion::SetPreallocationCOO(A,ncoo,coo_i,coo_j);
+  }
+#endif
+};
+
+/* Insertion of blocks using local (ghosted) block indices */
+struct BlockedLocalInsertion {
+  static const bool blocked = true;
+  typedef BlockedLocalInsertion Blocked;
+  static inline PetscErrorCode SetValue(Mat A,PetscInt i,PetscInt j,const PetscScalar *v,InsertMode mode)
+  {
+    return MatSetValuesLocal(A,1,&i,1,&j,v,mode);
+  }
+  static inline PetscErrorCode Recover(Mat A,InsertMode mode,RecPlan *plan,PetscScalar **C,PetscReal *a)
+  {
+    return RecoverJacobianBlockedLocal(A,mode,plan,C,a);
+  }
+#if PETSC_VERSION_GE(3,16,0)
+  static inline PetscErrorCode SetPreallocationCOO(Mat A,PetscInt ncoo,PetscInt *coo_i,PetscInt *coo_j)
+  {
+    return LocalInsertion::SetPreallocationCOO(A,ncoo,coo_i,coo_j);
+  }
+#endif
+};
+
+/* Explicit TS, i.e. RHSJacobian */
+struct NoMass {
+  static const bool implicit = false;    /* Is the shift a used? */
+  static const bool second_tape = false; /* Is dF/d(xdot) taped separately? */
+};
+
+/* Implicit TS with identity mass matrix, so that a is added to the diagonal */
+struct IdentityMass {
+  static const bool implicit = true;
+  static const bool second_tape = false;
+};
+
+/* Implicit TS with general mass matrix, given by a second tape for dF/d(xdot) */
+struct GeneralMass {
+  static const bool implicit = true;
+  static const bool second_tape = true;
+};
+
+/* Propagation of column-compressed (m x p) Jacobian, using a precomputed seed matrix and recovery plan */
+struct Compressed {
+  static const bool compressed = true;
+  static const bool reverse = false;
+  static const bool bidirectional = false;
+  static const bool blocked = false;
+  static inline PetscInt Rows(PetscInt m,PetscInt n,PetscInt p) {return m;}
+  static inline PetscInt Cols(PetscInt m,PetscInt n,PetscInt p) {return p;}
+  static inline void Propagate(PetscInt tag,PetscInt m,PetscInt n,PetscInt p,PetscScalar *u_vec,PetscScalar **Seed,PetscScalar *y,PetscScalar **J)
+  {
+    fov_forward(tag,m,n,p,u_vec,Seed,NULL,J);
+  }
+  template <class Insertion>
+  static inline PetscErrorCode Recover(Mat A,RecPlan *plan,const PetscInt *rows,PetscInt m,PetscInt n,PetscScalar **J)
+  {
+    return Insertion::Recover(A,INSERT_VALUES,plan,J,NULL);
+  }
+};
+
+/*
+  Propagation of column-compressed (m x p) Jacobian in blocks of directions, with each block of the
+  seed matrix generated from the colour vector (see AdolcPropagateBlocked)
+*/
+struct CompressedBlocked : Compressed {
+  static const bool blocked = true;
+};
+
+/*
+  Propagation of row-compressed (p x n) Jacobian, using a precomputed p x m seed matrix and
+  recovery plan. A forward sweep is required to record the values needed by reverse mode.
+*/
+struct CompressedReverse {
+  static const bool compressed = true;
+  static const bool reverse = true;
+  static const bool bidirectional = false;
+  static const bool blocked = false;
+  static inline PetscInt Rows(PetscInt m,PetscInt n,PetscInt p) {return p;}
+  static inline PetscInt Cols(PetscInt m,PetscInt n,PetscInt p) {return n;}
+  static inline void Propagate(PetscInt tag,PetscInt m,PetscInt n,PetscInt p,PetscScalar *u_vec,PetscScalar **Seed,PetscScalar *y,PetscScalar **J)
+  {
+    zos_forward(tag,m,n,1,u_vec,y);
+    fov_reverse(tag,m,n,p,Seed,J);
+  }
+  template <class Insertion>
+  static inline PetscErrorCode Recover(Mat A,RecPlan *plan,const PetscInt *rows,PetscInt m,PetscInt n,PetscScalar **J)
+  {
+    return Insertion::Recover(A,INSERT_VALUES,plan,J,NULL);
+  }
+};
+
+/*
+  Bidirectional propagation, using a partial column colouring (propagated as for Compressed) and
+  a partial row colouring (propagated as for CompressedReverse), each with its own recovery plan.
+  Either colouring may be empty.
+*/
+struct Bicoloured {
+  static const bool compressed = true;
+  static const bool reverse = false;
+  static const bool bidirectional = true;
+  static const bool blocked = false;
+  static inline PetscInt Rows(PetscInt m,PetscInt n,PetscInt p) {return m;}
+  static inline PetscInt Cols(PetscInt m,PetscInt n,PetscInt p) {return p;}
+  static inline void Propagate(PetscInt tag,PetscInt m,PetscInt n,PetscInt p,PetscScalar *u_vec,PetscScalar **Seed,PetscScalar *y,PetscScalar **J)
+  {
+    if (p) fov_forward(tag,m,n,p,u_vec,Seed,NULL,J);
+  }
+  static inline void PropagateReverse(PetscInt tag,PetscInt m,PetscInt n,PetscInt p,PetscScalar *u_vec,PetscScalar **Seed,PetscScalar *y,PetscScalar **J)
+  {
+    if (p) CompressedReverse::Propagate(tag,m,n,p,u_vec,Seed,y,J);
+  }
+  template <class Insertion>
+  static inline PetscErrorCode Recover(Mat A,RecPlan *plan,const PetscInt *rows,PetscInt m,PetscInt n,PetscScalar **J)
+  {
+    return Insertion::Recover(A,INSERT_VALUES,plan,J,NULL);
+  }
+};
+
+/* Propagation of full Jacobian (not recommended!) */
+struct Dense {
+  static const bool compressed = false;
+  static const bool reverse = false;
+  static const bool bidirectional = false;
+  static const bool blocked = false;
+  static inline PetscInt Rows(PetscInt m,PetscInt n,PetscInt p) {return m;}
+  static inline PetscInt Cols(PetscInt m,PetscInt n,PetscInt p) {return n;}
+  static inline void Propagate(PetscInt tag,PetscInt m,PetscInt n,PetscInt p,PetscScalar *u_vec,PetscScalar **Seed,PetscScalar *y,PetscScalar **J)
+  {
+    jacobian(tag,m,n,u_vec,J);
+  }
+  template <class Insertion>
+  static PetscErrorCode Recover(Mat A,RecPlan *plan,const PetscInt *rows,PetscInt m,PetscInt n,PetscScalar **J)
+  {
+    PetscErrorCode ierr;
+    PetscInt       i,j,row;
+
+    PetscFunctionBegin;
+    for (i=0; i<m; i++) {
+      row = rows ? rows[i] : i;
+      for (j=0; j<n; j++) {
+        if (fabs(J[i][j]) > 1.e-16) {
+          ierr = Insertion::SetValue(A,row,j,&J[i][j],INSERT_VALUES);CHKERRQ(ierr);
+        }
+      }
+    }
+    PetscFunctionReturn(0);
+  }
+};
+
+/*
+  Combine two compressed Jacobians in place, as J <- J + a * J2, so that the contributions
+  dF/dx and dF/d(xdot) to an implicit Jacobian may be recovered in a single pass. This holds
+  for both column and row compression, since both are linear in the Jacobian.
+
+  Input parameters:
+  m,p - number of rows and columns of compressed Jacobians
+  J2  - compressed Jacobian dF/d(xdot), stored contiguously
+  a   - shift
+
+  Output parameter:
+  J   - compressed Jacobian dF/dx on input, dF/dx + a * dF/d(xdot) on output
+*/
+PetscErrorCode AdolcShiftedSum(PetscInt m,PetscInt p,PetscScalar **J,PetscScalar **J2,PetscReal a)
+{
+  PetscInt          k;
+  PetscScalar       *c = J[0];
+  const PetscScalar *c2 = J2[0];
+
+  PetscFunctionBegin;
+  for (k=0; k<m*p; k++) c[k] += a*c2[k];
+  PetscFunctionReturn(0);
+}
+
+/*
+  Propagate a column-compressed Jacobian in blocks of (at most) seed_block directions. Each n x b
+  block of the seed matrix is generated from the colour vector in O(n) (see
+  GenerateSeedBlockFromColors), so the full n x p seed matrix is never stored, and the result of
+  each block is written directly into the corresponding columns of J. Each block requires its
+  own zero order sweep, so this trades some propagation time for memory.
+
+  Input parameters:
+  tag   - tape identifier
+  m,n,p - number of dependents, independents and colours
+  u_vec - vector at which to evaluate Jacobian
+  adctx - ADOL-C context, with colours and seed_block set
+
+  Output parameter:
+  J     - compressed Jacobian, of dimension m x p
+*/
+PetscErrorCode AdolcPropagateBlocked(PetscInt tag,PetscInt m,PetscInt n,PetscInt p,PetscScalar *u_vec,AdolcCtx *adctx,PetscScalar **J)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,c0,nb,b = PetscMin(adctx->seed_block,p);
+  PetscScalar    **S,**Y;
+
+  PetscFunctionBegin;
+  ierr = AdolcWorkspaceGetSeedBlock(adctx,n,b,&S);CHKERRQ(ierr);
+  ierr = AdolcWorkspaceGetRows(adctx,m,&Y);CHKERRQ(ierr);
+  for (c0=0; c0<p; c0+=b) {
+    nb   = PetscMin(b,p-c0);
+    ierr = GenerateSeedBlockFromColors(n,adctx->colours,c0,b,S);CHKERRQ(ierr);
+    for (i=0; i<m; i++) Y[i] = J[i] + c0;
+    fov_forward(tag,m,n,nb,u_vec,S,NULL,Y);
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Recover a compressed Jacobian straight into the value array of a matrix whose nonzero pattern
+  has been frozen in COO format. On the first call for a given matrix, the pattern is set from the
+  recovery plan, with the diagonal entry of each recovered row appended so that a shift may be
+  added later, and the identifier of the pattern is composed with the matrix. Since each matrix
+  carries its own mark, distinct operators (e.g. Amat and Pmat) may be used in turn without the
+  pattern being set again. Rows and columns share the ghosted numbering of the local patch, so
+  this holds with owned-only dependents too. Each call then gathers the entries in plan order and
+  scatters them with a single MatSetValuesCOO. This avoids the hashing of MatSetValues and the
+  stash checks of MatAssemblyBegin/End, and the matrix is assembled on return.
+
+  Input parameters:
+  adctx - ADOL-C context, with a scalar column or row recovery plan
+  J     - compressed Jacobian
+
+  Output parameter:
+  A     - Mat object corresponding to Jacobian
+
+  Notes:
+  Requires PETSc 3.16 or later. Entries in rows owned by other processes are communicated within
+  MatSetValuesCOO, so this is best combined with owned-only dependents (AdolcSetOwnedDependents).
+*/
+template <class Insertion>
+PetscErrorCode AdolcRecoverCOO(Mat A,AdolcCtx *adctx,PetscScalar **J)
+{
+#if PETSC_VERSION_GE(3,16,0)
+  PetscErrorCode ierr;
+  RecPlan        *plan = adctx->plan;
+  PetscInt       i,k,row,*coo_i,*coo_j,*frozen = NULL;
+  PetscScalar    *c = J[0];
+  PetscContainer container;
+
+  PetscFunctionBegin;
+  ierr = PetscObjectQuery((PetscObject)A,"AdolcCOOPattern",(PetscObject*)&container);CHKERRQ(ierr);
+  if (container) {
+    ierr = PetscContainerGetPointer(container,(void**)&frozen);CHKERRQ(ierr);
+  }
+  if ((!frozen) || (*frozen != adctx->cooid)) {
+    ierr = PetscMalloc2(PetscMax(adctx->ncoo,1),&coo_i,PetscMax(adctx->ncoo,1),&coo_j);CHKERRQ(ierr);
+    for (i=0; i<plan->m; i++) {
+      row = plan->rows ? plan->rows[i] : i;
+      for (k=plan->rowptr[i]; k<plan->rowptr[i+1]; k++) {
+        coo_i[k] = row;
+        coo_j[k] = plan->cols[k];
+      }
+      coo_i[plan->nnz+i] = coo_j[plan->nnz+i] = row;
+    }
+    ierr = Insertion::SetPreallocationCOO(A,adctx->ncoo,coo_i,coo_j);CHKERRQ(ierr);
+    ierr = PetscFree2(coo_i,coo_j);CHKERRQ(ierr);
+    ierr = PetscMalloc1(1,&frozen);CHKERRQ(ierr);
+    *frozen = adctx->cooid;
+    ierr = PetscContainerCreate(PETSC_COMM_SELF,&container);CHKERRQ(ierr);
+    ierr = PetscContainerSetPointer(container,frozen);CHKERRQ(ierr);
+    ierr = PetscContainerSetUserDestroy(container,PetscContainerUserDestroyDefault);CHKERRQ(ierr);
+    ierr = PetscObjectCompose((PetscObject)A,"AdolcCOOPattern",(PetscObject)container);CHKERRQ(ierr);
+    ierr = PetscContainerDestroy(&container);CHKERRQ(ierr);
+  }
+  for (k=0; k<plan->nnz; k++) adctx->coov[k] = c[plan->offsets[k]];
+  ierr = MatSetValuesCOO(A,adctx->coov,INSERT_VALUES);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+#else
+  PetscFunctionBegin;
+  SETERRQ(PETSC_COMM_SELF,PETSC_ERR_SUP,"COO assembly requires PETSc 3.16 or later");
+#endif
+}
+
+/*
+  Driver template for computing a Jacobian using ADOL-C and assembling it into a Mat.
+
+  For a general mass matrix, the dF/dx and dF/d(xdot) parts are combined in compressed
+  format, so that the Jacobian is recovered and assembled just once. For an identity mass
+  matrix, the shift a is added to the diagonal after assembly.
+
+  Input parameters:
+  tag1  - tape identifier for dF/dx part
+  tag2  - tape identifier for dF/d(xdot) part (only used with GeneralMass)
+  u_vec - vector at which to evaluate Jacobian
+  a     - shift (only used for implicit TS)
+  adctx - ADOL-C context, as defined above
+
+  Output parameter:
+  A     - Mat object corresponding to Jacobian
+*/
+template <class Insertion,class Mass,class Compression>
+PetscErrorCode AdolcComputeJacobianImpl(PetscInt tag1,PetscInt tag2,Mat A,PetscScalar *u_vec,PetscReal a,AdolcCtx *adctx)
+{
+  PetscErrorCode ierr;
+  PetscInt       m = adctx->m,n = adctx->n,p = adctx->p;
+  PetscInt       rows = Compression::Rows(m,n,p),cols = Compression::Cols(m,n,p);
+  PetscScalar    **J,**J2 = NULL,**JR = NULL,**JR2 = NULL,*y = NULL;
+
+  PetscFunctionBegin;
+  ierr = AdolcWorkspaceGetJacobian(adctx,rows,cols,&J);CHKERRQ(ierr);
+  if (Mass::second_tape) {
+    ierr = AdolcWorkspaceGetJacobian2(adctx,rows,cols,&J2);CHKERRQ(ierr);
+  }
+  if (Compression::bidirectional) {
+    ierr = AdolcWorkspaceGetJacobianR(adctx,adctx->pR,n,&JR);CHKERRQ(ierr);
+    if (Mass::second_tape) {
+      ierr = AdolcWorkspaceGetJacobianR2(adctx,adctx->pR,n,&JR2);CHKERRQ(ierr);
+    }
+  }
+  if ((Compression::reverse) || (Compression::bidirectional)) {
+    ierr = AdolcWorkspaceGetDependents(adctx,m,&y);CHKERRQ(ierr);
+  }
+
+  /* Propagate dF/dx part (and dF/d(xdot) part, if taped separately) */
+  ierr = PetscLogEventBegin(adctx->event4,0,0,0,0);CHKERRQ(ierr);
+  if (Compression::blocked) {
+    ierr = AdolcPropagateBlocked(tag1,m,n,p,u_vec,adctx,J);CHKERRQ(ierr);
+    if (Mass::second_tape) {
+      ierr = AdolcPropagateBlocked(tag2,m,n,p,u_vec,adctx,J2);CHKERRQ(ierr);
+    }
+  } else {
+    Compression::Propagate(tag1,m,n,p,u_vec,adctx->Seed,y,J);
+    if (Mass::second_tape)
+      Compression::Propagate(tag2,m,n,p,u_vec,adctx->Seed,y,J2);
+  }
+  if (Compression::bidirectional) {
+    Bicoloured::PropagateReverse(tag1,m,n,adctx->pR,u_vec,adctx->SeedR,y,JR);
+    if (Mass::second_tape)
+      Bicoloured::PropagateReverse(tag2,m,n,adctx->pR,u_vec,adctx->SeedR,y,JR2);
+  }
+  ierr = PetscLogEventEnd(adctx->event4,0,0,0,0);CHKERRQ(ierr);
+  if ((Compression::compressed) && (adctx->sparse_view) && (!adctx->sparse_view_done)) {
+    ierr = PrintMat(MPI_COMM_WORLD,Mass::implicit ? "Compressed Jacobian dF/dx:" : "Compressed Jacobian:",rows,cols,J);CHKERRQ(ierr);
+    if (Mass::second_tape) {
+      ierr = PrintMat(MPI_COMM_WORLD,"Compressed Jacobian dF/d(xdot):",rows,cols,J2);CHKERRQ(ierr);
+    }
+    adctx->sparse_view_done = PETSC_TRUE;
+  }
+  if (Mass::second_tape) {
+    ierr = AdolcShiftedSum(rows,cols,J,J2,a);CHKERRQ(ierr);
+    if (Compression::bidirectional) {
+      ierr = AdolcShiftedSum(adctx->pR,n,JR,JR2,a);CHKERRQ(ierr);
+    }
+  }
+
+  /* Recover and assemble, unless the pattern is frozen, in which case every entry of the pattern
+     is overwritten and assembly is not required */
+  ierr = PetscLogEventBegin(adctx->event5,0,0,0,0);CHKERRQ(ierr);
+  if ((Compression::compressed) && (!Compression::bidirectional) && (adctx->coo)) {
+    ierr = AdolcRecoverCOO<Insertion>(A,adctx,J);CHKERRQ(ierr);
+  } else {
+    /* Entries outside the recovery plan (or below the threshold, if dense) are not set */
+    ierr = MatZeroEntries(A);CHKERRQ(ierr);
+    ierr = Compression::template Recover<Insertion>(A,adctx->plan,adctx->rows,m,n,J);CHKERRQ(ierr);
+    if (Compression::bidirectional) {
+      ierr = Insertion::Recover(A,INSERT_VALUES,adctx->planR,JR,NULL);CHKERRQ(ierr);
+    }
+  }
+  ierr = PetscLogEventEnd(adctx->event5,0,0,0,0);CHKERRQ(ierr);
+  if ((!Compression::compressed) || (Compression::bidirectional) || (!adctx->coo)) {
+    ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  }
+
+  /* a * dF/d(xdot) part, in the case of an identity mass matrix */
+  if ((Mass::implicit) && (!Mass::second_tape)) {
+    ierr = MatShift(A,a);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Select the instantiation of the driver template corresponding to the ADOL-C context. If the
+  recovery plans have been grouped into blocks, the blocked counterpart of the insertion policy
+  is used, with the lower triangle ignored for SBAIJ matrices. Since the lower triangle is then
+  dropped, an SBAIJ matrix is only accepted if the Jacobian is known to be symmetric, either
+  through MAT_SYMMETRIC or -adolc_symmetric (see AdolcIJacobianSetUp).
+*/
+template <class Insertion,class Mass>
+PetscErrorCode AdolcComputeJacobianDispatch(PetscInt tag1,PetscInt tag2,Mat A,PetscScalar *u_vec,PetscReal a,AdolcCtx *adctx)
+{
+  PetscErrorCode ierr;
+  PetscBool      sbaij,set,symmetric;
+
+  PetscFunctionBegin;
+  if ((!Insertion::blocked) && (adctx->bs > 1)) {
+    ierr = PetscObjectTypeCompareAny((PetscObject)A,&sbaij,MATSBAIJ,MATSEQSBAIJ,MATMPISBAIJ,"");CHKERRQ(ierr);
+    if (sbaij) {
+      ierr = MatIsSymmetricKnown(A,&set,&symmetric);CHKERRQ(ierr);
+      if (((!set) || (!symmetric)) && (!adctx->symmetric))
+        SETERRQ(PETSC_COMM_SELF,PETSC_ERR_ARG_WRONGSTATE,"SBAIJ Jacobians require a symmetric Jacobian: set MAT_SYMMETRIC or use -adolc_symmetric");
+      ierr = MatSetOption(A,MAT_IGNORE_LOWER_TRIANGULAR,PETSC_TRUE);CHKERRQ(ierr);
+    }
+    ierr = AdolcComputeJacobianDispatch<typename Insertion::Blocked,Mass>(tag1,tag2,A,u_vec,a,adctx);CHKERRQ(ierr);
+  } else if ((adctx->sparse) && (adctx->bidirectional)) {
+    ierr = AdolcComputeJacobianImpl<Insertion,Mass,Bicoloured>(tag1,tag2,A,u_vec,a,adctx);CHKERRQ(ierr);
+  } else if ((adctx->sparse) && (adctx->reverse)) {
+    ierr = AdolcComputeJacobianImpl<Insertion,Mass,CompressedReverse>(tag1,tag2,A,u_vec,a,adctx);CHKERRQ(ierr);
+  } else if ((adctx->sparse) && (adctx->seed_block > 0)) {
+    ierr = AdolcComputeJacobianImpl<Insertion,Mass,CompressedBlocked>(tag1,tag2,A,u_vec,a,adctx);CHKERRQ(ierr);
+  } else if (adctx->sparse) {
+    ierr = AdolcComputeJacobianImpl<Insertion,Mass,Compressed>(tag1,tag2,A,u_vec,a,adctx);CHKERRQ(ierr);
+  } else {
+    ierr = AdolcComputeJacobianImpl<Insertion,Mass,Dense>(tag1,tag2,A,u_vec,a,adctx);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
 /* --------------------------------------------------------------------------------
    Drivers for RHSJacobian and IJacobian
    ----------------------------------------------------------------------------- */
@@ -22,522 +508,1438 @@
 */
 PetscErrorCode AdolcComputeRHSJacobian(PetscInt tag,Mat A,PetscScalar *u_vec,void *ctx)
 {
-  AdolcCtx       *adctx = (AdolcCtx*)ctx;
   PetscErrorCode ierr;
-  PetscInt       i,j,m = adctx->m,n = adctx->n,p = adctx->p;
-  PetscScalar    **J;
 
   PetscFunctionBegin;
-  ierr = AdolcMalloc2(m,p,&J);CHKERRQ(ierr);
-  ierr = PetscLogEventBegin(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->Seed)
-    fov_forward(tag,m,n,p,u_vec,adctx->Seed,NULL,J);
+  ierr = AdolcComputeJacobianDispatch<GlobalInsertion,NoMass>(tag,0,A,u_vec,0.,(AdolcCtx*)ctx);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute local portion of Jacobian for explicit TS in compressed format and recover from this,
+  using precomputed seed and recovery matrices. If sparse mode is not used, full Jacobian is
+  assembled (not recommended!).
+
+  Input parameters:
+  tag   - tape identifier
+  u_vec - vector at which to evaluate Jacobian
+  ctx   - ADOL-C context, as defined above
+
+  Output parameter:
+  A     - Mat object corresponding to Jacobian
+*/
+PetscErrorCode AdolcComputeRHSJacobianLocal(PetscInt tag,Mat A,PetscScalar *u_vec,void *ctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcComputeJacobianDispatch<LocalInsertion,NoMass>(tag,0,A,u_vec,0.,(AdolcCtx*)ctx);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute Jacobian for implicit TS in compressed format and recover from this, using
+  precomputed seed and recovery matrices. If sparse mode is not used, full Jacobian is
+  assembled (not recommended!).
+
+  The dF/dx and dF/d(xdot) parts are combined in compressed format, so that the Jacobian
+  is recovered and assembled just once.
+
+  Input parameters:
+  tag1   - tape identifier for df/dx part
+  tag2   - tape identifier for df/d(xdot) part
+  u_vec - vector at which to evaluate Jacobian
+  ctx   - ADOL-C context, as defined above
+
+  Output parameter:
+  A     - Mat object corresponding to Jacobian
+*/
+PetscErrorCode AdolcComputeIJacobian(PetscInt tag1,PetscInt tag2,Mat A,PetscScalar *u_vec,PetscReal a,void *ctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcComputeJacobianDispatch<GlobalInsertion,GeneralMass>(tag1,tag2,A,u_vec,a,(AdolcCtx*)ctx);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute Jacobian for implicit TS in the special case where it is
+  known that the mass matrix is simply the identity. i.e. We have
+  a problem of the form
+                        du/dt = F(u).
+
+  Input parameters:
+  tag   - tape identifier for df/dx part
+  u_vec - vector at which to evaluate Jacobian
+  ctx   - ADOL-C context, as defined above
+
+  Output parameter:
+  A     - Mat object corresponding to Jacobian
+*/
+PetscErrorCode AdolcComputeIJacobianIDMass(PetscInt tag,Mat A,PetscScalar *u_vec,PetscReal a,void *ctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcComputeJacobianDispatch<GlobalInsertion,IdentityMass>(tag,0,A,u_vec,a,(AdolcCtx*)ctx);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute local portion of Jacobian for implicit TS in compressed format and recover from this, using
+  precomputed seed and recovery matrices. If sparse mode is not used, full Jacobian is
+  assembled (not recommended!).
+
+  The dF/dx and dF/d(xdot) parts are combined in compressed format, so that the Jacobian
+  is recovered and assembled just once.
+
+  Input parameters:
+  tag1   - tape identifier for df/dx part
+  tag2   - tape identifier for df/d(xdot) part
+  u_vec - vector at which to evaluate Jacobian
+  ctx   - ADOL-C context, as defined above
+
+  Output parameter:
+  A     - Mat object corresponding to Jacobian
+*/
+PetscErrorCode AdolcComputeIJacobianLocal(PetscInt tag1,PetscInt tag2,Mat A,PetscScalar *u_vec,PetscReal a,void *ctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcComputeJacobianDispatch<LocalInsertion,GeneralMass>(tag1,tag2,A,u_vec,a,(AdolcCtx*)ctx);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute local portion of Jacobian for implicit TS in the special case where it is
+  known that the mass matrix is simply the identity. i.e. We have
+  a problem of the form
+                        du/dt = F(u).
+
+  Input parameters:
+  tag   - tape identifier for df/dx part
+  u_vec - vector at which to evaluate Jacobian
+  ctx   - ADOL-C context, as defined above
+
+  Output parameter:
+  A     - Mat object corresponding to Jacobian
+*/
+PetscErrorCode AdolcComputeIJacobianLocalIDMass(PetscInt tag,Mat A,PetscScalar *u_vec,PetscReal a,void *ctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcComputeJacobianDispatch<LocalInsertion,IdentityMass>(tag,0,A,u_vec,a,(AdolcCtx*)ctx);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* --------------------------------------------------------------------------------
+   Drivers for Jacobian w.r.t. a parameter
+   ----------------------------------------------------------------------------- */
+
+/*
+  Driver template for computing a Jacobian w.r.t. k parameters for explicit TS. Only the
+  parameter directions are propagated, using fos_forward if a single direction is required and
+  fov_forward otherwise.
+
+  By default, the k parameter directions are seeded with the identity. If a seed matrix and
+  recovery plan for the parameters have been set up by AdolcJacobianPSetUp, then q <= k compressed
+  directions are propagated instead.
+
+  Input parameters:
+  u_vec - vector at which to evaluate Jacobian
+  k     - number of parameters
+  param - array of parameters
+  tag   - tape identifier, with independent variables followed by parameters
+  adctx - ADOL-C context, as defined above
+
+  Output parameter:
+  A     - Mat object corresponding to Jacobian, with k columns
+*/
+template <class Insertion>
+PetscErrorCode AdolcComputeJacobianPImpl(Mat A,PetscScalar *u_vec,PetscInt k,PetscScalar *param,PetscInt tag,AdolcCtx *adctx)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,j,row,m = adctx->m,n = adctx->n,q;
+  PetscScalar    **J,**S,*concat;
+
+  PetscFunctionBegin;
+  if (adctx->SeedP) {
+    q = adctx->q;
+    S = adctx->SeedP;
+  } else {
+    q = k;
+    ierr = AdolcWorkspaceGetSeedP(adctx,n,k,&S);CHKERRQ(ierr);
+  }
+  ierr = AdolcWorkspaceGetJacobianP(adctx,m,q,&J);CHKERRQ(ierr);
+  ierr = AdolcWorkspaceGetConcat(adctx,n+k,&concat);CHKERRQ(ierr);
+  ierr = PetscMemcpy(concat,u_vec,n*sizeof(PetscScalar));CHKERRQ(ierr);
+  ierr = PetscMemcpy(&concat[n],param,k*sizeof(PetscScalar));CHKERRQ(ierr);
+
+  /* Propagate parameter directions */
+  if (q == 1)
+    fos_forward(tag,m,n+k,0,concat,S[0],NULL,J[0]);
   else
-    jacobian(tag,m,n,u_vec,J);
-  ierr = PetscLogEventEnd(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->sparse) {
-    if ((adctx->sparse_view) && (!adctx->sparse_view_done)) {
-      ierr = PrintMat(MPI_COMM_WORLD,"Compressed Jacobian:",m,p,J);CHKERRQ(ierr);
-      adctx->sparse_view_done = PETSC_TRUE;
-    }
-    ierr = PetscLogEventBegin(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-    ierr = RecoverJacobian(A,INSERT_VALUES,m,p,adctx->Rec,J,NULL);CHKERRQ(ierr);
-    ierr = PetscLogEventEnd(adctx->event5,0,0,0,0);CHKERRQ(ierr);
+    fov_forward(tag,m,n+k,q,concat,S,NULL,J);
+
+  ierr = MatZeroEntries(A);CHKERRQ(ierr); /* Entries outside the plan or below the threshold are not set */
+  if (adctx->planP) {
+    ierr = Insertion::Recover(A,INSERT_VALUES,adctx->planP,J,NULL);CHKERRQ(ierr);
   } else {
     for (i=0; i<m; i++) {
-      for (j=0; j<n; j++) {
+      row = adctx->rows ? adctx->rows[i] : i;
+      for (j=0; j<k; j++) {
         if (fabs(J[i][j]) > 1.e-16) {
-          ierr = MatSetValues(A,1,&i,1,&j,&J[i][j],INSERT_VALUES);CHKERRQ(ierr);
+          ierr = Insertion::SetValue(A,row,j,&J[i][j],INSERT_VALUES);CHKERRQ(ierr);
         }
       }
     }
   }
-  ierr = AdolcFree2(J);CHKERRQ(ierr);
-  ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute Jacobian w.r.t. k parameters for explicit TS. See AdolcComputeJacobianPImpl.
+
+  Input parameters:
+  u_vec - vector at which to evaluate Jacobian
+  k     - number of parameters
+  param - array of parameters
+  tag   - tape identifier, with independent variables followed by parameters
+  ctx   - ADOL-C context, as defined above
+
+  Output parameter:
+  A     - Mat object corresponding to Jacobian, with k columns
+*/
+PetscErrorCode AdolcComputeRHSJacobianP(Mat A,PetscScalar *u_vec,PetscInt k,PetscScalar *param,PetscInt tag,void *ctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcComputeJacobianPImpl<GlobalInsertion>(A,u_vec,k,param,tag,(AdolcCtx*)ctx);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute local portion of Jacobian w.r.t. k parameters for explicit TS. See
+  AdolcComputeJacobianPImpl.
+
+  Input parameters:
+  u_vec - vector at which to evaluate Jacobian
+  k     - number of parameters
+  param - array of parameters
+  tag   - tape identifier, with independent variables followed by parameters
+  ctx   - ADOL-C context, as defined above
+
+  Output parameter:
+  A     - Mat object corresponding to Jacobian, with k columns
+*/
+PetscErrorCode AdolcComputeRHSJacobianPLocal(Mat A,PetscScalar *u_vec,PetscInt k,PetscScalar *param,PetscInt tag,void *ctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcComputeJacobianPImpl<LocalInsertion>(A,u_vec,k,param,tag,(AdolcCtx*)ctx);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+
+/* --------------------------------------------------------------------------------
+   Drivers for Jacobian diagonal
+   ----------------------------------------------------------------------------- */
+
+/*
+  Propagate the dF/dx and dF/d(xdot) parts of an implicit Jacobian using the diagonal-only seed
+  matrix set up by AdolcDiagonalSetUp, and combine them in compressed format. If no diagonal
+  seed matrix is available, the full Jacobian is propagated.
+
+  Input parameters:
+  tag1  - tape identifier for df/dx part
+  tag2  - tape identifier for df/d(xdot) part, or negative if the mass matrix is the identity
+  u_vec - vector at which to evaluate Jacobian
+  a     - shift
+  adctx - ADOL-C context, as defined above
+
+  Output parameter:
+  J     - compressed Jacobian dF/dx + a * dF/d(xdot), owned by the workspace
+*/
+PetscErrorCode AdolcPropagateDiagonal(PetscInt tag1,PetscInt tag2,PetscScalar *u_vec,PetscReal a,AdolcCtx *adctx,PetscScalar ***J)
+{
+  PetscErrorCode ierr;
+  PetscInt       m = adctx->m,n = adctx->n,p = adctx->SeedD ? adctx->pD : n;
+  PetscScalar    **J2 = NULL;
+
+  PetscFunctionBegin;
+  ierr = AdolcWorkspaceGetJacobian(adctx,m,p,J);CHKERRQ(ierr);
+  if (tag2 >= 0) {
+    ierr = AdolcWorkspaceGetJacobian2(adctx,m,p,&J2);CHKERRQ(ierr);
+  }
+  ierr = PetscLogEventBegin(adctx->event4,0,0,0,0);CHKERRQ(ierr);
+  if (adctx->SeedD) {
+    fov_forward(tag1,m,n,p,u_vec,adctx->SeedD,NULL,*J);
+    if (tag2 >= 0)
+      fov_forward(tag2,m,n,p,u_vec,adctx->SeedD,NULL,J2);
+  } else {
+    jacobian(tag1,m,n,u_vec,*J);
+    if (tag2 >= 0)
+      jacobian(tag2,m,n,u_vec,J2);
+  }
+  ierr = PetscLogEventEnd(adctx->event4,0,0,0,0);CHKERRQ(ierr);
+  if (tag2 >= 0) {
+    ierr = AdolcShiftedSum(m,p,*J,J2,a);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute local portion of Jacobian diagonal for implicit TS, using the diagonal-only seed matrix
+  and recovery vector set up by AdolcDiagonalSetUp (or the full Jacobian, if these are not set).
+
+  Input parameters:
+  tag1  - tape identifier for df/dx part
+  tag2  - tape identifier for df/d(xdot) part, or negative if the mass matrix is the identity
+  u_vec - vector at which to evaluate Jacobian
+  a     - shift
+  ctx   - ADOL-C context, as defined above
+
+  Output parameter:
+  diag  - array of length m holding the Jacobian diagonal, in local (ghosted) numbering
+*/
+PetscErrorCode AdolcComputeIJacobianDiagonal(PetscInt tag1,PetscInt tag2,PetscScalar *diag,PetscScalar *u_vec,PetscReal a,void *ctx)
+{
+  AdolcCtx       *adctx = (AdolcCtx*)ctx;
+  PetscErrorCode ierr;
+  PetscInt       i;
+  PetscScalar    **J,shift = (tag2 >= 0) ? 0. : a;
+
+  PetscFunctionBegin;
+  ierr = AdolcPropagateDiagonal(tag1,tag2,u_vec,a,adctx,&J);CHKERRQ(ierr);
+  ierr = PetscLogEventBegin(adctx->event5,0,0,0,0);CHKERRQ(ierr);
+  if (adctx->SeedD) {
+    for (i=0; i<adctx->m; i++) diag[i] = J[i][adctx->rec[i]] + shift;
+  } else {
+    for (i=0; i<adctx->m; i++) diag[i] = J[i][i] + shift;
+  }
+  ierr = PetscLogEventEnd(adctx->event5,0,0,0,0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* --------------------------------------------------------------------------------
+   Setup for Jacobian drivers
+   ----------------------------------------------------------------------------- */
+
+/*
+  Mark only the owned points of a DMDA as dependents, rather than every point of the local patch.
+  Ghost rows of the Jacobian of a local function are empty, so this shrinks the number of
+  dependents m (and therefore the compressed Jacobian, the row seed matrix and the recovery plans)
+  to the owned points, at the cost of a map from each dependent to its local row. This should be
+  called before tracing, with tracing routines marking dependents over the owned patch only if the
+  map is set. The map is freed by AdolcJacobianDestroy.
+
+  Input parameters:
+  da    - distributed array upon which the traced function is defined
+  adctx - ADOL-C context
+
+  Output parameter:
+  adctx - ADOL-C context, with m and the row map set
+*/
+PetscErrorCode AdolcSetOwnedDependents(DM da,AdolcCtx *adctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = PetscFree(adctx->rows);CHKERRQ(ierr);
+  ierr = DMGetOwnedRows(da,&adctx->rows,&adctx->m);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Register log events for sparsity pattern computation, colouring, propagation and recovery, if
+  these have not already been registered by the caller
+
+  Input parameter:
+  adctx - ADOL-C context
+*/
+PetscErrorCode AdolcRegisterEvents(AdolcCtx *adctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  if (!adctx->event2) {
+    ierr = PetscLogEventRegister("Sparsitypattern",MAT_CLASSID,&adctx->event2);CHKERRQ(ierr);
+  }
+  if (!adctx->event3) {
+    ierr = PetscLogEventRegister("Colouring",MAT_CLASSID,&adctx->event3);CHKERRQ(ierr);
+  }
+  if (!adctx->event4) {
+    ierr = PetscLogEventRegister("Propagation",MAT_CLASSID,&adctx->event4);CHKERRQ(ierr);
+  }
+  if (!adctx->event5) {
+    ierr = PetscLogEventRegister("Recovery",MAT_CLASSID,&adctx->event5);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute the sparsity pattern of a traced function. If a DMDA is given then, by default, the
+  pattern is generated from its stencil (see DMGetSparsity), which avoids a sweep over the tape.
+  Otherwise, jac_pat is used. If a second tape is given, the union of both sparsity patterns is
+  taken, so that colourings are valid for both dF/dx and dF/d(xdot).
+
+  Options:
+  -adolc_sparsity_pattern <dm>  - generate the sparsity pattern from the DMDA stencil (dm) or the
+                                  tape (tape)
+  -adolc_sparsity_check         - check that the tape pattern is contained in the DMDA pattern
+
+  Input parameters:
+  da    - distributed array upon which the traced function is defined, in local numbering (may
+          be NULL)
+  tag1  - tape identifier for dF/dx part
+  tag2  - tape identifier for dF/d(xdot) part, or negative if there is no second tape
+  m,n   - number of dependent and independent variables
+  rows  - local (ghosted) row of each dependent, if only owned points are dependents, or NULL
+
+  Output parameter:
+  JP    - sparsity pattern, in the format used by jac_pat, which should be freed row by row
+*/
+PetscErrorCode AdolcGetSparsityPattern(DM da,PetscInt tag1,PetscInt tag2,PetscInt m,PetscInt n,const PetscInt *rows,unsigned int ***JP)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,k,l,gm,ctrl[3] = {0,0,0},pattern = 0,bad;
+  PetscScalar    *u_vec;
+  PetscBool      check = PETSC_FALSE;
+  const char     *patterns[2] = {"dm","tape"};
+  unsigned int   **JP1,**JP2,*row;
+  DMDALocalInfo  info;
+
+  PetscFunctionBegin;
+  ierr = PetscOptionsGetEList(NULL,NULL,"-adolc_sparsity_pattern",patterns,2,&pattern,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparsity_check",&check,NULL);CHKERRQ(ierr);
+  if ((da) && (pattern == 0)) {
+    ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+    gm = info.gxm*info.gym*info.gzm*info.dof;
+    if ((n != gm) || ((!rows) && (m != gm)))
+      SETERRQ2(PETSC_COMM_SELF,PETSC_ERR_ARG_SIZ,"Tape dimensions %D x %D do not match local DMDA size. Use -adolc_sparsity_pattern tape",m,n);
+    *JP = (unsigned int **) malloc(gm*sizeof(unsigned int*));
+    ierr = DMGetSparsity(da,*JP);CHKERRQ(ierr);
+
+    /* Keep only the rows of dependents, which appear in increasing order */
+    if (rows) {
+      for (i=0,l=0; i<gm; i++) {
+        if ((l < m) && (rows[l] == i)) (*JP)[l++] = (*JP)[i];
+        else free((*JP)[i]);
+      }
+    }
+    if (!check) PetscFunctionReturn(0);
+    ierr = AdolcGetSparsityPattern(NULL,tag1,tag2,m,n,rows,&JP1);CHKERRQ(ierr);
+    ierr = CheckSparsity(m,n,*JP,JP1,&bad);CHKERRQ(ierr);
+    for (i=0; i<m; i++)
+      free(JP1[i]);
+    free(JP1);
+    if (bad >= 0)
+      SETERRQ1(PETSC_COMM_SELF,PETSC_ERR_PLIB,"Tape sparsity pattern not contained in DMDA stencil at row %D. Use -adolc_sparsity_pattern tape",bad);
+    PetscFunctionReturn(0);
+  }
+  ierr = PetscCalloc1(n,&u_vec);CHKERRQ(ierr);
+  JP1 = (unsigned int **) malloc(m*sizeof(unsigned int*));
+  jac_pat(tag1,m,n,u_vec,JP1,ctrl);
+  if (tag2 >= 0) {
+    JP2 = (unsigned int **) malloc(m*sizeof(unsigned int*));
+    jac_pat(tag2,m,n,u_vec,JP2,ctrl);
+    for (i=0; i<m; i++) {
+      row    = (unsigned int *) malloc((1+JP1[i][0]+JP2[i][0])*sizeof(unsigned int));
+      row[0] = JP1[i][0];
+      for (k=1; k<=(PetscInt) JP1[i][0]; k++) row[k] = JP1[i][k];
+      std::sort(row+1,row+1+JP1[i][0]);
+      for (k=1; k<=(PetscInt) JP2[i][0]; k++) {
+        if (!std::binary_search(row+1,row+1+JP1[i][0],JP2[i][k])) row[++row[0]] = JP2[i][k];
+      }
+      std::sort(row+1,row+1+row[0]);
+      free(JP1[i]);
+      free(JP2[i]);
+      JP1[i] = row;
+    }
+    free(JP2);
+  }
+  ierr = PetscFree(u_vec);CHKERRQ(ierr);
+  *JP = JP1;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute the key under which the compression objects for a function traced on a DMDA are cached.
+  This is an FNV-1a hash of everything the sparsity pattern, colouring and strategy depend upon:
+  the DMDA sizes, degrees of freedom, stencil, boundary types, rank layout and local patch, the
+  statistics of the tape(s) and the options which affect the choice of strategy.
+
+  ADOL-C does not expose the operations on a tape, so the tape is identified only by its numbers
+  of independents, dependents, operations, locations, values and live variables. A change to the
+  traced function which leaves all of these unchanged (e.g. swapping the arguments of a product)
+  is not detected, so cache files should be removed whenever the traced function is modified.
+
+  Input parameters:
+  da      - distributed array upon which the traced function is defined
+  tag1    - tape identifier for dF/dx part
+  tag2    - tape identifier for dF/d(xdot) part, or negative if there is no second tape
+  options - integer-valued options which affect the choice of strategy
+  nopt    - number of options
+
+  Output parameter:
+  key     - hash key
+*/
+PetscErrorCode AdolcCacheKey(DM da,PetscInt tag1,PetscInt tag2,const PetscInt *options,PetscInt nopt,unsigned long long *key)
+{
+  PetscErrorCode ierr;
+  DMDALocalInfo  info;
+  PetscMPIInt    rank,size;
+  PetscInt       i,nv = 0,values[64];
+  size_t         stats[STAT_SIZE];
+
+  PetscFunctionBegin;
+  ierr = MPI_Comm_rank(PETSC_COMM_WORLD,&rank);CHKERRQ(ierr);
+  ierr = MPI_Comm_size(PETSC_COMM_WORLD,&size);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+  values[nv++] = rank;values[nv++] = size;
+  values[nv++] = info.dim;values[nv++] = info.dof;values[nv++] = info.sw;values[nv++] = info.st;
+  values[nv++] = info.mx;values[nv++] = info.my;values[nv++] = info.mz;
+  values[nv++] = info.bx;values[nv++] = info.by;values[nv++] = info.bz;
+  values[nv++] = info.xs;values[nv++] = info.ys;values[nv++] = info.zs;
+  values[nv++] = info.xm;values[nv++] = info.ym;values[nv++] = info.zm;
+  values[nv++] = info.gxs;values[nv++] = info.gys;values[nv++] = info.gzs;
+  values[nv++] = info.gxm;values[nv++] = info.gym;values[nv++] = info.gzm;
+  tapestats(tag1,stats);
+  values[nv++] = stats[NUM_INDEPENDENTS];values[nv++] = stats[NUM_DEPENDENTS];values[nv++] = stats[NUM_OPERATIONS];
+  values[nv++] = stats[NUM_LOCATIONS];values[nv++] = stats[NUM_VALUES];values[nv++] = stats[NUM_MAX_LIVES];
+  values[nv++] = tag2;
+  if (tag2 >= 0) {
+    tapestats(tag2,stats);
+    values[nv++] = stats[NUM_INDEPENDENTS];values[nv++] = stats[NUM_DEPENDENTS];values[nv++] = stats[NUM_OPERATIONS];
+    values[nv++] = stats[NUM_LOCATIONS];values[nv++] = stats[NUM_VALUES];values[nv++] = stats[NUM_MAX_LIVES];
+  }
+  if (nv+nopt > 64) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_ARG_OUTOFRANGE,"Too many options to hash");
+  for (i=0; i<nopt; i++) values[nv++] = options[i];
+
+  *key = 14695981039346656037ULL;
+  for (i=0; i<(PetscInt) (nv*sizeof(PetscInt)); i++) {
+    *key ^= ((unsigned char *) values)[i];
+    *key *= 1099511628211ULL;
+  }
+  PetscFunctionReturn(0);
+}
+
+#define ADOLC_CACHE_MAGIC 1128547651
+
+/*
+  Write the compression objects of an ADOL-C context to a (per-rank) binary cache file. Seed
+  matrices are not written, since they are cheaply regenerated from the colour vectors. The file
+  is written via a temporary file, so that it is never read while partially written.
+
+  Input parameters:
+  filename - name of cache file
+  adctx    - ADOL-C context, as set up by AdolcIJacobianSetUp
+  counts   - numbers of colours for each strategy considered, for viewing purposes
+  density  - density of the sparsity pattern, for viewing purposes
+*/
+PetscErrorCode AdolcCacheWrite(const char *filename,AdolcCtx *adctx,const PetscInt *counts,PetscReal density)
+{
+  PetscErrorCode ierr;
+  PetscViewer    viewer;
+  PetscInt       header[12];
+  char           tmpname[PETSC_MAX_PATH_LEN];
+
+  PetscFunctionBegin;
+  header[0] = ADOLC_CACHE_MAGIC;
+  header[1] = adctx->m;header[2] = adctx->n;
+  header[3] = adctx->sparse;header[4] = adctx->reverse;header[5] = adctx->bidirectional;
+  header[6] = adctx->p;header[7] = adctx->pR;
+  header[8] = counts[0];header[9] = counts[1];header[10] = counts[2];header[11] = counts[3];
+  ierr = PetscSNPrintf(tmpname,sizeof(tmpname),"%s.tmp",filename);CHKERRQ(ierr);
+  ierr = PetscViewerBinaryOpen(PETSC_COMM_SELF,tmpname,FILE_MODE_WRITE,&viewer);CHKERRQ(ierr);
+  ierr = BinaryWriteInt(viewer,header,12);CHKERRQ(ierr);
+  header[0] = (PetscInt) (density*1.e6);
+  ierr = BinaryWriteInt(viewer,header,1);CHKERRQ(ierr);
+  if (adctx->sparse) {
+    ierr = BinaryWriteInt(viewer,adctx->colours,adctx->reverse ? adctx->m : adctx->n);CHKERRQ(ierr);
+    ierr = RecPlanWrite(viewer,adctx->plan);CHKERRQ(ierr);
+    if (adctx->bidirectional) {
+      ierr = BinaryWriteInt(viewer,adctx->coloursR,adctx->m);CHKERRQ(ierr);
+      ierr = RecPlanWrite(viewer,adctx->planR);CHKERRQ(ierr);
+    }
+  }
+  ierr = PetscViewerDestroy(&viewer);CHKERRQ(ierr);
+  if (rename(tmpname,filename)) SETERRQ1(PETSC_COMM_SELF,PETSC_ERR_FILE_WRITE,"Unable to write ADOL-C cache file %s",filename);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Free any compression objects held by an ADOL-C context and reset its strategy, so that they may
+  be computed afresh after a cache miss
+
+  Input parameter:
+  adctx - ADOL-C context
+*/
+PetscErrorCode AdolcCacheDiscard(AdolcCtx *adctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = RecPlanDestroy(&adctx->plan);CHKERRQ(ierr);
+  ierr = RecPlanDestroy(&adctx->planR);CHKERRQ(ierr);
+  if (adctx->Seed) {
+    ierr = AdolcFree2(adctx->Seed);CHKERRQ(ierr);
+    adctx->Seed = NULL;
+  }
+  if (adctx->SeedR) {
+    ierr = AdolcFree2(adctx->SeedR);CHKERRQ(ierr);
+    adctx->SeedR = NULL;
+  }
+  ierr = PetscFree(adctx->colours);CHKERRQ(ierr);
+  ierr = PetscFree(adctx->coloursR);CHKERRQ(ierr);
+  adctx->reverse = adctx->bidirectional = PETSC_FALSE;
+  adctx->p = adctx->pR = 0;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Check that colours read from a cache file lie in range, before they are used to index a seed
+  matrix
+
+  Input parameters:
+  colours - colour of each row or column
+  n       - number of rows or columns
+  p       - number of colours
+*/
+PetscErrorCode AdolcCacheCheckColours(const PetscInt *colours,PetscInt n,PetscInt p)
+{
+  PetscInt i;
+
+  PetscFunctionBegin;
+  for (i=0; i<n; i++) {
+    if ((colours[i] < 0) || (colours[i] >= p)) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Colour out of range");
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Read the compression objects of an ADOL-C context from an open cache file (see AdolcCacheRead)
+
+  Input parameter:
+  viewer   - binary viewer
+
+  Output parameters:
+  adctx    - ADOL-C context, with dimensions m and n set on input
+  counts   - numbers of colours for each strategy considered
+  density  - density of the sparsity pattern
+*/
+PetscErrorCode AdolcCacheReadViewer(PetscViewer viewer,AdolcCtx *adctx,PetscInt *counts,PetscReal *density)
+{
+  PetscErrorCode ierr;
+  PetscInt       header[12],m = adctx->m,n = adctx->n;
+
+  PetscFunctionBegin;
+  ierr = BinaryReadInt(viewer,header,12);CHKERRQ(ierr);
+  if (header[0] != ADOLC_CACHE_MAGIC) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Not an ADOL-C cache file");
+  if ((header[1] != m) || (header[2] != n))
+    SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Cache file does not match the tape dimensions");
+  if ((header[6] < 0) || (header[6] > PetscMax(m,n)) || (header[7] < 0) || (header[7] > m))
+    SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Cache file holds an invalid number of colours");
+  adctx->sparse        = (PetscBool) header[3];
+  adctx->reverse       = (PetscBool) header[4];
+  adctx->bidirectional = (PetscBool) header[5];
+  adctx->p             = header[6];
+  adctx->pR            = header[7];
+  counts[0] = header[8];counts[1] = header[9];counts[2] = header[10];counts[3] = header[11];
+  ierr = BinaryReadInt(viewer,header,1);CHKERRQ(ierr);
+  *density = header[0]*1.e-6;
+  if (adctx->sparse) {
+    if (adctx->reverse) {
+      ierr = PetscMalloc1(m,&adctx->colours);CHKERRQ(ierr);
+      ierr = BinaryReadInt(viewer,adctx->colours,m);CHKERRQ(ierr);
+      ierr = AdolcCacheCheckColours(adctx->colours,m,adctx->p);CHKERRQ(ierr);
+      ierr = AdolcMalloc2(adctx->p,m,&adctx->Seed);CHKERRQ(ierr);
+      ierr = GenerateRowSeedMatrixFromColors(m,adctx->colours,adctx->Seed);CHKERRQ(ierr);
+    } else {
+      ierr = PetscMalloc1(n,&adctx->colours);CHKERRQ(ierr);
+      ierr = BinaryReadInt(viewer,adctx->colours,n);CHKERRQ(ierr);
+      ierr = AdolcCacheCheckColours(adctx->colours,n,adctx->p);CHKERRQ(ierr);
+      if ((adctx->seed_block <= 0) || (adctx->bidirectional)) {
+        ierr = AdolcMalloc2(n,adctx->p,&adctx->Seed);CHKERRQ(ierr);
+        ierr = GenerateSeedMatrixFromColors(n,adctx->colours,adctx->Seed);CHKERRQ(ierr);
+      }
+    }
+    /* The compressed Jacobian is m x p by columns, or p x n by rows */
+    ierr = RecPlanRead(viewer,m,n,adctx->reverse ? adctx->p*n : m*adctx->p,&adctx->plan);CHKERRQ(ierr);
+    if (adctx->bidirectional) {
+      ierr = PetscMalloc1(m,&adctx->coloursR);CHKERRQ(ierr);
+      ierr = BinaryReadInt(viewer,adctx->coloursR,m);CHKERRQ(ierr);
+      ierr = AdolcCacheCheckColours(adctx->coloursR,m,adctx->pR);CHKERRQ(ierr);
+      ierr = AdolcMalloc2(adctx->pR,m,&adctx->SeedR);CHKERRQ(ierr);
+      ierr = GenerateRowSeedMatrixFromColors(m,adctx->coloursR,adctx->SeedR);CHKERRQ(ierr);
+      ierr = RecPlanRead(viewer,m,n,adctx->pR*n,&adctx->planR);CHKERRQ(ierr);
+    }
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Read the compression objects of an ADOL-C context from a binary cache file, as written by
+  AdolcCacheWrite, and regenerate the seed matrices (except for a column seed matrix which is
+  generated in blocks during propagation). A missing, truncated or otherwise invalid file is
+  treated as a cache miss, rather than an error, so that the objects are simply recomputed.
+
+  Input parameter:
+  filename - name of cache file
+
+  Output parameters:
+  adctx    - ADOL-C context, with dimensions m and n set on input
+  counts   - numbers of colours for each strategy considered
+  density  - density of the sparsity pattern
+  hit      - whether the compression objects were read
+*/
+PetscErrorCode AdolcCacheRead(const char *filename,AdolcCtx *adctx,PetscInt *counts,PetscReal *density,PetscBool *hit)
+{
+  PetscErrorCode ierr,rerr;
+  PetscViewer    viewer = NULL;
+
+  PetscFunctionBegin;
+  ierr = PetscTestFile(filename,'r',hit);CHKERRQ(ierr);
+  if (!*hit) PetscFunctionReturn(0);
+#if PETSC_VERSION_LT(3,14,0)
+  ierr = PetscPushErrorHandler(PetscIgnoreErrorHandler,NULL);CHKERRQ(ierr);
+#else
+  ierr = PetscPushErrorHandler(PetscReturnErrorHandler,NULL);CHKERRQ(ierr);
+#endif
+  rerr = PetscViewerBinaryOpen(PETSC_COMM_SELF,filename,FILE_MODE_READ,&viewer);
+  if (!rerr) rerr = AdolcCacheReadViewer(viewer,adctx,counts,density);
+  ierr = PetscPopErrorHandler();CHKERRQ(ierr);
+  ierr = PetscViewerDestroy(&viewer);CHKERRQ(ierr);
+  if (rerr) {
+    ierr = PetscInfo1(NULL,"Ignoring invalid ADOL-C cache file %s\n",filename);CHKERRQ(ierr);
+    ierr = AdolcCacheDiscard(adctx);CHKERRQ(ierr);
+    *hit = PETSC_FALSE;
+  }
   PetscFunctionReturn(0);
 }
 
 /*
-  Compute Jacobian for explicit TS in compressed format and recover from this, using
-  precomputed seed and recovery matrices. If sparse mode is not used, full Jacobian is
-  assembled (not recommended!).
+  Get a stencil tile for a DMDA, reading it from a file if one exists for the same dimension,
+  degrees of freedom and stencil, or computing it (see StencilTileCreate) and writing it otherwise.
+  A truncated or otherwise invalid file is treated in the same way as a mismatch, so that the tile
+  is recomputed and the file rewritten. Since the tile is independent of the grid size and
+  partition, the same file may be used however the grid is refined or rebalanced between runs. The
+  file is written by the first rank, via a temporary file, so that other ranks never read a
+  partially written tile.
 
   Input parameters:
-  tag   - tape identifier
-  u_vec - vector at which to evaluate Jacobian
-  ctx   - ADOL-C context, as defined above
+  da       - distributed array
+  filename - name of tile file
 
   Output parameter:
-  A     - Mat object corresponding to Jacobian
+  tile     - stencil tile, which should be freed using StencilTileDestroy
 */
-PetscErrorCode AdolcComputeRHSJacobianLocal(PetscInt tag,Mat A,PetscScalar *u_vec,void *ctx)
+PetscErrorCode AdolcGetStencilTile(DM da,const char *filename,StencilTile **tile)
 {
-  AdolcCtx       *adctx = (AdolcCtx*)ctx;
-  PetscErrorCode ierr;
-  PetscInt       i,j,m = adctx->m,n = adctx->n,p = adctx->p;
-  PetscScalar    **J;
+  PetscErrorCode ierr,rerr;
+  PetscViewer    viewer = NULL;
+  PetscBool      exists,match = PETSC_FALSE;
+  PetscMPIInt    rank;
+  char           tmpname[PETSC_MAX_PATH_LEN];
 
   PetscFunctionBegin;
-  ierr = AdolcMalloc2(m,p,&J);CHKERRQ(ierr);
-  ierr = PetscLogEventBegin(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->Seed)
-    fov_forward(tag,m,n,p,u_vec,adctx->Seed,NULL,J);
-  else
-    jacobian(tag,m,n,u_vec,J);
-  ierr = PetscLogEventEnd(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->sparse) {
-    if ((adctx->sparse_view) && (!adctx->sparse_view_done)) {
-      ierr = PrintMat(MPI_COMM_WORLD,"Compressed Jacobian:",m,p,J);CHKERRQ(ierr);
-      adctx->sparse_view_done = PETSC_TRUE;
-    }
-    ierr = PetscLogEventBegin(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-    ierr = RecoverJacobianLocal(A,INSERT_VALUES,m,p,adctx->Rec,J,NULL);CHKERRQ(ierr);
-    ierr = PetscLogEventEnd(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-  } else {
-    for (i=0; i<m; i++) {
-      for (j=0; j<n; j++) {
-        if (fabs(J[i][j]) > 1.e-16) {
-          ierr = MatSetValuesLocal(A,1,&i,1,&j,&J[i][j],INSERT_VALUES);CHKERRQ(ierr);
-        }
+  *tile = NULL;
+  ierr = PetscTestFile(filename,'r',&exists);CHKERRQ(ierr);
+  if (exists) {
+#if PETSC_VERSION_LT(3,14,0)
+    ierr = PetscPushErrorHandler(PetscIgnoreErrorHandler,NULL);CHKERRQ(ierr);
+#else
+    ierr = PetscPushErrorHandler(PetscReturnErrorHandler,NULL);CHKERRQ(ierr);
+#endif
+    rerr = PetscViewerBinaryOpen(PETSC_COMM_SELF,filename,FILE_MODE_READ,&viewer);
+    if (!rerr) rerr = StencilTileRead(viewer,tile);
+    ierr = PetscPopErrorHandler();CHKERRQ(ierr);
+    ierr = PetscViewerDestroy(&viewer);CHKERRQ(ierr);
+    if (!rerr) {
+      ierr = StencilTileMatch(da,*tile,&match);CHKERRQ(ierr);
+      if (match) {
+        ierr = PetscInfo1(NULL,"Read stencil tile from %s\n",filename);CHKERRQ(ierr);
+        PetscFunctionReturn(0);
       }
+    } else {
+      ierr = PetscInfo1(NULL,"Ignoring invalid stencil tile file %s\n",filename);CHKERRQ(ierr);
     }
+    ierr = StencilTileDestroy(tile);CHKERRQ(ierr);
+  }
+  ierr = StencilTileCreate(da,tile);CHKERRQ(ierr);
+  ierr = MPI_Comm_rank(PETSC_COMM_WORLD,&rank);CHKERRQ(ierr);
+  if (!rank) {
+    ierr = PetscSNPrintf(tmpname,sizeof(tmpname),"%s.tmp",filename);CHKERRQ(ierr);
+    ierr = PetscViewerBinaryOpen(PETSC_COMM_SELF,tmpname,FILE_MODE_WRITE,&viewer);CHKERRQ(ierr);
+    ierr = StencilTileWrite(viewer,*tile);CHKERRQ(ierr);
+    ierr = PetscViewerDestroy(&viewer);CHKERRQ(ierr);
+    if (rename(tmpname,filename)) SETERRQ1(PETSC_COMM_SELF,PETSC_ERR_FILE_WRITE,"Unable to write stencil tile to %s",filename);
+    ierr = PetscInfo1(NULL,"Wrote stencil tile to %s\n",filename);CHKERRQ(ierr);
   }
-  ierr = AdolcFree2(J);CHKERRQ(ierr);
-  ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
 
 /*
-  Compute Jacobian for implicit TS in compressed format and recover from this, using
-  precomputed seed and recovery matrices. If sparse mode is not used, full Jacobian is
-  assembled (not recommended!).
+  Set up the ADOL-C context for Jacobian computation, once the function of interest has been
+  traced. The sparsity pattern is generated from the stencil of the DMDA, if provided, or using
+  jac_pat otherwise (see AdolcGetSparsityPattern). Unless the density of the Jacobian exceeds a
+  threshold, compressed mode is chosen. Otherwise, the full Jacobian is propagated.
+
+  In compressed mode, the Jacobian may be compressed by columns and propagated in vector forward
+  mode, compressed by rows and propagated in vector reverse mode, or compressed from both sides
+  using a star bicolouring (if PETSc is configured with ColPack), so that a few dense rows and
+  columns do not force a large number of sweeps. By default, each available colouring is
+  computed and whichever requires the fewest sweeps is used, with ties going to forward mode.
+  If a DMDA is provided then, by default, its local patch is coloured from the stencil (see
+  GetStencilColoring), which is valid for periodic boundaries on any number of ranks. Otherwise,
+  the sparsity pattern is coloured greedily. Other colouring backends may be selected, or each
+  tried in turn (see GetColumnColoring).
+
+  A DMDA may instead be coloured by tiling the colouring of a small periodic tile, which may be
+  stored in a file and reused for any grid size or partition with the same stencil (see
+  AdolcGetStencilTile), so that no colouring is computed when the grid is refined or rebalanced.
+
+  Options:
+  -adolc_sparse <bool>           - enforce compressed (or full) mode, rather than choosing automatically
+  -adolc_sparse_threshold <0.5>  - density above which the full Jacobian is propagated
+  -adolc_sparse_mode <auto>      - compress by columns (forward), by rows (reverse), from both sides
+                                   (bidirectional), or choose automatically (auto)
+  -adolc_sparse_view             - print sparsity pattern and seed matrix
+  -adolc_strategy_view           - print chosen strategy, number of colours and predicted memory
+                                   and flops per Jacobian evaluation
+  -adolc_sparsity_pattern <dm>   - generate the sparsity pattern from the DMDA stencil or the tape
+  -adolc_sparsity_check          - check that the tape pattern is contained in the DMDA pattern
+  -adolc_coloring <stencil>      - column colouring backend: stencil, tile, dm, block, greedy or (with ColPack)
+                                   colpack_natural, colpack_largest_first, colpack_smallest_last
+                                   or colpack_incidence_degree. Use auto to try each and keep the
+                                   one with the fewest colours
+  -adolc_coloring_tile <file>    - colour the DMDA using the stencil tile held in a file, computing
+                                   and writing it if the file does not exist or does not match
+  -adolc_seed_block <b>          - for compression by columns, do not store the seed matrix, but
+                                   generate it from the colours in blocks of b directions, each
+                                   propagated separately (0 to store the whole seed matrix)
+  -adolc_cache <prefix>          - read the compression objects from a per-rank binary cache file
+                                   if a valid one exists on every rank for this DMDA layout and tape
+                                   (see AdolcCacheKey), or write one if not
+  -adolc_block_recovery <bool>   - group the recovery plan into dof x dof blocks and insert using
+                                   MatSetValuesBlocked (default if the DMDA matrix type is BAIJ or
+                                   SBAIJ). Not used with bidirectional compression
+  -adolc_symmetric               - assert that the Jacobian is symmetric. Since only the upper
+                                   triangle is inserted into an SBAIJ matrix, blocked recovery into
+                                   one is refused unless this is set, or the matrix is flagged
+                                   symmetric (MAT_SYMMETRIC)
+  -adolc_coo                     - freeze the nonzero pattern of the matrix at the first evaluation
+                                   and scatter recovered entries with MatSetValuesCOO, without
+                                   assembly (requires PETSc 3.16; not used with bidirectional
+                                   compression or blocked recovery)
 
   Input parameters:
-  tag1   - tape identifier for df/dx part
-  tag2   - tape identifier for df/d(xdot) part
-  u_vec - vector at which to evaluate Jacobian
-  ctx   - ADOL-C context, as defined above
+  da    - distributed array upon which the traced function is defined (may be NULL)
+  tag1  - tape identifier for dF/dx part
+  tag2  - tape identifier for dF/d(xdot) part, or negative if there is no second tape
+  adctx - ADOL-C context, with dimensions m and n set
 
-  Output parameter:
-  A     - Mat object corresponding to Jacobian
+  Note: The seed matrices, recovery plans and workspace should be freed using AdolcJacobianDestroy.
 */
-PetscErrorCode AdolcComputeIJacobian(PetscInt tag1,PetscInt tag2,Mat A,PetscScalar *u_vec,PetscReal a,void *ctx)
+PetscErrorCode AdolcIJacobianSetUp(DM da,PetscInt tag1,PetscInt tag2,AdolcCtx *adctx)
 {
-  AdolcCtx       *adctx = (AdolcCtx*)ctx;
   PetscErrorCode ierr;
-  PetscInt       i,j,m = adctx->m,n = adctx->n,p = adctx->p;
-  PetscScalar    **J;
+  PetscInt       i,m = adctx->m,n = adctx->n,nnz = 0,*colours = NULL,*rowcolours = NULL;
+  PetscInt       *bicolours = NULL,*birowcolours = NULL,mode = 2,strategy = 0,p = 0,q = 0,pc = 0,pr = 0;
+  PetscReal      threshold = 0.5,density = 1.;
+  PetscInt       options[6],counts[4];
+  PetscBool      set,sparse,view = PETSC_FALSE,bicolour = PETSC_FALSE,cache = PETSC_FALSE,cached = PETSC_FALSE,tiled = PETSC_FALSE,block = PETSC_FALSE;
+  StencilTile    *tile;
+  RecPlan        *bplan;
+  DMDALocalInfo  info;
+  MatType        mtype;
+  char           prefix[PETSC_MAX_PATH_LEN],filename[PETSC_MAX_PATH_LEN],tilename[PETSC_MAX_PATH_LEN],coloring[64];
+  PetscMPIInt    rank;
+  unsigned long long key;
+  const char     *modes[4] = {"forward","reverse","auto","bidirectional"};
+  const char     *sparsities[2] = {"dm","tape"};
+  const char     *strategies[4] = {"compressed forward","compressed reverse","","compressed bidirectional"};
+  PetscScalar    **Seed = NULL;
+  unsigned int   **JP = NULL;
+  size_t         stats[STAT_SIZE];
+  PetscLogDouble mem,flops,ops;
+  MPI_Comm       comm = MPI_COMM_WORLD;
+  static PetscInt cooids = 0;
 
   PetscFunctionBegin;
-  ierr = AdolcMalloc2(m,p,&J);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse",&adctx->sparse,&set);CHKERRQ(ierr);
+  ierr = PetscOptionsGetReal(NULL,NULL,"-adolc_sparse_threshold",&threshold,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetEList(NULL,NULL,"-adolc_sparse_mode",modes,4,&mode,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse_view",&adctx->sparse_view,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_strategy_view",&view,NULL);CHKERRQ(ierr);
+  adctx->seed_block = 0;
+  ierr = PetscOptionsGetInt(NULL,NULL,"-adolc_seed_block",&adctx->seed_block,NULL);CHKERRQ(ierr);
+  ierr = PetscStrcpy(coloring,da ? "stencil" : "greedy");CHKERRQ(ierr);
+  ierr = PetscOptionsGetString(NULL,NULL,"-adolc_coloring",coloring,sizeof(coloring),NULL);CHKERRQ(ierr);
+  if (da) {
+    ierr = PetscOptionsGetString(NULL,NULL,"-adolc_coloring_tile",tilename,sizeof(tilename),&tiled);CHKERRQ(ierr);
+  }
+  if (tiled) {
+    ierr = PetscStrcpy(coloring,"tile");CHKERRQ(ierr);
+  }
+  ierr = AdolcRegisterEvents(adctx);CHKERRQ(ierr);
+  adctx->reverse = adctx->bidirectional = PETSC_FALSE;
 
-  /* dF/dx part */
-  ierr = PetscLogEventBegin(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->Seed)
-    fov_forward(tag1,m,n,p,u_vec,adctx->Seed,NULL,J);
-  else
-    jacobian(tag1,m,n,u_vec,J);
-  ierr = PetscLogEventEnd(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  ierr = MatZeroEntries(A);CHKERRQ(ierr);
-  if (adctx->sparse) {
-    if ((adctx->sparse_view) && (!adctx->sparse_view_done)) {
-      ierr = PrintMat(MPI_COMM_WORLD,"Compressed Jacobian dF/dx:",m,p,J);CHKERRQ(ierr);
+  /* Look for a cache file holding the compression objects for this DMDA layout and tape */
+  if (da) {
+    ierr = PetscOptionsGetString(NULL,NULL,"-adolc_cache",prefix,sizeof(prefix),&cache);CHKERRQ(ierr);
+  }
+  if (cache) {
+    options[0] = set ? adctx->sparse : -1;
+    options[1] = (PetscInt) (threshold*1.e6);
+    options[2] = mode;
+    options[3] = 0;
+    ierr = PetscOptionsGetEList(NULL,NULL,"-adolc_sparsity_pattern",sparsities,2,&options[3],NULL);CHKERRQ(ierr);
+#if defined(PETSC_HAVE_COLPACK)
+    options[4] = 1;
+#else
+    options[4] = 0;
+#endif
+    options[5] = 0;
+    for (i=0; coloring[i]; i++) options[5] = (31*options[5] + coloring[i]) % 1000003;
+    ierr = AdolcCacheKey(da,tag1,tag2,options,6,&key);CHKERRQ(ierr);
+    ierr = MPI_Comm_rank(PETSC_COMM_WORLD,&rank);CHKERRQ(ierr);
+    ierr = PetscSNPrintf(filename,sizeof(filename),"%s-%016llx.%d.bin",prefix,key,rank);CHKERRQ(ierr);
+    sparse = adctx->sparse;
+    ierr = PetscLogEventBegin(adctx->event3,0,0,0,0);CHKERRQ(ierr);
+    ierr = AdolcCacheRead(filename,adctx,counts,&density,&cached);CHKERRQ(ierr);
+    ierr = PetscLogEventEnd(adctx->event3,0,0,0,0);CHKERRQ(ierr);
+
+    /* Only use the cache if every rank hit, since some colouring backends are collective */
+    ierr = MPI_Allreduce(MPI_IN_PLACE,&cached,1,MPIU_BOOL,MPI_LAND,comm);CHKERRQ(ierr);
+    if (!cached) {
+      ierr = AdolcCacheDiscard(adctx);CHKERRQ(ierr);
+      adctx->sparse = sparse;
+      density       = 1.;
+    } else {
+      p = counts[0];q = counts[1];pc = counts[2];pr = counts[3];
+      strategy = adctx->bidirectional ? 3 : (adctx->reverse ? 1 : 0);
+      ierr = PetscInfo1(NULL,"Read ADOL-C compression objects from %s\n",filename);CHKERRQ(ierr);
     }
-    ierr = PetscLogEventBegin(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-    ierr = RecoverJacobian(A,INSERT_VALUES,m,p,adctx->Rec,J,NULL);CHKERRQ(ierr);
-    ierr = PetscLogEventEnd(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-  } else {
-    for (i=0; i<m; i++) {
-      for (j=0; j<n; j++) {
-        if (fabs(J[i][j]) > 1.e-16) {
-          ierr = MatSetValues(A,1,&i,1,&j,&J[i][j],INSERT_VALUES);CHKERRQ(ierr);
+  }
+
+  /* Generate sparsity pattern and decide upon strategy, unless full mode is enforced */
+  if ((!cached) && ((!set) || (adctx->sparse))) {
+    ierr = PetscLogEventBegin(adctx->event2,0,0,0,0);CHKERRQ(ierr);
+    ierr = AdolcGetSparsityPattern(da,tag1,tag2,m,n,adctx->rows,&JP);CHKERRQ(ierr);
+    ierr = PetscLogEventEnd(adctx->event2,0,0,0,0);CHKERRQ(ierr);
+    if (adctx->sparse_view) {
+      ierr = PrintSparsity(comm,m,JP);CHKERRQ(ierr);
+    }
+    for (i=0; i<m; i++) nnz += (PetscInt) JP[i][0];
+    if (m && n) density = ((PetscReal) nnz)/((PetscReal) m*n);
+    if (!set) adctx->sparse = (density > threshold) ? PETSC_FALSE : PETSC_TRUE;
+  }
+
+  if (cached) {
+    Seed = adctx->Seed;
+  } else if (adctx->sparse) {
+
+    /* Count colours for each strategy under consideration */
+    ierr = PetscLogEventBegin(adctx->event3,0,0,0,0);CHKERRQ(ierr);
+    if ((mode == 0) || (mode == 2)) {
+      ierr = PetscMalloc1(n,&colours);CHKERRQ(ierr);
+      if (tiled) {
+        ierr = AdolcGetStencilTile(da,tilename,&tile);CHKERRQ(ierr);
+        ierr = StencilTileApply(da,tile,colours,&p);CHKERRQ(ierr);
+        ierr = StencilTileDestroy(&tile);CHKERRQ(ierr);
+      } else {
+        ierr = GetColumnColoring(da,JP,m,n,coloring,view,colours,&p);CHKERRQ(ierr);
+      }
+    }
+    if ((mode == 1) || (mode == 2)) {
+      ierr = PetscMalloc1(m,&rowcolours);CHKERRQ(ierr);
+      ierr = GreedyRowColoring(JP,m,n,rowcolours,&q);CHKERRQ(ierr);
+    }
+#if defined(PETSC_HAVE_COLPACK)
+    bicolour = (mode == 2) ? PETSC_TRUE : PETSC_FALSE;
+#endif
+    if ((mode == 3) || (bicolour)) {
+      ierr = PetscMalloc1(n,&bicolours);CHKERRQ(ierr);
+      ierr = PetscMalloc1(m,&birowcolours);CHKERRQ(ierr);
+      ierr = GetStarBicoloring(JP,m,n,birowcolours,&pr,bicolours,&pc);CHKERRQ(ierr);
+    }
+    strategy = mode;
+    if (mode == 2) {
+      strategy = (q < p) ? 1 : 0;
+      if ((bicolour) && (pc+pr < PetscMin(p,q))) strategy = 3;
+    }
+    adctx->reverse       = (strategy == 1) ? PETSC_TRUE : PETSC_FALSE;
+    adctx->bidirectional = (strategy == 3) ? PETSC_TRUE : PETSC_FALSE;
+
+    if (adctx->bidirectional) {
+
+      /* Generate column and row seed matrices and the pair of recovery plans */
+      adctx->p  = pc;
+      adctx->pR = pr;
+      ierr = AdolcMalloc2(n,pc,&Seed);CHKERRQ(ierr);
+      ierr = GenerateSeedMatrixFromColors(n,bicolours,Seed);CHKERRQ(ierr);
+      ierr = AdolcMalloc2(pr,m,&adctx->SeedR);CHKERRQ(ierr);
+      ierr = GenerateRowSeedMatrixFromColors(m,birowcolours,adctx->SeedR);CHKERRQ(ierr);
+      ierr = GetBidirectionalRecoveryPlans(JP,m,n,birowcolours,bicolours,pc,&adctx->plan,&adctx->planR);CHKERRQ(ierr);
+      adctx->colours  = bicolours;
+      adctx->coloursR = birowcolours;
+      bicolours = birowcolours = NULL;
+      if (adctx->sparse_view) {
+        ierr = PrintMat(comm,"Seed matrix:",n,pc,Seed);CHKERRQ(ierr);
+        ierr = PrintMat(comm,"Row seed matrix:",pr,m,adctx->SeedR);CHKERRQ(ierr);
+      }
+    } else if (adctx->reverse) {
+
+      /* Generate row seed matrix and recovery plan directly from the sparsity pattern */
+      adctx->p = q;
+      ierr = AdolcMalloc2(q,m,&Seed);CHKERRQ(ierr);
+      ierr = GenerateRowSeedMatrixFromColors(m,rowcolours,Seed);CHKERRQ(ierr);
+      ierr = GetRowRecoveryPlan(JP,m,n,rowcolours,&adctx->plan);CHKERRQ(ierr);
+      adctx->colours = rowcolours;
+      rowcolours     = NULL;
+      if (adctx->sparse_view) {
+        ierr = PrintMat(comm,"Row seed matrix:",q,m,Seed);CHKERRQ(ierr);
+      }
+    } else {
+
+      /* Generate column seed matrix (unless it is generated in blocks) and recovery plan */
+      adctx->p = p;
+      if (adctx->seed_block <= 0) {
+        ierr = AdolcMalloc2(n,p,&Seed);CHKERRQ(ierr);
+        ierr = GenerateSeedMatrixFromColors(n,colours,Seed);CHKERRQ(ierr);
+        if (adctx->sparse_view) {
+          ierr = PrintMat(comm,"Seed matrix:",n,p,Seed);CHKERRQ(ierr);
         }
       }
+      ierr = GetRecoveryMatrix(colours,JP,m,p,&adctx->plan);CHKERRQ(ierr);
+      adctx->colours = colours;
+      colours        = NULL;
     }
+    ierr = PetscFree(colours);CHKERRQ(ierr);
+    ierr = PetscFree(rowcolours);CHKERRQ(ierr);
+    ierr = PetscFree(bicolours);CHKERRQ(ierr);
+    ierr = PetscFree(birowcolours);CHKERRQ(ierr);
+    ierr = PetscLogEventEnd(adctx->event3,0,0,0,0);CHKERRQ(ierr);
+  } else {
+    adctx->p = n;
+  }
+  adctx->Seed = Seed;
+  if ((!adctx->sparse) || (adctx->reverse) || (adctx->bidirectional)) adctx->seed_block = 0;
+  if (adctx->plan) adctx->plan->rows = adctx->rows;
+  if (adctx->planR) adctx->planR->rows = adctx->rows;
+  if (JP) {
+    for (i=0; i<m; i++)
+      free(JP[i]);
+    free(JP);
+  }
+  ierr = AdolcWorkspaceSetUp(adctx);CHKERRQ(ierr);
+  if ((cache) && (!cached)) {
+    counts[0] = p;counts[1] = q;counts[2] = pc;counts[3] = pr;
+    ierr = AdolcCacheWrite(filename,adctx,counts,density);CHKERRQ(ierr);
+    ierr = PetscInfo1(NULL,"Wrote ADOL-C compression objects to %s\n",filename);CHKERRQ(ierr);
   }
-  ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
 
-  /* a * dF/d(xdot) part */
-  ierr = PetscLogEventBegin(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->Seed)
-    fov_forward(tag2,m,n,p,u_vec,adctx->Seed,NULL,J);
-  else
-    jacobian(tag2,m,n,u_vec,J);
-  ierr = PetscLogEventEnd(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->sparse) {
-    if ((adctx->sparse_view) && (!adctx->sparse_view_done)) {
-      ierr = PrintMat(MPI_COMM_WORLD,"Compressed Jacobian dF/d(xdot):",m,p,J);CHKERRQ(ierr);
-      adctx->sparse_view_done = PETSC_TRUE;
+  /*
+    Predict memory and flops per Jacobian evaluation. Vector forward and reverse mode cost roughly
+    two flops per operation on the tape and per direction, with reverse mode requiring a further
+    forward sweep, and one further flop per entry to recover (or to scan the full Jacobian).
+  */
+  if (view) {
+    tapestats(tag1,stats);
+    ops = stats[NUM_OPERATIONS];
+    if (tag2 >= 0) {
+      tapestats(tag2,stats);
+      ops += stats[NUM_OPERATIONS];
     }
-    ierr = PetscLogEventBegin(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-    ierr = RecoverJacobian(A,ADD_VALUES,m,p,adctx->Rec,J,&a);CHKERRQ(ierr);
-    ierr = PetscLogEventEnd(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-  } else {
-    for (i=0; i<m; i++) {
-      for (j=0; j<n; j++) {
-        if (fabs(J[i][j]) > 1.e-16) {
-          J[i][j] *= a;
-          ierr = MatSetValues(A,1,&i,1,&j,&J[i][j],ADD_VALUES);CHKERRQ(ierr);
-        }
+    flops = 2.*adctx->p*ops;
+    if (adctx->bidirectional) {
+      mem    = ((PetscLogDouble)(m+n)*adctx->p + (PetscLogDouble)(n+m)*adctx->pR + m)*sizeof(PetscScalar) + (PetscLogDouble)(adctx->plan->nnz+adctx->planR->nnz)*2*sizeof(PetscInt);
+      flops += 2.*adctx->pR*ops + ops + adctx->plan->nnz + adctx->planR->nnz;
+    } else if (adctx->reverse) {
+      mem    = ((PetscLogDouble)(n+m)*adctx->p + m)*sizeof(PetscScalar) + ((PetscLogDouble)adctx->plan->nnz*2 + m)*sizeof(PetscInt);
+      flops += ops + adctx->plan->nnz;
+    } else if ((adctx->sparse) && (adctx->seed_block > 0)) {
+      mem    = ((PetscLogDouble)m*adctx->p + (PetscLogDouble)n*PetscMin(adctx->seed_block,adctx->p))*sizeof(PetscScalar) + m*sizeof(PetscScalar*) + ((PetscLogDouble)adctx->plan->nnz*2 + n)*sizeof(PetscInt);
+      flops += ops*((adctx->p-1)/adctx->seed_block) + adctx->plan->nnz + (PetscLogDouble)n*((adctx->p-1)/adctx->seed_block + 1);
+    } else if (adctx->sparse) {
+      mem    = (PetscLogDouble)(m+n)*adctx->p*sizeof(PetscScalar) + ((PetscLogDouble)adctx->plan->nnz*2 + n)*sizeof(PetscInt);
+      flops += adctx->plan->nnz;
+    } else {
+      mem    = (PetscLogDouble)m*adctx->p*sizeof(PetscScalar);
+      flops += (PetscLogDouble)m*n;
+    }
+    ierr = PetscPrintf(comm,"ADOL-C Jacobian: %s mode, density %g, p = %D, pR = %D (column colours %D, row colours %D, bicolours %D + %D), predicted memory %g MiB and %g flops per evaluation\n",
+                       adctx->sparse ? strategies[strategy] : "full",(double) density,adctx->p,adctx->pR,p,q,pc,pr,mem/1048576.,flops);CHKERRQ(ierr);
+  }
+
+  /*
+    Group the recovery plan into blocks for a DMDA with several degrees of freedom, so that each
+    block row is inserted with a single call. This is done after caching, so that the cache holds
+    the scalar plan. Blocks are padded with zeros, which would overwrite the entries recovered by
+    the other plan with bidirectional compression.
+  */
+  adctx->bs = 0;
+  if ((da) && (adctx->sparse) && (!adctx->bidirectional)) {
+    ierr = DMGetMatType(da,&mtype);CHKERRQ(ierr);
+    if (mtype) {
+      ierr = PetscStrendswith(mtype,"baij",&block);CHKERRQ(ierr); /* BAIJ or SBAIJ, sequential or parallel */
+    }
+    ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_block_recovery",&block,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_symmetric",&adctx->symmetric,NULL);CHKERRQ(ierr);
+    ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+    if ((block) && (info.dof > 1)) {
+      ierr = GetBlockRecoveryPlan(adctx->plan,info.dof,&bplan);CHKERRQ(ierr);
+      ierr = RecPlanDestroy(&adctx->plan);CHKERRQ(ierr);
+      adctx->plan = bplan;
+      adctx->bs   = info.dof;
+      if (view) {
+        ierr = PetscPrintf(comm,"ADOL-C Jacobian: recovery in %D x %D blocks\n",info.dof,info.dof);CHKERRQ(ierr);
       }
     }
   }
-  ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = AdolcFree2(J);CHKERRQ(ierr);
+
+  /* Frozen-pattern assembly, for a single scalar recovery plan */
+  adctx->coo = PETSC_FALSE;
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_coo",&adctx->coo,NULL);CHKERRQ(ierr);
+  if ((adctx->coo) && ((!adctx->sparse) || (adctx->bidirectional) || (adctx->bs > 1))) {
+    ierr = PetscInfo(NULL,"COO assembly requires a single scalar recovery plan, so is not used\n");CHKERRQ(ierr);
+    adctx->coo = PETSC_FALSE;
+  }
+#if PETSC_VERSION_LT(3,16,0)
+  if (adctx->coo) {
+    ierr = PetscInfo(NULL,"COO assembly requires PETSc 3.16 or later, so is not used\n");CHKERRQ(ierr);
+    adctx->coo = PETSC_FALSE;
+  }
+#endif
+  if (adctx->coo) {
+    /* Each setup gives a new pattern, so a matrix frozen with an earlier one is set again */
+    adctx->cooid = ++cooids;
+    adctx->ncoo  = adctx->plan->nnz + adctx->plan->m;
+    ierr = PetscFree(adctx->coov);CHKERRQ(ierr);
+    ierr = PetscCalloc1(PetscMax(adctx->ncoo,1),&adctx->coov);CHKERRQ(ierr);
+  }
   PetscFunctionReturn(0);
 }
 
 /*
-  Compute Jacobian for implicit TS in the special case where it is
-  known that the mass matrix is simply the identity. i.e. We have
-  a problem of the form
-                        du/dt = F(u).
+  Set up the ADOL-C context for Jacobian computation of a single traced function. See
+  AdolcIJacobianSetUp for details.
 
   Input parameters:
-  tag   - tape identifier for df/dx part
-  u_vec - vector at which to evaluate Jacobian
-  ctx   - ADOL-C context, as defined above
-
-  Output parameter:
-  A     - Mat object corresponding to Jacobian
+  da    - distributed array upon which the traced function is defined (may be NULL)
+  tag   - tape identifier
+  adctx - ADOL-C context, with dimensions m and n set
 */
-PetscErrorCode AdolcComputeIJacobianIDMass(PetscInt tag,Mat A,PetscScalar *u_vec,PetscReal a,void *ctx)
+PetscErrorCode AdolcJacobianSetUp(DM da,PetscInt tag,AdolcCtx *adctx)
 {
-  AdolcCtx       *adctx = (AdolcCtx*)ctx;
   PetscErrorCode ierr;
-  PetscInt       i,j,m = adctx->m,n = adctx->n,p = adctx->p;
-  PetscScalar    **J;
 
   PetscFunctionBegin;
-  ierr = AdolcMalloc2(m,p,&J);CHKERRQ(ierr);
-
-  /* dF/dx part */
-  ierr = PetscLogEventBegin(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->Seed)
-    fov_forward(tag,m,n,p,u_vec,adctx->Seed,NULL,J);
-  else
-    jacobian(tag,m,n,u_vec,J);
-  ierr = PetscLogEventEnd(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  ierr = MatZeroEntries(A);CHKERRQ(ierr);
-  if (adctx->sparse) {
-    if ((adctx->sparse_view) && (!adctx->sparse_view_done)) {
-      ierr = PrintMat(MPI_COMM_WORLD,"Compressed Jacobian dF/dx:",m,p,J);CHKERRQ(ierr);
-    }
-    ierr = PetscLogEventBegin(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-    ierr = RecoverJacobian(A,INSERT_VALUES,m,p,adctx->Rec,J,NULL);CHKERRQ(ierr);
-    ierr = PetscLogEventEnd(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-  } else {
-    for (i=0; i<m; i++) {
-      for (j=0; j<n; j++) {
-        if (fabs(J[i][j]) > 1.e-16) {
-          ierr = MatSetValues(A,1,&i,1,&j,&J[i][j],INSERT_VALUES);CHKERRQ(ierr);
-        }
-      }
-    }
-  }
-  ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = AdolcFree2(J);CHKERRQ(ierr);
-
-  /* a * dF/d(xdot) part */
-  ierr = MatShift(A,a);CHKERRQ(ierr);
+  ierr = AdolcIJacobianSetUp(da,tag,-1,adctx);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
 
 /*
-  Compute local portion of Jacobian for implicit TS in compressed format and recover from this, using
-  precomputed seed and recovery matrices. If sparse mode is not used, full Jacobian is
-  assembled (not recommended!).
+  Set up the ADOL-C context for computing a compressed Jacobian w.r.t. k parameters, once the
+  function has been traced with the independent variables followed by the parameters. Parameters
+  which influence disjoint sets of dependents are given the same colour (see GetParameterColoring),
+  so that q <= k directions are propagated by AdolcComputeRHSJacobianP(Local).
+
+  Options:
+  -adolc_sparse_view   - print the sparsity pattern and seed matrix
+  -adolc_strategy_view - print the number of colours used
 
   Input parameters:
-  tag1   - tape identifier for df/dx part
-  tag2   - tape identifier for df/d(xdot) part
-  u_vec - vector at which to evaluate Jacobian
-  ctx   - ADOL-C context, as defined above
+  tag   - tape identifier, with independent variables followed by parameters
+  k     - number of parameters
+  adctx - ADOL-C context, with dimensions m and n (excluding parameters) set
 
-  Output parameter:
-  A     - Mat object corresponding to Jacobian
+  Note: The seed matrix and recovery plan should be freed using AdolcJacobianDestroy.
 */
-PetscErrorCode AdolcComputeIJacobianLocal(PetscInt tag1,PetscInt tag2,Mat A,PetscScalar *u_vec,PetscReal a,void *ctx)
+PetscErrorCode AdolcJacobianPSetUp(PetscInt tag,PetscInt k,AdolcCtx *adctx)
 {
-  AdolcCtx       *adctx = (AdolcCtx*)ctx;
   PetscErrorCode ierr;
-  PetscInt       i,j,m = adctx->m,n = adctx->n,p = adctx->p;
-  PetscScalar    **J;
+  PetscInt       i,j,m = adctx->m,n = adctx->n,*colours;
+  PetscBool      view = PETSC_FALSE;
+  unsigned int   **JP;
+  MPI_Comm       comm = MPI_COMM_WORLD;
 
   PetscFunctionBegin;
-  ierr = AdolcMalloc2(m,p,&J);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse_view",&adctx->sparse_view,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_strategy_view",&view,NULL);CHKERRQ(ierr);
+  ierr = AdolcRegisterEvents(adctx);CHKERRQ(ierr);
 
-  /* dF/dx part */
-  ierr = PetscLogEventBegin(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->Seed)
-    fov_forward(tag1,m,n,p,u_vec,adctx->Seed,NULL,J);
-  else
-    jacobian(tag1,m,n,u_vec,J);
-  ierr = PetscLogEventEnd(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->sparse) {
-    if ((adctx->sparse_view) && (!adctx->sparse_view_done)) {
-      ierr = PrintMat(MPI_COMM_WORLD,"Compressed Jacobian dF/dx:",m,p,J);CHKERRQ(ierr);
-    }
-    ierr = PetscLogEventBegin(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-    ierr = RecoverJacobianLocal(A,INSERT_VALUES,m,p,adctx->Rec,J,NULL);CHKERRQ(ierr);
-    ierr = PetscLogEventEnd(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-  } else {
-    for (i=0; i<m; i++) {
-      for (j=0; j<n; j++) {
-        if (fabs(J[i][j]) > 1.e-16) {
-          ierr = MatSetValuesLocal(A,1,&i,1,&j,&J[i][j],INSERT_VALUES);CHKERRQ(ierr);
-        }
-      }
-    }
+  /* Generate sparsity pattern w.r.t. both independent variables and parameters */
+  ierr = PetscLogEventBegin(adctx->event2,0,0,0,0);CHKERRQ(ierr);
+  ierr = AdolcGetSparsityPattern(NULL,tag,-1,m,n+k,NULL,&JP);CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(adctx->event2,0,0,0,0);CHKERRQ(ierr);
+  if (adctx->sparse_view) {
+    ierr = PrintSparsity(comm,m,JP);CHKERRQ(ierr);
   }
-  ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
 
-  /* a * dF/d(xdot) part */
-  ierr = PetscLogEventBegin(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->Seed)
-    fov_forward(tag2,m,n,p,u_vec,adctx->Seed,NULL,J);
-  else
-    jacobian(tag2,m,n,u_vec,J);
-  ierr = PetscLogEventEnd(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->sparse) {
-    if ((adctx->sparse_view) && (!adctx->sparse_view_done)) {
-      ierr = PrintMat(MPI_COMM_WORLD,"Compressed Jacobian dF/d(xdot):",m,p,J);CHKERRQ(ierr);
-      adctx->sparse_view_done = PETSC_TRUE;
-    }
-    ierr = PetscLogEventBegin(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-    ierr = RecoverJacobianLocal(A,ADD_VALUES,m,p,adctx->Rec,J,&a);CHKERRQ(ierr);
-    ierr = PetscLogEventEnd(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-  } else {
-    for (i=0; i<m; i++) {
-      for (j=0; j<n; j++) {
-        if (fabs(J[i][j]) > 1.e-16) {
-          J[i][j] *= a;
-          ierr = MatSetValuesLocal(A,1,&i,1,&j,&J[i][j],ADD_VALUES);CHKERRQ(ierr);
-        }
-      }
-    }
+  /* Colour the parameters and generate seed matrix and recovery plan */
+  ierr = PetscLogEventBegin(adctx->event3,0,0,0,0);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(k,1),&colours);CHKERRQ(ierr);
+  ierr = GetParameterColoring(JP,m,n,k,colours,&adctx->q);CHKERRQ(ierr);
+  ierr = AdolcMalloc2(n+k,adctx->q,&adctx->SeedP);CHKERRQ(ierr);
+  for (i=0; i<n+k; i++) {
+    for (j=0; j<adctx->q; j++) adctx->SeedP[i][j] = 0.;
+  }
+  ierr = GenerateParameterSeedMatrix(n,k,colours,adctx->SeedP);CHKERRQ(ierr);
+  ierr = GetParameterRecoveryMatrix(JP,m,n,adctx->q,colours,&adctx->planP);CHKERRQ(ierr);
+  adctx->planP->rows = adctx->rows;
+  ierr = PetscLogEventEnd(adctx->event3,0,0,0,0);CHKERRQ(ierr);
+  if (adctx->sparse_view) {
+    ierr = PrintMat(comm,"Parameter seed matrix:",n+k,adctx->q,adctx->SeedP);CHKERRQ(ierr);
+  }
+  for (i=0; i<m; i++)
+    free(JP[i]);
+  free(JP);
+  ierr = PetscFree(colours);CHKERRQ(ierr);
+  if (view) {
+    ierr = PetscPrintf(comm,"ADOL-C Jacobian w.r.t. %D parameters: q = %D\n",k,adctx->q);CHKERRQ(ierr);
   }
-  ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = AdolcFree2(J);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
 
 /*
-  Compute local portion of Jacobian for implicit TS in the special case where it is
-  known that the mass matrix is simply the identity. i.e. We have
-  a problem of the form
-                        du/dt = F(u).
+  Set up the ADOL-C context for computing the Jacobian diagonal only, once the function of
+  interest has been traced. The diagonal may be recovered using a colouring which only separates
+  columns which are adjacent to one another (see GetDiagonalColoring), so far fewer directions
+  are propagated than for the full Jacobian. If a second tape is given, the colouring respects
+  the union of both sparsity patterns.
 
   Input parameters:
-  tag   - tape identifier for df/dx part
-  u_vec - vector at which to evaluate Jacobian
-  ctx   - ADOL-C context, as defined above
+  tag1  - tape identifier for df/dx part
+  tag2  - tape identifier for df/d(xdot) part, or negative if the mass matrix is the identity
+  adctx - ADOL-C context, with dimensions m and n set
 
-  Output parameter:
-  A     - Mat object corresponding to Jacobian
+  Note: The seed matrix and recovery vector should be freed using AdolcJacobianDestroy.
 */
-PetscErrorCode AdolcComputeIJacobianLocalIDMass(PetscInt tag,Mat A,PetscScalar *u_vec,PetscReal a,void *ctx)
+PetscErrorCode AdolcDiagonalSetUp(PetscInt tag1,PetscInt tag2,AdolcCtx *adctx)
 {
-  AdolcCtx       *adctx = (AdolcCtx*)ctx;
   PetscErrorCode ierr;
-  PetscInt       i,j,m = adctx->m,n = adctx->n,p = adctx->p;
-  PetscScalar    **J;
+  PetscInt       i,m = adctx->m,n = adctx->n,*colours;
+  PetscBool      view = PETSC_FALSE;
+  unsigned int   **JP;
+  MPI_Comm       comm = MPI_COMM_WORLD;
 
   PetscFunctionBegin;
-  ierr = AdolcMalloc2(m,p,&J);CHKERRQ(ierr);
+  if (m != n) SETERRQ2(PETSC_COMM_SELF,PETSC_ERR_ARG_SIZ,"Jacobian diagonal requires m = n, but m = %D and n = %D",m,n);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse_view",&adctx->sparse_view,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_strategy_view",&view,NULL);CHKERRQ(ierr);
+  ierr = AdolcRegisterEvents(adctx);CHKERRQ(ierr);
 
-  /* dF/dx part */
-  ierr = PetscLogEventBegin(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->Seed)
-    fov_forward(tag,m,n,p,u_vec,adctx->Seed,NULL,J);
-  else
-    jacobian(tag,m,n,u_vec,J);
-  ierr = PetscLogEventEnd(adctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (adctx->sparse) {
-    if ((adctx->sparse_view) && (!adctx->sparse_view_done)) {
-      ierr = PrintMat(MPI_COMM_WORLD,"Compressed Jacobian dF/dx:",m,p,J);CHKERRQ(ierr);
-    }
-    ierr = PetscLogEventBegin(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-    ierr = RecoverJacobianLocal(A,INSERT_VALUES,m,p,adctx->Rec,J,NULL);CHKERRQ(ierr);
-    ierr = PetscLogEventEnd(adctx->event5,0,0,0,0);CHKERRQ(ierr);
-  } else {
-    for (i=0; i<m; i++) {
-      for (j=0; j<n; j++) {
-        if (fabs(J[i][j]) > 1.e-16) {
-          ierr = MatSetValuesLocal(A,1,&i,1,&j,&J[i][j],INSERT_VALUES);CHKERRQ(ierr);
-        }
-      }
-    }
+  /* Generate sparsity pattern(s), taking the union if two tapes are given */
+  ierr = PetscLogEventBegin(adctx->event2,0,0,0,0);CHKERRQ(ierr);
+  ierr = AdolcGetSparsityPattern(NULL,tag1,tag2,m,n,adctx->rows,&JP);CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(adctx->event2,0,0,0,0);CHKERRQ(ierr);
+  if (adctx->sparse_view) {
+    ierr = PrintSparsity(comm,m,JP);CHKERRQ(ierr);
   }
-  ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = AdolcFree2(J);CHKERRQ(ierr);
 
-  /* a * dF/d(xdot) part */
-  ierr = MatShift(A,a);CHKERRQ(ierr);
+  /* Colour for diagonal recovery and generate seed matrix and recovery vector */
+  ierr = PetscLogEventBegin(adctx->event3,0,0,0,0);CHKERRQ(ierr);
+  ierr = PetscMalloc1(n,&colours);CHKERRQ(ierr);
+  ierr = GetDiagonalColoring(JP,n,colours,&adctx->pD);CHKERRQ(ierr);
+  ierr = AdolcMalloc2(n,adctx->pD,&adctx->SeedD);CHKERRQ(ierr);
+  ierr = GenerateSeedMatrixFromColors(n,colours,adctx->SeedD);CHKERRQ(ierr);
+  adctx->rec = colours;
+  ierr = PetscLogEventEnd(adctx->event3,0,0,0,0);CHKERRQ(ierr);
+  if (adctx->sparse_view) {
+    ierr = PrintMat(comm,"Diagonal seed matrix:",n,adctx->pD,adctx->SeedD);CHKERRQ(ierr);
+  }
+  for (i=0; i<m; i++)
+    free(JP[i]);
+  free(JP);
+  if (view) {
+    ierr = PetscPrintf(comm,"ADOL-C Jacobian diagonal: p = %D\n",adctx->pD);CHKERRQ(ierr);
+  }
   PetscFunctionReturn(0);
 }
 
 /* --------------------------------------------------------------------------------
-   Drivers for Jacobian w.r.t. a parameter
+   Driver for compressed sparse Hessians
    ----------------------------------------------------------------------------- */
 
 /*
-  Compute Jacobian w.r.t a parameter for explicit TS.
+  Set up the ADOL-C context for computing the Hessian of a scalar function, once it has been
+  traced. The sparsity pattern is computed using hess_pat and the columns are star coloured (or
+  distance-2 coloured, which does not exploit symmetry), so that each entry may be recovered
+  directly from the n x pH compressed Hessian (see GetSymmetricRecoveryMatrix). The seed matrix is
+  stored as the Taylor tensor used by hov_wk_forward, so no further allocation is required.
 
-  TODO: Do not form whole matrix. Just propagate [0,0,1] (for example).
-  TODO: Account for multiple parameters
-  TODO: Allow compressed format
+  Options:
+  -adolc_hessian_coloring <star> - colour using ColPack's star colouring (star), which requires
+                                   ColPack, or a greedy distance-2 colouring (greedy)
+  -adolc_strategy_view           - print the number of colours used
 
   Input parameters:
-  u_vec - vector at which to evaluate Jacobian
-  param - the parameter
-  tag   - tape identifier
-  ctx   - ADOL-C context, as defined above
+  tag   - tape identifier, with one dependent
+  adctx - ADOL-C context, with dimension n set
 
-  Output parameter:
-  A     - Mat object corresponding to Jacobian
+  Note: The recovery plan and tensors should be freed using AdolcJacobianDestroy.
 */
-PetscErrorCode AdolcComputeRHSJacobianP(Mat A,PetscScalar *u_vec,PetscScalar *param,PetscInt tag,void *ctx)
+PetscErrorCode AdolcHessianSetUp(PetscInt tag,AdolcCtx *adctx)
 {
-  AdolcCtx       *adctx = (AdolcCtx*)ctx;
   PetscErrorCode ierr;
-  PetscInt       i,j = 0,m = adctx->m,n = adctx->n;
-  PetscScalar    **J,*concat;
+  PetscInt       i,j,n = adctx->n,p,*colours;
+  PetscBool      view = PETSC_FALSE;
+  PetscScalar    *u_vec,**H;
+  unsigned int   **HP;
+  const char     *colourings[2] = {"star","greedy"};
+  MPI_Comm       comm = MPI_COMM_WORLD;
+#if defined(PETSC_HAVE_COLPACK)
+  PetscInt       colouring = 0;
+#else
+  PetscInt       colouring = 1;
+#endif
 
   PetscFunctionBegin;
-  ierr = AdolcMalloc2(m,n+1,&J);CHKERRQ(ierr);
-  ierr = PetscMalloc1(n+1,&concat);CHKERRQ(ierr);
-  for (i=0; i<n; i++) {
-    concat[i] = u_vec[i];
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_sparse_view",&adctx->sparse_view,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_strategy_view",&view,NULL);CHKERRQ(ierr);
+  ierr = PetscOptionsGetEList(NULL,NULL,"-adolc_hessian_coloring",colourings,2,&colouring,NULL);CHKERRQ(ierr);
+  ierr = AdolcRegisterEvents(adctx);CHKERRQ(ierr);
+
+  /* Generate (symmetric) sparsity pattern */
+  ierr = PetscLogEventBegin(adctx->event2,0,0,0,0);CHKERRQ(ierr);
+  ierr = PetscCalloc1(n,&u_vec);CHKERRQ(ierr);
+  HP = (unsigned int **) malloc(n*sizeof(unsigned int*));
+  hess_pat(tag,n,u_vec,HP,0);
+  ierr = PetscFree(u_vec);CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(adctx->event2,0,0,0,0);CHKERRQ(ierr);
+  if (adctx->sparse_view) {
+    ierr = PrintSparsity(comm,n,HP);CHKERRQ(ierr);
+  }
+
+  /* Colour, seed the Taylor tensor and build the recovery plan */
+  ierr = PetscLogEventBegin(adctx->event3,0,0,0,0);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(n,1),&colours);CHKERRQ(ierr);
+  if (colouring == 0) {
+    ierr = ColPackStarColoring(HP,n,colours,&p);CHKERRQ(ierr);
+  } else {
+    ierr = GreedyColoring(HP,n,n,colours,&p);CHKERRQ(ierr);
   }
-  concat[n] = param[0];
-  jacobian(tag,m,n+1,concat,J);
-  for (i=0; i<m; i++) {
-    //if (fabs(J[i][n]) > 1.e-16) {
-      ierr = MatSetValues(A,1,&i,1,&j,&J[i][n],INSERT_VALUES);CHKERRQ(ierr);
-    //}
+  adctx->pH = p;
+  adctx->XH = myalloc3(n,p,1);
+  adctx->YH = myalloc3(1,p,1);
+  adctx->ZH = myalloc3(p,n,2);
+  adctx->UH = myalloc2(1,2);
+  for (j=0; j<n; j++) {
+    for (i=0; i<p; i++) adctx->XH[j][i][0] = (colours[j] == i) ? 1. : 0.;
+  }
+  adctx->UH[0][0] = 1.;adctx->UH[0][1] = 0.;
+  ierr = GetSymmetricRecoveryMatrix(colours,HP,n,p,&adctx->planH);CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(adctx->event3,0,0,0,0);CHKERRQ(ierr);
+  for (i=0; i<n; i++)
+    free(HP[i]);
+  free(HP);
+  ierr = PetscFree(colours);CHKERRQ(ierr);
+
+  /* Size the compressed Hessian buffer now, so that no allocation happens during evaluation */
+  ierr = AdolcWorkspaceGetJacobian(adctx,n,p,&H);CHKERRQ(ierr);
+  if (view) {
+    ierr = PetscPrintf(comm,"ADOL-C Hessian: %s colouring, p = %D\n",colourings[colouring],p);CHKERRQ(ierr);
   }
-  ierr = PetscFree(concat);CHKERRQ(ierr);
-  ierr = AdolcFree2(J);CHKERRQ(ierr);
-  ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
-  ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
 
 /*
-  Compute local portion of Jacobian w.r.t a parameter for explicit TS.
-
-  TODO: Do not form whole matrix. Just propagate [0,0,1] (for example).
-  TODO: Account for multiple parameters
-  TODO: Allow compressed format
+  Compute the Hessian of a scalar function in compressed format and recover from this, using the
+  seed tensor and recovery plan set up by AdolcHessianSetUp. A single hov_wk_forward sweep computes
+  the first and second order Taylor coefficients in each of the pH directions, after which
+  hos_ov_reverse yields the compressed Hessian as the second order adjoints.
 
   Input parameters:
-  u_vec - vector at which to evaluate Jacobian
-  param - the parameter
   tag   - tape identifier
+  x     - vector at which to evaluate Hessian
   ctx   - ADOL-C context, as defined above
 
   Output parameter:
-  A     - Mat object corresponding to Jacobian
+  A     - Mat object corresponding to Hessian
 */
-PetscErrorCode AdolcComputeRHSJacobianPLocal(Mat A,PetscScalar *u_vec,PetscScalar *param,PetscInt tag,void *ctx)
+PetscErrorCode AdolcComputeHessian(PetscInt tag,Mat A,PetscScalar *x,void *ctx)
 {
-  AdolcCtx       *adctx = (AdolcCtx*)ctx;
   PetscErrorCode ierr;
-  PetscInt       i,j = 0,m = adctx->m,n = adctx->n;
-  PetscScalar    **J,*concat;
+  AdolcCtx       *adctx = (AdolcCtx*)ctx;
+  PetscInt       i,j,n = adctx->n,p = adctx->pH;
+  PetscScalar    **H,y;
 
   PetscFunctionBegin;
-  ierr = AdolcMalloc2(m,1,&J);CHKERRQ(ierr);
-  ierr = PetscMalloc1(n+1,&concat);CHKERRQ(ierr);
+  ierr = AdolcWorkspaceGetJacobian(adctx,n,p,&H);CHKERRQ(ierr);
+  ierr = PetscLogEventBegin(adctx->event4,0,0,0,0);CHKERRQ(ierr);
+  hov_wk_forward(tag,1,n,1,2,p,x,adctx->XH,&y,adctx->YH);
+  hos_ov_reverse(tag,1,n,1,p,adctx->UH,adctx->ZH);
   for (i=0; i<n; i++) {
-    concat[i] = u_vec[i];
+    for (j=0; j<p; j++) H[i][j] = adctx->ZH[j][i][1];
   }
-  concat[n] = param[0];
-  jacobian(tag,m,n+1,concat,J);
-  for (i=0; i<m; i++) {
-    if (fabs(J[i][n]) > 1.e-16) {
-      ierr = MatSetValuesLocal(A,1,&i,1,&j,&J[i][n],INSERT_VALUES);CHKERRQ(ierr);
-    }
+  ierr = PetscLogEventEnd(adctx->event4,0,0,0,0);CHKERRQ(ierr);
+  if ((adctx->sparse_view) && (!adctx->sparse_view_done)) {
+    ierr = PrintMat(MPI_COMM_WORLD,"Compressed Hessian:",n,p,H);CHKERRQ(ierr);
+    adctx->sparse_view_done = PETSC_TRUE;
   }
-  ierr = PetscFree(concat);CHKERRQ(ierr);
-  ierr = AdolcFree2(J);CHKERRQ(ierr);
+  ierr = PetscLogEventBegin(adctx->event5,0,0,0,0);CHKERRQ(ierr);
+  ierr = RecoverJacobian(A,INSERT_VALUES,adctx->planH,H,NULL);CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(adctx->event5,0,0,0,0);CHKERRQ(ierr);
   ierr = MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
   ierr = MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
 
-
-/* --------------------------------------------------------------------------------
-   Drivers for Jacobian diagonal
-   ----------------------------------------------------------------------------- */
-
 /*
-  Compute local portion of Jacobian diagonal for implicit TS in compressed format and recover
-  from this, using precomputed seed matrix and recovery vector.
-
-  Input parameters:
-  tag1  - tape identifier for df/dx part
-  tag2  - tape identifier for df/d(xdot) part
-  u_vec - vector at which to evaluate Jacobian
-  ctx   - ADOL-C context, as defined above
+  Free the seed matrices, recovery plans, recovery vector, tensors and workspace set up by
+  AdolcJacobianSetUp, AdolcJacobianPSetUp, AdolcDiagonalSetUp and AdolcHessianSetUp
 
-  Output parameter:
-  diag  - Vec object corresponding to Jacobian diagonal
+  Input parameter:
+  adctx - ADOL-C context
 */
-PetscErrorCode AdolcComputeIJacobianAndDiagonalLocal(PetscInt tag1,PetscInt tag2,Vec diag,PetscScalar *u_vec,PetscReal a,void *ctx)
+PetscErrorCode AdolcJacobianDestroy(AdolcCtx *adctx)
 {
-  AdolcCtx       *adctx = (AdolcCtx*)ctx;
   PetscErrorCode ierr;
-  PetscInt       i,m = adctx->m,n = adctx->n,p = adctx->p;
-  PetscScalar    **J;
 
   PetscFunctionBegin;
-  ierr = AdolcMalloc2(m,p,&J);CHKERRQ(ierr);
-
-  /* dF/dx part */
-  if (adctx->Seed)
-    fov_forward(tag1,m,n,p,u_vec,adctx->Seed,NULL,J);
-  else
-    jacobian(tag1,m,n,u_vec,J);
-  if (adctx->sparse) {
-    ierr = RecoverDiagonalLocal(diag,INSERT_VALUES,m,adctx->rec,J,NULL);CHKERRQ(ierr);
-  } else {
-    for (i=0; i<m; i++) {
-      if (fabs(J[i][i]) > 1.e-16) {
-        ierr = VecSetValuesLocal(diag,1,&i,&J[i][i],INSERT_VALUES);CHKERRQ(ierr);
-      }
-    }
+  ierr = RecPlanDestroy(&adctx->plan);CHKERRQ(ierr);
+  ierr = RecPlanDestroy(&adctx->planR);CHKERRQ(ierr);
+  ierr = RecPlanDestroy(&adctx->planH);CHKERRQ(ierr);
+  ierr = RecPlanDestroy(&adctx->planP);CHKERRQ(ierr);
+  if (adctx->XH) {
+    myfree3(adctx->XH);
+    myfree3(adctx->YH);
+    myfree3(adctx->ZH);
+    myfree2(adctx->UH);
+    adctx->XH = adctx->YH = adctx->ZH = NULL;
+    adctx->UH = NULL;
   }
-  ierr = VecAssemblyBegin(diag);CHKERRQ(ierr);
-  ierr = VecAssemblyEnd(diag);CHKERRQ(ierr);
-
-  /* a * dF/d(xdot) part */
-  if (adctx->Seed)
-    fov_forward(tag2,m,n,p,u_vec,adctx->Seed,NULL,J);
-  else
-    jacobian(tag2,m,n,u_vec,J);
-  if (adctx->sparse) {
-    ierr = RecoverDiagonalLocal(diag,ADD_VALUES,m,adctx->rec,J,NULL);CHKERRQ(ierr);
-  } else {
-    for (i=0; i<m; i++) {
-      if (fabs(J[i][i]) > 1.e-16) {
-        J[i][i] *= a;
-        ierr = VecSetValuesLocal(diag,1,&i,&J[i][i],ADD_VALUES);CHKERRQ(ierr);
-      }
-    }
+  if (adctx->Seed) {
+    ierr = AdolcFree2(adctx->Seed);CHKERRQ(ierr);
+    adctx->Seed = NULL;
   }
-  ierr = VecAssemblyBegin(diag);CHKERRQ(ierr);
-  ierr = VecAssemblyEnd(diag);CHKERRQ(ierr);
-  ierr = AdolcFree2(J);CHKERRQ(ierr);
+  if (adctx->SeedR) {
+    ierr = AdolcFree2(adctx->SeedR);CHKERRQ(ierr);
+    adctx->SeedR = NULL;
+  }
+  if (adctx->SeedD) {
+    ierr = AdolcFree2(adctx->SeedD);CHKERRQ(ierr);
+    adctx->SeedD = NULL;
+  }
+  if (adctx->SeedP) {
+    ierr = AdolcFree2(adctx->SeedP);CHKERRQ(ierr);
+    adctx->SeedP = NULL;
+  }
+  ierr = PetscFree(adctx->colours);CHKERRQ(ierr);
+  ierr = PetscFree(adctx->coloursR);CHKERRQ(ierr);
+  ierr = PetscFree(adctx->rec);CHKERRQ(ierr);
+  ierr = PetscFree(adctx->rows);CHKERRQ(ierr);
+  ierr = PetscFree(adctx->coov);CHKERRQ(ierr);
+  ierr = AdolcWorkspaceDestroy(adctx);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
-
+#endif
@@ -1,6 +1,7 @@
 #include <petscdm.h>
 #include <petscdmda.h>
 #include <adolc/adolc.h>
+#include "contexts.cxx"
 
 
 /*
@@ -39,6 +40,374 @@ PetscErrorCode AdolcFree2(T **A)
   PetscFunctionReturn(0);
 }
 
+/*
+  (Re)allocate a contiguous 2d array, but only if its dimensions differ from those it is
+  currently allocated with. Memory is obtained using PetscMalloc, so is aligned to
+  PETSC_MEMALIGN.
+
+  Input parameters:
+  m,n       - number of rows and columns required
+  mcur,ncur - number of rows and columns currently allocated (updated on output)
+
+  Output parameter:
+  A         - 2d array, whose rows point into contiguous storage
+*/
+PetscErrorCode AdolcWorkspaceResize2(PetscInt m,PetscInt n,PetscInt *mcur,PetscInt *ncur,PetscScalar ***A)
+{
+  PetscErrorCode ierr;
+  PetscInt       i;
+
+  PetscFunctionBegin;
+  if ((*A) && (m == *mcur) && (n == *ncur)) PetscFunctionReturn(0);
+  if (*A) {
+    ierr = PetscFree((*A)[0]);CHKERRQ(ierr);
+    ierr = PetscFree(*A);CHKERRQ(ierr);
+  }
+  ierr = PetscMalloc1(PetscMax(m,1),A);CHKERRQ(ierr);
+  ierr = PetscCalloc1(PetscMax(m*n,1),&(*A)[0]);CHKERRQ(ierr);
+  for (i=1; i<m; i++) (*A)[i] = (*A)[0] + i*n;
+  *mcur = m;*ncur = n;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Get compressed Jacobian buffer of dimension m x p from the persistent workspace
+
+  Input parameters:
+  adctx - ADOL-C context
+  m,p   - number of rows and columns (colours) required
+
+  Output parameter:
+  J     - buffer, owned by the workspace
+*/
+PetscErrorCode AdolcWorkspaceGetJacobian(AdolcCtx *adctx,PetscInt m,PetscInt p,PetscScalar ***J)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcWorkspaceResize2(m,p,&adctx->work.Jm,&adctx->work.Jn,&adctx->work.J);CHKERRQ(ierr);
+  *J = adctx->work.J;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Get second compressed Jacobian buffer of dimension m x p from the persistent workspace, for
+  holding dF/d(xdot) in implicit TS
+
+  Input parameters:
+  adctx - ADOL-C context
+  m,p   - number of rows and columns (colours) required
+
+  Output parameter:
+  J2    - buffer, owned by the workspace
+*/
+PetscErrorCode AdolcWorkspaceGetJacobian2(AdolcCtx *adctx,PetscInt m,PetscInt p,PetscScalar ***J2)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcWorkspaceResize2(m,p,&adctx->work.J2m,&adctx->work.J2n,&adctx->work.J2);CHKERRQ(ierr);
+  *J2 = adctx->work.J2;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Get row-compressed Jacobian buffer of dimension p x n from the persistent workspace, for the
+  reverse mode part of bidirectional compression
+
+  Input parameters:
+  adctx - ADOL-C context
+  p,n   - number of rows (colours) and columns required
+
+  Output parameter:
+  JR    - buffer, owned by the workspace
+*/
+PetscErrorCode AdolcWorkspaceGetJacobianR(AdolcCtx *adctx,PetscInt p,PetscInt n,PetscScalar ***JR)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcWorkspaceResize2(p,n,&adctx->work.JRm,&adctx->work.JRn,&adctx->work.JR);CHKERRQ(ierr);
+  *JR = adctx->work.JR;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Get second row-compressed Jacobian buffer of dimension p x n from the persistent workspace,
+  for holding the reverse mode part of dF/d(xdot) in implicit TS
+
+  Input parameters:
+  adctx - ADOL-C context
+  p,n   - number of rows (colours) and columns required
+
+  Output parameter:
+  JR2   - buffer, owned by the workspace
+*/
+PetscErrorCode AdolcWorkspaceGetJacobianR2(AdolcCtx *adctx,PetscInt p,PetscInt n,PetscScalar ***JR2)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcWorkspaceResize2(p,n,&adctx->work.JR2m,&adctx->work.JR2n,&adctx->work.JR2);CHKERRQ(ierr);
+  *JR2 = adctx->work.JR2;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Get buffer for Jacobian w.r.t. parameters, of dimension m x n, from the persistent workspace
+
+  Input parameters:
+  adctx - ADOL-C context
+  m,n   - number of rows and columns required
+
+  Output parameter:
+  JP    - buffer, owned by the workspace
+*/
+PetscErrorCode AdolcWorkspaceGetJacobianP(AdolcCtx *adctx,PetscInt m,PetscInt n,PetscScalar ***JP)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcWorkspaceResize2(m,n,&adctx->work.JPm,&adctx->work.JPn,&adctx->work.JP);CHKERRQ(ierr);
+  *JP = adctx->work.JP;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Get identity seed matrix for k parameter directions, of dimension (n+k) x k, from the
+  persistent workspace. Rows corresponding to independent variables are zero.
+
+  Input parameters:
+  adctx - ADOL-C context
+  n     - number of independent variables, excluding parameters
+  k     - number of parameters
+
+  Output parameter:
+  SP    - seed matrix, owned by the workspace
+*/
+PetscErrorCode AdolcWorkspaceGetSeedP(AdolcCtx *adctx,PetscInt n,PetscInt k,PetscScalar ***SP)
+{
+  PetscErrorCode ierr;
+  PetscInt       j;
+
+  PetscFunctionBegin;
+  ierr = AdolcWorkspaceResize2(n+k,k,&adctx->work.SPm,&adctx->work.SPn,&adctx->work.SP);CHKERRQ(ierr);
+  for (j=0; j<k; j++) adctx->work.SP[n+j][j] = 1.;
+  *SP = adctx->work.SP;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Get vector for concatenating independent variables and parameters from the persistent
+  workspace
+
+  Input parameters:
+  adctx  - ADOL-C context
+  n      - length required
+
+  Output parameter:
+  concat - buffer, owned by the workspace
+*/
+PetscErrorCode AdolcWorkspaceGetConcat(AdolcCtx *adctx,PetscInt n,PetscScalar **concat)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  if ((!adctx->work.concat) || (n != adctx->work.concatn)) {
+    ierr = PetscFree(adctx->work.concat);CHKERRQ(ierr);
+    ierr = PetscCalloc1(PetscMax(n,1),&adctx->work.concat);CHKERRQ(ierr);
+    adctx->work.concatn = n;
+  }
+  *concat = adctx->work.concat;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Get buffer for dependent values of length m from the persistent workspace, as required by the
+  forward sweep which precedes reverse mode propagation
+
+  Input parameters:
+  adctx - ADOL-C context
+  m     - length required
+
+  Output parameter:
+  y     - buffer, owned by the workspace
+*/
+PetscErrorCode AdolcWorkspaceGetDependents(AdolcCtx *adctx,PetscInt m,PetscScalar **y)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  if ((!adctx->work.y) || (m != adctx->work.yn)) {
+    ierr = PetscFree(adctx->work.y);CHKERRQ(ierr);
+    ierr = PetscCalloc1(PetscMax(m,1),&adctx->work.y);CHKERRQ(ierr);
+    adctx->work.yn = m;
+  }
+  *y = adctx->work.y;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Get buffer for a block of b columns of the column seed matrix, of dimension n x b, from the
+  persistent workspace. The buffer is zero on allocation.
+
+  Input parameters:
+  adctx - ADOL-C context
+  n,b   - number of rows and columns required
+
+  Output parameter:
+  SB    - buffer, owned by the workspace
+*/
+PetscErrorCode AdolcWorkspaceGetSeedBlock(AdolcCtx *adctx,PetscInt n,PetscInt b,PetscScalar ***SB)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AdolcWorkspaceResize2(n,b,&adctx->work.SBm,&adctx->work.SBn,&adctx->work.SB);CHKERRQ(ierr);
+  *SB = adctx->work.SB;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Get array of m row pointers from the persistent workspace, for addressing a block of columns of
+  a compressed Jacobian
+
+  Input parameters:
+  adctx - ADOL-C context
+  m     - length required
+
+  Output parameter:
+  Y     - array of row pointers, owned by the workspace
+*/
+PetscErrorCode AdolcWorkspaceGetRows(AdolcCtx *adctx,PetscInt m,PetscScalar ***Y)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  if ((!adctx->work.Y) || (m != adctx->work.Ym)) {
+    ierr = PetscFree(adctx->work.Y);CHKERRQ(ierr);
+    ierr = PetscMalloc1(PetscMax(m,1),&adctx->work.Y);CHKERRQ(ierr);
+    adctx->work.Ym = m;
+  }
+  *Y = adctx->work.Y;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Print the total memory footprint of the persistent workspace
+
+  Input parameters:
+  comm  - MPI communicator
+  adctx - ADOL-C context
+*/
+PetscErrorCode AdolcWorkspaceView(MPI_Comm comm,AdolcCtx *adctx)
+{
+  PetscErrorCode ierr;
+  AdolcWork      *work = &adctx->work;
+  PetscLogDouble bytes = 0.;
+
+  PetscFunctionBegin;
+  if (work->J) bytes += work->Jm*(sizeof(PetscScalar*) + work->Jn*sizeof(PetscScalar));
+  if (work->J2) bytes += work->J2m*(sizeof(PetscScalar*) + work->J2n*sizeof(PetscScalar));
+  if (work->JR) bytes += work->JRm*(sizeof(PetscScalar*) + work->JRn*sizeof(PetscScalar));
+  if (work->JR2) bytes += work->JR2m*(sizeof(PetscScalar*) + work->JR2n*sizeof(PetscScalar));
+  if (work->JP) bytes += work->JPm*(sizeof(PetscScalar*) + work->JPn*sizeof(PetscScalar));
+  if (work->SP) bytes += work->SPm*(sizeof(PetscScalar*) + work->SPn*sizeof(PetscScalar));
+  if (work->concat) bytes += work->concatn*sizeof(PetscScalar);
+  if (work->y) bytes += work->yn*sizeof(PetscScalar);
+  if (work->SB) bytes += work->SBm*(sizeof(PetscScalar*) + work->SBn*sizeof(PetscScalar));
+  if (work->Y) bytes += work->Ym*sizeof(PetscScalar*);
+  ierr = PetscPrintf(comm,"ADOL-C workspace: J %D x %D, J2 %D x %D, JR %D x %D, JR2 %D x %D, JP %D x %D, SP %D x %D, SB %D x %D, concat %D, y %D, total %g KiB\n",
+                     work->Jm,work->Jn,work->J2m,work->J2n,work->JRm,work->JRn,work->JR2m,work->JR2n,work->JPm,work->JPn,work->SPm,work->SPn,work->SBm,work->SBn,work->concatn,work->yn,bytes/1024.);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Size the persistent workspace according to the dimensions stored in the ADOL-C context, so
+  that no allocation happens during Jacobian evaluation. Use -adolc_workspace_view to print
+  its memory footprint.
+
+  Input parameter:
+  adctx - ADOL-C context, with m, n and p set (and reverse, for row compression,
+          bidirectional and pR, for bidirectional compression, or seed_block, for blocked
+          column compression)
+*/
+PetscErrorCode AdolcWorkspaceSetUp(AdolcCtx *adctx)
+{
+  PetscErrorCode ierr;
+  PetscScalar    **J,**SB,**Y,*y;
+  PetscBool      view = PETSC_FALSE;
+
+  PetscFunctionBegin;
+  if (adctx->reverse) {
+    ierr = AdolcWorkspaceGetJacobian(adctx,adctx->p,adctx->n,&J);CHKERRQ(ierr);
+    ierr = AdolcWorkspaceGetDependents(adctx,adctx->m,&y);CHKERRQ(ierr);
+  } else {
+    ierr = AdolcWorkspaceGetJacobian(adctx,adctx->m,adctx->p,&J);CHKERRQ(ierr);
+  }
+  if (adctx->bidirectional) {
+    ierr = AdolcWorkspaceGetJacobianR(adctx,adctx->pR,adctx->n,&J);CHKERRQ(ierr);
+    ierr = AdolcWorkspaceGetDependents(adctx,adctx->m,&y);CHKERRQ(ierr);
+  }
+  if ((adctx->seed_block > 0) && (adctx->sparse) && (!adctx->reverse) && (!adctx->bidirectional)) {
+    ierr = AdolcWorkspaceGetSeedBlock(adctx,adctx->n,PetscMin(adctx->seed_block,adctx->p),&SB);CHKERRQ(ierr);
+    ierr = PetscMemzero(SB[0],adctx->work.SBm*adctx->work.SBn*sizeof(PetscScalar));CHKERRQ(ierr);
+    ierr = AdolcWorkspaceGetRows(adctx,adctx->m,&Y);CHKERRQ(ierr);
+  }
+  ierr = PetscOptionsGetBool(NULL,NULL,"-adolc_workspace_view",&view,NULL);CHKERRQ(ierr);
+  if (view) {
+    ierr = AdolcWorkspaceView(PETSC_COMM_WORLD,adctx);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Free the persistent workspace
+
+  Input parameter:
+  adctx - ADOL-C context
+*/
+PetscErrorCode AdolcWorkspaceDestroy(AdolcCtx *adctx)
+{
+  PetscErrorCode ierr;
+  AdolcWork      *work = &adctx->work;
+
+  PetscFunctionBegin;
+  if (work->J) {
+    ierr = PetscFree(work->J[0]);CHKERRQ(ierr);
+    ierr = PetscFree(work->J);CHKERRQ(ierr);
+  }
+  if (work->J2) {
+    ierr = PetscFree(work->J2[0]);CHKERRQ(ierr);
+    ierr = PetscFree(work->J2);CHKERRQ(ierr);
+  }
+  if (work->JR) {
+    ierr = PetscFree(work->JR[0]);CHKERRQ(ierr);
+    ierr = PetscFree(work->JR);CHKERRQ(ierr);
+  }
+  if (work->JR2) {
+    ierr = PetscFree(work->JR2[0]);CHKERRQ(ierr);
+    ierr = PetscFree(work->JR2);CHKERRQ(ierr);
+  }
+  if (work->JP) {
+    ierr = PetscFree(work->JP[0]);CHKERRQ(ierr);
+    ierr = PetscFree(work->JP);CHKERRQ(ierr);
+  }
+  if (work->SP) {
+    ierr = PetscFree(work->SP[0]);CHKERRQ(ierr);
+    ierr = PetscFree(work->SP);CHKERRQ(ierr);
+  }
+  ierr = PetscFree(work->concat);CHKERRQ(ierr);
+  if (work->SB) {
+    ierr = PetscFree(work->SB[0]);CHKERRQ(ierr);
+    ierr = PetscFree(work->SB);CHKERRQ(ierr);
+  }
+  ierr = PetscFree(work->Y);CHKERRQ(ierr);
+  ierr = PetscFree(work->y);CHKERRQ(ierr);
+  ierr = PetscMemzero(work,sizeof(AdolcWork));CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
 /*
   Shift indices in an array of type T to endow it with ghost points.
   (e.g. This works for arrays of adoubles or AFields.)
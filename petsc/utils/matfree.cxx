@@ -1,7 +1,202 @@
+#ifndef ADOLCMATFREE
+#define ADOLCMATFREE
 #include <petscdm.h>
 #include <petscdmda.h>
 #include <adolc/adolc.h>
-#include "contexts.cxx"
+#include "drivers.cxx"
+
+/*
+  Set up a matrix-free context for tapes recorded in local (ghosted) numbering on a DMDA of any
+  dimension, number of degrees of freedom and stencil width. The tape dimensions are taken from
+  the ghosted region, the action vector is allocated and the owned entries, which form ym*zm
+  contiguous runs of xm*dof entries, are mapped once to their offsets in local ordering, so that
+  products may be written back without branching on ownership (see MatFreeWriteOwned).
+
+  Input parameter:
+  da   - DMDA upon which the tapes are defined
+
+  Output parameter:
+  mctx - matrix-free context, with m, n, action and the run map set
+*/
+PetscErrorCode MatFreeSetUp(DM da,MatCtx *mctx)
+{
+  PetscErrorCode ierr;
+  DMDALocalInfo  info;
+  PetscInt       dim,dof,j,k,r = 0;
+
+  PetscFunctionBegin;
+  ierr = DMDAGetInfo(da,&dim,NULL,NULL,NULL,NULL,NULL,NULL,&dof,NULL,NULL,NULL,NULL,NULL);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+  if (dim < 2) {info.ys = info.gys = 0;info.ym = info.gym = 1;}
+  if (dim < 3) {info.zs = info.gzs = 0;info.zm = info.gzm = 1;}
+  mctx->m = dof*info.gxm*info.gym*info.gzm;
+  mctx->n = mctx->m;
+  mctx->nruns = info.ym*info.zm;
+  mctx->runlen = dof*info.xm;
+  mctx->tagc = -1;
+  mctx->tstate[0] = -1;
+  mctx->tstate[1] = -1;
+  ierr = PetscLogEventRegister("Taylor cache hit",MAT_CLASSID,&mctx->taylorhit);CHKERRQ(ierr);
+  ierr = PetscLogEventRegister("Taylor cache miss",MAT_CLASSID,&mctx->taylormiss);CHKERRQ(ierr);
+  mctx->xc = NULL;
+  mctx->dxc = NULL;
+  mctx->S = NULL;
+  mctx->T = NULL;
+  mctx->Scap[0] = mctx->Scap[1] = 0;
+  mctx->Tcap[0] = mctx->Tcap[1] = 0;
+  ierr = PetscMalloc1(PetscMax(mctx->m,mctx->n),&mctx->action);CHKERRQ(ierr);
+  ierr = PetscMalloc1(mctx->nruns,&mctx->runs);CHKERRQ(ierr);
+  for (k=info.zs; k<info.zs+info.zm; k++) {
+    for (j=info.ys; j<info.ys+info.ym; j++) {
+      mctx->runs[r++] = (((k-info.gzs)*info.gym + j-info.gys)*info.gxm + info.xs-info.gxs)*dof;
+    }
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Free the workspace allocated by MatFreeSetUp.
+*/
+PetscErrorCode MatFreeDestroy(MatCtx *mctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = PetscFree(mctx->action);CHKERRQ(ierr);
+  ierr = PetscFree(mctx->runs);CHKERRQ(ierr);
+  ierr = PetscFree2(mctx->xc,mctx->dxc);CHKERRQ(ierr);
+  if (mctx->S) {
+    ierr = PetscFree(mctx->S[0]);CHKERRQ(ierr);
+    ierr = PetscFree(mctx->S);CHKERRQ(ierr);
+  }
+  if (mctx->T) {
+    ierr = PetscFree(mctx->T[0]);CHKERRQ(ierr);
+    ierr = PetscFree(mctx->T);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Enable the fused Jacobian vector product (see JacobianVectorProductFused), given a tape of the
+  implicit function F(x,xdot) recorded with the local (ghosted) entries of x and then those of
+  xdot marked as independents.
+
+  Input parameter:
+  tag  - tag of the fused tape
+
+  Output parameter:
+  mctx - matrix-free context, set up by MatFreeSetUp
+*/
+PetscErrorCode MatFreeFusedSetUp(PetscInt tag,MatCtx *mctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  mctx->tagc = tag;
+  ierr = PetscMalloc2(2*mctx->n,&mctx->xc,2*mctx->n,&mctx->dxc);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Update the point at which the Jacobian is applied, scattering X (and Xdot, for the fused tape)
+  to local vectors just once per Jacobian evaluation, rather than once per product.
+
+  Input parameters:
+  da   - DMDA upon which the tapes are defined
+  mctx - matrix-free context, holding the current X and Xdot
+
+  Output parameter:
+  mctx - matrix-free context, with localX0 (and the fused base point) updated
+*/
+PetscErrorCode MatFreeSetBasePoint(DM da,MatCtx *mctx)
+{
+  PetscErrorCode    ierr;
+  Vec               localXdot;
+  const PetscScalar *x0,*xdot0;
+
+  PetscFunctionBegin;
+  ierr = DMGlobalToLocalBegin(da,mctx->X,INSERT_VALUES,mctx->localX0);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd(da,mctx->X,INSERT_VALUES,mctx->localX0);CHKERRQ(ierr);
+  if (mctx->tagc >= 0) {
+    ierr = DMGetLocalVector(da,&localXdot);CHKERRQ(ierr);
+    ierr = DMGlobalToLocalBegin(da,mctx->Xdot,INSERT_VALUES,localXdot);CHKERRQ(ierr);
+    ierr = DMGlobalToLocalEnd(da,mctx->Xdot,INSERT_VALUES,localXdot);CHKERRQ(ierr);
+    ierr = VecGetArrayRead(mctx->localX0,&x0);CHKERRQ(ierr);
+    ierr = VecGetArrayRead(localXdot,&xdot0);CHKERRQ(ierr);
+    ierr = PetscMemcpy(mctx->xc,x0,mctx->n*sizeof(PetscScalar));CHKERRQ(ierr);
+    ierr = PetscMemcpy(mctx->xc+mctx->n,xdot0,mctx->n*sizeof(PetscScalar));CHKERRQ(ierr);
+    ierr = VecRestoreArrayRead(localXdot,&xdot0);CHKERRQ(ierr);
+    ierr = VecRestoreArrayRead(mctx->localX0,&x0);CHKERRQ(ierr);
+    ierr = DMRestoreLocalVector(da,&localXdot);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Prepare a tape for a reverse sweep at the current linearisation point. The zero order forward
+  sweep, which stores the Taylor buffer used by fos_reverse and fov_reverse, is run only if
+  localX0 has changed since the last sweep on the same tape, so that it is run exactly once per
+  linearisation point however many transpose products are applied there. Hits and misses are
+  logged as the events "Taylor cache hit" and "Taylor cache miss".
+
+  Input parameters:
+  mctx - matrix-free context, set up by MatFreeSetUp
+  t    - 0 for tag1 or 1 for tag2
+  x0   - array of localX0
+*/
+PetscErrorCode MatFreeTaylorUpdate(MatCtx *mctx,PetscInt t,const PetscScalar *x0)
+{
+  PetscErrorCode   ierr;
+  PetscObjectState state;
+
+  PetscFunctionBegin;
+  ierr = PetscObjectStateGet((PetscObject)mctx->localX0,&state);CHKERRQ(ierr);
+  if (state == mctx->tstate[t]) {
+    ierr = PetscLogEventBegin(mctx->taylorhit,0,0,0,0);CHKERRQ(ierr);
+    ierr = PetscLogEventEnd(mctx->taylorhit,0,0,0,0);CHKERRQ(ierr);
+  } else {
+    ierr = PetscLogEventBegin(mctx->taylormiss,0,0,0,0);CHKERRQ(ierr);
+    zos_forward(t ? mctx->tag2 : mctx->tag1,mctx->m,mctx->n,1,x0,NULL);
+    mctx->tstate[t] = state;
+    ierr = PetscLogEventEnd(mctx->taylormiss,0,0,0,0);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Write the owned part of an array in local (ghosted) ordering, such as the output of fos_forward
+  or fos_reverse, straight into the local storage of a global vector. Each run of owned entries
+  is copied (or scaled and added) in a single pass, without calls to VecSetValuesLocal or vector
+  assembly.
+
+  Input parameters:
+  mctx   - matrix-free context, set up by MatFreeSetUp
+  action - array in local (ghosted) ordering
+  mode   - INSERT_VALUES to copy the owned entries, or ADD_VALUES to add a times them
+  a      - scaling (only used with ADD_VALUES)
+
+  Output parameter:
+  y      - local storage of the global vector, as given by VecGetArray
+*/
+PetscErrorCode MatFreeWriteOwned(MatCtx *mctx,const PetscScalar *action,InsertMode mode,PetscReal a,PetscScalar *y)
+{
+  PetscErrorCode    ierr;
+  PetscInt          r,l,len = mctx->runlen;
+  const PetscScalar *src;
+  PetscScalar       *dst;
+
+  PetscFunctionBegin;
+  for (r=0; r<mctx->nruns; r++) {
+    src = action + mctx->runs[r];
+    dst = y + r*len;
+    if (mode == INSERT_VALUES) {
+      ierr = PetscMemcpy(dst,src,len*sizeof(PetscScalar));CHKERRQ(ierr);
+    } else {
+      for (l=0; l<len; l++) dst[l] += a*src[l];
+    }
+  }
+  PetscFunctionReturn(0);
+}
 
 /*
   ADOL-C implementation for Jacobian vector product, using the forward mode of AD.
@@ -24,12 +219,11 @@ PetscErrorCode JacobianVectorProduct(Mat A_shell,Vec X,Vec Y)
 {
   MatCtx            *mctx;
   PetscErrorCode    ierr;
-  PetscInt          m,n,i,j,k = 0,d;
+  PetscInt          m,n;
   const PetscScalar *x0;
-  PetscScalar       *action,*x1;
+  PetscScalar       *action,*x1,*z;
   Vec               localX1;
   DM                da;
-  DMDALocalInfo     info;
 
   PetscFunctionBegin;
 
@@ -40,7 +234,6 @@ PetscErrorCode JacobianVectorProduct(Mat A_shell,Vec X,Vec Y)
 
   /* Get local input vectors and extract data, x0 and x1*/
   ierr = TSGetDM(mctx->ts,&da);CHKERRQ(ierr);
-  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
   ierr = DMGetLocalVector(da,&localX1);CHKERRQ(ierr);
   ierr = DMGlobalToLocalBegin(da,X,INSERT_VALUES,localX1);CHKERRQ(ierr);
   ierr = DMGlobalToLocalEnd(da,X,INSERT_VALUES,localX1);CHKERRQ(ierr);
@@ -49,50 +242,80 @@ PetscErrorCode JacobianVectorProduct(Mat A_shell,Vec X,Vec Y)
   ierr = VecGetArray(localX1,&x1);CHKERRQ(ierr);
 
   /* dF/dx part */
-  ierr = PetscMalloc1(m,&action);CHKERRQ(ierr);
+  action = mctx->action;
+  ierr = VecGetArray(Y,&z);CHKERRQ(ierr);
   ierr = PetscLogEventBegin(mctx->event1,0,0,0,0);CHKERRQ(ierr);
   fos_forward(mctx->tag1,m,n,0,x0,x1,NULL,action);
-  for (j=info.gys; j<info.gys+info.gym; j++) {
-    for (i=info.gxs; i<info.gxs+info.gxm; i++) {
-      for (d=0; d<2; d++) {
-        if ((i >= info.xs) && (i < info.xs+info.xm) && (j >= info.ys) && (j < info.ys+info.ym)) {
-          ierr = VecSetValuesLocal(Y,1,&k,&action[k],INSERT_VALUES);CHKERRQ(ierr);
-        }
-        k++;
-      }
-    }
-  }
+  ierr = MatFreeWriteOwned(mctx,action,INSERT_VALUES,0.,z);CHKERRQ(ierr);
   ierr = PetscLogEventEnd(mctx->event1,0,0,0,0);CHKERRQ(ierr);
-  k = 0;
-  ierr = VecAssemblyBegin(Y);CHKERRQ(ierr); /* Note: Need to assemble between separate calls */
-  ierr = VecAssemblyEnd(Y);CHKERRQ(ierr);   /*       to INSERT_VALUES and ADD_VALUES         */
 
   /* a * dF/d(xdot) part */
   ierr = PetscLogEventBegin(mctx->event2,0,0,0,0);CHKERRQ(ierr);
   fos_forward(mctx->tag2,m,n,0,x0,x1,NULL,action);
-  for (j=info.gys; j<info.gys+info.gym; j++) {
-    for (i=info.gxs; i<info.gxs+info.gxm; i++) {
-      for (d=0; d<2; d++) {
-        if ((i >= info.xs) && (i < info.xs+info.xm) && (j >= info.ys) && (j < info.ys+info.ym)) {
-          action[k] *= mctx->shift;
-          ierr = VecSetValuesLocal(Y,1,&k,&action[k],ADD_VALUES);CHKERRQ(ierr);
-        }
-        k++;
-      }
-    }
-  }
+  ierr = MatFreeWriteOwned(mctx,action,ADD_VALUES,mctx->shift,z);CHKERRQ(ierr);
   ierr = PetscLogEventEnd(mctx->event2,0,0,0,0);CHKERRQ(ierr);
-  ierr = VecAssemblyBegin(Y);CHKERRQ(ierr);
-  ierr = VecAssemblyEnd(Y);CHKERRQ(ierr);
-  ierr = PetscFree(action);CHKERRQ(ierr);
 
   /* Restore local vector */
+  ierr = VecRestoreArray(Y,&z);CHKERRQ(ierr);
   ierr = VecRestoreArray(localX1,&x1);CHKERRQ(ierr);
   ierr = VecRestoreArrayRead(mctx->localX0,&x0);CHKERRQ(ierr);
   ierr = DMRestoreLocalVector(da,&localX1);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
 
+/*
+  Fused variant of JacobianVectorProduct, which propagates the seed (x1,a*x1) through a single tape
+  of F(x,xdot) in both arguments (see MatFreeFusedSetUp), so that
+     (dG/dx)(x0) * x1 = (df/dx + a*df/d(xdot))(x0) * x1
+  is computed in one forward sweep and written back once.
+
+  Input parameters:
+  A_shell - Jacobian matrix of MatShell type
+  X       - vector to be multiplied by A_shell
+
+  Output parameters:
+  Y       - product of A_shell and X
+*/
+PetscErrorCode JacobianVectorProductFused(Mat A_shell,Vec X,Vec Y)
+{
+  MatCtx            *mctx;
+  PetscErrorCode    ierr;
+  PetscInt          i,n;
+  const PetscScalar *x1;
+  PetscScalar       *z;
+  Vec               localX1;
+  DM                da;
+
+  PetscFunctionBegin;
+
+  /* Get matrix-free context info */
+  ierr = MatShellGetContext(A_shell,(void**)&mctx);CHKERRQ(ierr);
+  if (mctx->tagc < 0) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_ARG_WRONGSTATE,"Fused tape not set up; call MatFreeFusedSetUp");
+  n = mctx->n;
+
+  /* Get local input vector and assemble the seed (x1,a*x1) */
+  ierr = TSGetDM(mctx->ts,&da);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(da,&localX1);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalBegin(da,X,INSERT_VALUES,localX1);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd(da,X,INSERT_VALUES,localX1);CHKERRQ(ierr);
+  ierr = VecGetArrayRead(localX1,&x1);CHKERRQ(ierr);
+  for (i=0; i<n; i++) {
+    mctx->dxc[i]   = x1[i];
+    mctx->dxc[n+i] = mctx->shift*x1[i];
+  }
+  ierr = VecRestoreArrayRead(localX1,&x1);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(da,&localX1);CHKERRQ(ierr);
+
+  /* dF/dx + a * dF/d(xdot) in one sweep */
+  ierr = VecGetArray(Y,&z);CHKERRQ(ierr);
+  ierr = PetscLogEventBegin(mctx->event1,0,0,0,0);CHKERRQ(ierr);
+  fos_forward(mctx->tagc,mctx->m,2*n,0,mctx->xc,mctx->dxc,NULL,mctx->action);
+  ierr = MatFreeWriteOwned(mctx,mctx->action,INSERT_VALUES,0.,z);CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(mctx->event1,0,0,0,0);CHKERRQ(ierr);
+  ierr = VecRestoreArray(Y,&z);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
 /*
   Special case where mass matrix is identity
 */
@@ -100,12 +323,11 @@ PetscErrorCode JacobianVectorProductIDMass(Mat A_shell,Vec X,Vec Y)
 {
   MatCtx            *mctx;
   PetscErrorCode    ierr;
-  PetscInt          m,n,i,j,k = 0,d;
+  PetscInt          m,n;
   const PetscScalar *x0;
-  PetscScalar       *action,*x1;
+  PetscScalar       *action,*x1,*z;
   Vec               localX1;
   DM                da;
-  DMDALocalInfo     info;
 
   PetscFunctionBegin;
 
@@ -116,7 +338,6 @@ PetscErrorCode JacobianVectorProductIDMass(Mat A_shell,Vec X,Vec Y)
 
   /* Get local input vectors and extract data, x0 and x1*/
   ierr = TSGetDM(mctx->ts,&da);CHKERRQ(ierr);
-  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
   ierr = DMGetLocalVector(da,&localX1);CHKERRQ(ierr);
   ierr = DMGlobalToLocalBegin(da,X,INSERT_VALUES,localX1);CHKERRQ(ierr);
   ierr = DMGlobalToLocalEnd(da,X,INSERT_VALUES,localX1);CHKERRQ(ierr);
@@ -125,33 +346,22 @@ PetscErrorCode JacobianVectorProductIDMass(Mat A_shell,Vec X,Vec Y)
   ierr = VecGetArray(localX1,&x1);CHKERRQ(ierr);
 
   /* dF/dx part */
-  ierr = PetscMalloc1(m,&action);CHKERRQ(ierr);
+  action = mctx->action;
+  ierr = VecGetArray(Y,&z);CHKERRQ(ierr);
   ierr = PetscLogEventBegin(mctx->event1,0,0,0,0);CHKERRQ(ierr);
   fos_forward(mctx->tag1,m,n,0,x0,x1,NULL,action);
-  for (j=info.gys; j<info.gys+info.gym; j++) {
-    for (i=info.gxs; i<info.gxs+info.gxm; i++) {
-      for (d=0; d<2; d++) {
-        if ((i >= info.xs) && (i < info.xs+info.xm) && (j >= info.ys) && (j < info.ys+info.ym)) {
-          ierr = VecSetValuesLocal(Y,1,&k,&action[k],INSERT_VALUES);CHKERRQ(ierr);
-        }
-        k++;
-      }
-    }
-  }
+  ierr = MatFreeWriteOwned(mctx,action,INSERT_VALUES,0.,z);CHKERRQ(ierr);
   ierr = PetscLogEventEnd(mctx->event1,0,0,0,0);CHKERRQ(ierr);
-  k = 0;
-  ierr = VecAssemblyBegin(Y);CHKERRQ(ierr); /* Note: Need to assemble between separate calls */
-  ierr = VecAssemblyEnd(Y);CHKERRQ(ierr);   /*       to INSERT_VALUES and ADD_VALUES         */
-  ierr = PetscFree(action);CHKERRQ(ierr);
 
   /* Restore local vector */
+  ierr = VecRestoreArray(Y,&z);CHKERRQ(ierr);
   ierr = VecRestoreArray(localX1,&x1);CHKERRQ(ierr);
   ierr = VecRestoreArrayRead(mctx->localX0,&x0);CHKERRQ(ierr);
   ierr = DMRestoreLocalVector(da,&localX1);CHKERRQ(ierr);
 
   /* a * dF/d(xdot) part */
   ierr = PetscLogEventBegin(mctx->event2,0,0,0,0);CHKERRQ(ierr);
-  ierr = VecAXPY(Y,mctx->shift,X);
+  ierr = VecAXPY(Y,mctx->shift,X);CHKERRQ(ierr);
   ierr = PetscLogEventEnd(mctx->event2,0,0,0,0);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
@@ -172,12 +382,11 @@ PetscErrorCode JacobianTransposeVectorProduct(Mat A_shell,Vec Y,Vec X)
 {
   MatCtx            *mctx;
   PetscErrorCode    ierr;
-  PetscInt          m,n,i,j,k = 0,d;
+  PetscInt          m,n;
   const PetscScalar *x;
-  PetscScalar       *action,*y;
+  PetscScalar       *action,*y,*z;
   Vec               localY;
   DM                da;
-  DMDALocalInfo     info;
 
   PetscFunctionBegin;
 
@@ -188,7 +397,6 @@ PetscErrorCode JacobianTransposeVectorProduct(Mat A_shell,Vec Y,Vec X)
 
   /* Get local input vectors and extract data, x0 and x1*/
   ierr = TSGetDM(mctx->ts,&da);CHKERRQ(ierr);
-  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
   ierr = DMGetLocalVector(da,&localY);CHKERRQ(ierr);
   ierr = DMGlobalToLocalBegin(da,Y,INSERT_VALUES,localY);CHKERRQ(ierr);
   ierr = DMGlobalToLocalEnd(da,Y,INSERT_VALUES,localY);CHKERRQ(ierr);
@@ -196,50 +404,23 @@ PetscErrorCode JacobianTransposeVectorProduct(Mat A_shell,Vec Y,Vec X)
   ierr = VecGetArray(localY,&y);CHKERRQ(ierr);
 
   /* dF/dx part */
-  ierr = PetscMalloc1(n,&action);CHKERRQ(ierr);
+  action = mctx->action;
+  ierr = VecGetArray(X,&z);CHKERRQ(ierr);
   ierr = PetscLogEventBegin(mctx->event3,0,0,0,0);CHKERRQ(ierr);
-  if (!mctx->flg)
-    zos_forward(mctx->tag1,m,n,1,x,NULL);
+  ierr = MatFreeTaylorUpdate(mctx,0,x);CHKERRQ(ierr);
   fos_reverse(mctx->tag1,m,n,y,action);
-  for (j=info.gys; j<info.gys+info.gym; j++) {
-    for (i=info.gxs; i<info.gxs+info.gxm; i++) {
-      for (d=0; d<2; d++) {
-        if ((i >= info.xs) && (i < info.xs+info.xm) && (j >= info.ys) && (j < info.ys+info.ym)) {
-          ierr = VecSetValuesLocal(X,1,&k,&action[k],INSERT_VALUES);CHKERRQ(ierr);
-        }
-        k++;
-      }
-    }
-  }
+  ierr = MatFreeWriteOwned(mctx,action,INSERT_VALUES,0.,z);CHKERRQ(ierr);
   ierr = PetscLogEventEnd(mctx->event3,0,0,0,0);CHKERRQ(ierr);
-  k = 0;
-  ierr = VecAssemblyBegin(X);CHKERRQ(ierr); /* Note: Need to assemble between separate calls */
-  ierr = VecAssemblyEnd(X);CHKERRQ(ierr);   /*       to INSERT_VALUES and ADD_VALUES         */
 
   /* a * dF/d(xdot) part */
   ierr = PetscLogEventBegin(mctx->event4,0,0,0,0);CHKERRQ(ierr);
-  if (!mctx->flg) {
-    zos_forward(mctx->tag2,m,n,1,x,NULL);
-    mctx->flg = PETSC_TRUE;
-  }
+  ierr = MatFreeTaylorUpdate(mctx,1,x);CHKERRQ(ierr);
   fos_reverse(mctx->tag2,m,n,y,action);
-  for (j=info.gys; j<info.gys+info.gym; j++) {
-    for (i=info.gxs; i<info.gxs+info.gxm; i++) {
-      for (d=0; d<2; d++) {
-        if ((i >= info.xs) && (i < info.xs+info.xm) && (j >= info.ys) && (j < info.ys+info.ym)) {
-          action[k] *= mctx->shift;
-          ierr = VecSetValuesLocal(X,1,&k,&action[k],ADD_VALUES);CHKERRQ(ierr);
-        }
-        k++;
-      }
-    }
-  }
+  ierr = MatFreeWriteOwned(mctx,action,ADD_VALUES,mctx->shift,z);CHKERRQ(ierr);
   ierr = PetscLogEventEnd(mctx->event4,0,0,0,0);CHKERRQ(ierr);
-  ierr = VecAssemblyBegin(X);CHKERRQ(ierr);
-  ierr = VecAssemblyEnd(X);CHKERRQ(ierr);
-  ierr = PetscFree(action);CHKERRQ(ierr);
 
   /* Restore local vector */
+  ierr = VecRestoreArray(X,&z);CHKERRQ(ierr);
   ierr = VecRestoreArray(localY,&y);CHKERRQ(ierr);
   ierr = VecRestoreArrayRead(mctx->localX0,&x);CHKERRQ(ierr);
   ierr = DMRestoreLocalVector(da,&localY);CHKERRQ(ierr);
@@ -253,12 +434,11 @@ PetscErrorCode JacobianTransposeVectorProductIDMass(Mat A_shell,Vec Y,Vec X)
 {
   MatCtx            *mctx;
   PetscErrorCode    ierr;
-  PetscInt          m,n,i,j,k = 0,d;
+  PetscInt          m,n;
   const PetscScalar *x;
-  PetscScalar       *action,*y;
+  PetscScalar       *action,*y,*z;
   Vec               localY;
   DM                da;
-  DMDALocalInfo     info;
 
   PetscFunctionBegin;
 
@@ -269,7 +449,6 @@ PetscErrorCode JacobianTransposeVectorProductIDMass(Mat A_shell,Vec Y,Vec X)
 
   /* Get local input vectors and extract data, x0 and x1*/
   ierr = TSGetDM(mctx->ts,&da);CHKERRQ(ierr);
-  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
   ierr = DMGetLocalVector(da,&localY);CHKERRQ(ierr);
   ierr = DMGlobalToLocalBegin(da,Y,INSERT_VALUES,localY);CHKERRQ(ierr);
   ierr = DMGlobalToLocalEnd(da,Y,INSERT_VALUES,localY);CHKERRQ(ierr);
@@ -277,28 +456,16 @@ PetscErrorCode JacobianTransposeVectorProductIDMass(Mat A_shell,Vec Y,Vec X)
   ierr = VecGetArray(localY,&y);CHKERRQ(ierr);
 
   /* dF/dx part */
-  ierr = PetscMalloc1(n,&action);CHKERRQ(ierr);
+  action = mctx->action;
+  ierr = VecGetArray(X,&z);CHKERRQ(ierr);
   ierr = PetscLogEventBegin(mctx->event3,0,0,0,0);CHKERRQ(ierr);
-  if (!mctx->flg)
-    zos_forward(mctx->tag1,m,n,1,x,NULL);
+  ierr = MatFreeTaylorUpdate(mctx,0,x);CHKERRQ(ierr);
   fos_reverse(mctx->tag1,m,n,y,action);
-  for (j=info.gys; j<info.gys+info.gym; j++) {
-    for (i=info.gxs; i<info.gxs+info.gxm; i++) {
-      for (d=0; d<2; d++) {
-        if ((i >= info.xs) && (i < info.xs+info.xm) && (j >= info.ys) && (j < info.ys+info.ym)) {
-          ierr = VecSetValuesLocal(X,1,&k,&action[k],INSERT_VALUES);CHKERRQ(ierr);
-        }
-        k++;
-      }
-    }
-  }
+  ierr = MatFreeWriteOwned(mctx,action,INSERT_VALUES,0.,z);CHKERRQ(ierr);
   ierr = PetscLogEventEnd(mctx->event3,0,0,0,0);CHKERRQ(ierr);
-  k = 0;
-  ierr = VecAssemblyBegin(X);CHKERRQ(ierr); /* Note: Need to assemble between separate calls */
-  ierr = VecAssemblyEnd(X);CHKERRQ(ierr);   /*       to INSERT_VALUES and ADD_VALUES         */
-  ierr = PetscFree(action);CHKERRQ(ierr);
 
   /* Restore local vector */
+  ierr = VecRestoreArray(X,&z);CHKERRQ(ierr);
   ierr = VecRestoreArray(localY,&y);CHKERRQ(ierr);
   ierr = VecRestoreArrayRead(mctx->localX0,&x);CHKERRQ(ierr);
   ierr = DMRestoreLocalVector(da,&localY);CHKERRQ(ierr);
@@ -310,7 +477,327 @@ PetscErrorCode JacobianTransposeVectorProductIDMass(Mat A_shell,Vec Y,Vec X)
   PetscFunctionReturn(0);
 }
 
-// TODO: Modify the below to use matrix-free preconditioning
+#if PETSC_VERSION_GE(3,14,0)
+/*
+  Get a contiguous 2d array of dimension m x n for the block products, reusing the persistent one
+  held in the matrix-free context unless it is too small, so that alternating products with the
+  Jacobian and its transpose, or products with fewer columns, do not reallocate
+
+  Input parameters:
+  m,n - number of rows and columns required
+  cap - number of rows and entries currently allocated (updated on output)
+
+  Output parameter:
+  A   - 2d array, whose rows point into contiguous storage, owned by the matrix-free context
+*/
+static PetscErrorCode MatFreeGetBlock(PetscInt m,PetscInt n,PetscInt *cap,PetscScalar ***A)
+{
+  PetscErrorCode ierr;
+  PetscInt       i;
+
+  PetscFunctionBegin;
+  if ((!*A) || (m > cap[0]) || (m*n > cap[1])) {
+    if (*A) {
+      ierr = PetscFree((*A)[0]);CHKERRQ(ierr);
+      ierr = PetscFree(*A);CHKERRQ(ierr);
+    }
+    cap[0] = PetscMax(m,cap[0]);
+    cap[1] = PetscMax(m*n,cap[1]);
+    ierr = PetscMalloc1(PetscMax(cap[0],1),A);CHKERRQ(ierr);
+    ierr = PetscMalloc1(PetscMax(cap[1],1),&(*A)[0]);CHKERRQ(ierr);
+  }
+  for (i=1; i<m; i++) (*A)[i] = (*A)[0] + i*n;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Apply the implicit Jacobian (or its transpose) to each column of a dense matrix, propagating all
+  k columns through each tape in a single vector mode sweep (fov_forward or fov_reverse), rather
+  than k first order sweeps. Used to implement the MatMatMult and MatTransposeMatMult products of
+  the MatShell.
+  Requires PETSc 3.14 or later, for MatShellSetMatProductOperation and MatDenseGetColumnVecRead.
+  The seed and result blocks are kept in the matrix-free context and freed by MatFreeDestroy.
+
+  Input parameters:
+  A_shell - Jacobian matrix of MatShell type
+  V       - dense matrix, whose columns are to be multiplied
+  trans   - multiply by the transpose of A_shell?
+  idmass  - is the mass matrix the identity?
+
+  Output parameter:
+  W       - dense matrix of products
+*/
+PetscErrorCode MatFreeApplyBlock(Mat A_shell,Mat V,Mat W,PetscBool trans,PetscBool idmass)
+{
+  MatCtx            *mctx;
+  PetscErrorCode    ierr;
+  PetscInt          m,n,k,c,i,r,l,t,lda,len,nin,tags[2];
+  const PetscScalar *x0,*vl;
+  PetscScalar       *w,**S,**T,val;
+  Vec               v,localV;
+  DM                da;
+
+  PetscFunctionBegin;
+
+  /* Get matrix-free context info */
+  ierr = MatShellGetContext(A_shell,(void**)&mctx);CHKERRQ(ierr);
+  ierr = TSGetDM(mctx->ts,&da);CHKERRQ(ierr);
+  ierr = MatGetSize(V,NULL,&k);CHKERRQ(ierr);
+  m = mctx->m;
+  n = mctx->n;
+  nin = trans ? m : n;
+  len = mctx->runlen;
+  tags[0] = mctx->tag1;
+  tags[1] = mctx->tag2;
+
+  /* Scatter each column to local (ghosted) ordering and gather into the seed matrix */
+  if (!trans) {
+    ierr = MatFreeGetBlock(n,k,mctx->Scap,&mctx->S);CHKERRQ(ierr);
+    ierr = MatFreeGetBlock(m,k,mctx->Tcap,&mctx->T);CHKERRQ(ierr);
+  } else {
+    ierr = MatFreeGetBlock(k,m,mctx->Scap,&mctx->S);CHKERRQ(ierr);
+    ierr = MatFreeGetBlock(k,n,mctx->Tcap,&mctx->T);CHKERRQ(ierr);
+  }
+  S = mctx->S;
+  T = mctx->T;
+  ierr = DMGetLocalVector(da,&localV);CHKERRQ(ierr);
+  for (c=0; c<k; c++) {
+    ierr = MatDenseGetColumnVecRead(V,c,&v);CHKERRQ(ierr);
+    ierr = DMGlobalToLocalBegin(da,v,INSERT_VALUES,localV);CHKERRQ(ierr);
+    ierr = DMGlobalToLocalEnd(da,v,INSERT_VALUES,localV);CHKERRQ(ierr);
+    ierr = MatDenseRestoreColumnVecRead(V,c,&v);CHKERRQ(ierr);
+    ierr = VecGetArrayRead(localV,&vl);CHKERRQ(ierr);
+    for (i=0; i<nin; i++) {
+      if (!trans) S[i][c] = vl[i];
+      else S[c][i] = vl[i];
+    }
+    ierr = VecRestoreArrayRead(localV,&vl);CHKERRQ(ierr);
+  }
+  ierr = DMRestoreLocalVector(da,&localV);CHKERRQ(ierr);
+
+  /* dF/dx part, then a * dF/d(xdot) part, writing the owned rows of each column */
+  ierr = VecGetArrayRead(mctx->localX0,&x0);CHKERRQ(ierr);
+  ierr = MatDenseGetLDA(W,&lda);CHKERRQ(ierr);
+  ierr = MatDenseGetArrayWrite(W,&w);CHKERRQ(ierr);
+  for (t=0; t<(idmass ? 1 : 2); t++) {
+    ierr = PetscLogEventBegin(trans ? (t ? mctx->event4 : mctx->event3) : (t ? mctx->event2 : mctx->event1),0,0,0,0);CHKERRQ(ierr);
+    if (!trans) {
+      fov_forward(tags[t],m,n,k,x0,S,mctx->action,T);
+    } else {
+      ierr = MatFreeTaylorUpdate(mctx,t,x0);CHKERRQ(ierr);
+      fov_reverse(tags[t],m,n,k,S,T);
+    }
+    for (c=0; c<k; c++) {
+      for (r=0; r<mctx->nruns; r++) {
+        for (l=0; l<len; l++) {
+          val = trans ? T[c][mctx->runs[r]+l] : T[mctx->runs[r]+l][c];
+          if (!t) w[c*lda+r*len+l] = val;
+          else w[c*lda+r*len+l] += mctx->shift*val;
+        }
+      }
+    }
+    ierr = PetscLogEventEnd(trans ? (t ? mctx->event4 : mctx->event3) : (t ? mctx->event2 : mctx->event1),0,0,0,0);CHKERRQ(ierr);
+  }
+  ierr = MatDenseRestoreArrayWrite(W,&w);CHKERRQ(ierr);
+  ierr = VecRestoreArrayRead(mctx->localX0,&x0);CHKERRQ(ierr);
+
+  /* Identity mass matrix part */
+  if (idmass) {
+    ierr = MatAXPY(W,mctx->shift,V,SAME_NONZERO_PATTERN);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Multi-vector analogues of JacobianVectorProduct and JacobianTransposeVectorProduct (and their
+  identity mass variants), to be set on the MatShell using MatShellSetMatProductOperation with
+  the MATPRODUCT_AB and MATPRODUCT_AtB product types, respectively.
+
+  Input parameters:
+  A_shell - Jacobian matrix of MatShell type
+  V       - dense matrix to be multiplied by A_shell (or its transpose)
+  data    - unused
+
+  Output parameter:
+  W       - dense matrix of products
+*/
+PetscErrorCode JacobianMatMult(Mat A_shell,Mat V,Mat W,void *data)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = MatFreeApplyBlock(A_shell,V,W,PETSC_FALSE,PETSC_FALSE);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+PetscErrorCode JacobianMatMultIDMass(Mat A_shell,Mat V,Mat W,void *data)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = MatFreeApplyBlock(A_shell,V,W,PETSC_FALSE,PETSC_TRUE);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+PetscErrorCode JacobianTransposeMatMult(Mat A_shell,Mat V,Mat W,void *data)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = MatFreeApplyBlock(A_shell,V,W,PETSC_TRUE,PETSC_FALSE);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+PetscErrorCode JacobianTransposeMatMultIDMass(Mat A_shell,Mat V,Mat W,void *data)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = MatFreeApplyBlock(A_shell,V,W,PETSC_TRUE,PETSC_TRUE);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Check the block products of a matrix-free Jacobian against k separate MatMult (and
+  MatMultTranspose) calls, applied to the columns of a random dense matrix
+
+  Input parameters:
+  A_shell - Jacobian matrix of MatShell type, with its MatProduct operations set
+  k       - number of columns
+
+  Output parameter:
+  err     - largest relative difference between corresponding columns
+*/
+PetscErrorCode MatFreeCheckBlock(Mat A_shell,PetscInt k,PetscReal *err)
+{
+  PetscErrorCode ierr;
+  MPI_Comm       comm;
+  Mat            V,W;
+  Vec            v,w,y;
+  PetscRandom    rand;
+  PetscInt       c,t,mloc,M;
+  PetscReal      nrm,nrmy;
+
+  PetscFunctionBegin;
+  ierr = PetscObjectGetComm((PetscObject)A_shell,&comm);CHKERRQ(ierr);
+  ierr = MatGetLocalSize(A_shell,&mloc,NULL);CHKERRQ(ierr);
+  ierr = MatGetSize(A_shell,&M,NULL);CHKERRQ(ierr);
+  ierr = MatCreateDense(comm,mloc,PETSC_DECIDE,M,k,NULL,&V);CHKERRQ(ierr);
+  ierr = PetscRandomCreate(comm,&rand);CHKERRQ(ierr);
+  ierr = PetscRandomSetFromOptions(rand);CHKERRQ(ierr);
+  ierr = MatSetRandom(V,rand);CHKERRQ(ierr);
+  ierr = PetscRandomDestroy(&rand);CHKERRQ(ierr);
+  ierr = MatCreateVecs(A_shell,&y,NULL);CHKERRQ(ierr);
+  *err = 0.;
+  for (t=0; t<2; t++) {
+    if (!t) {
+      ierr = MatMatMult(A_shell,V,MAT_INITIAL_MATRIX,PETSC_DEFAULT,&W);CHKERRQ(ierr);
+    } else {
+      ierr = MatTransposeMatMult(A_shell,V,MAT_INITIAL_MATRIX,PETSC_DEFAULT,&W);CHKERRQ(ierr);
+    }
+    for (c=0; c<k; c++) {
+      ierr = MatDenseGetColumnVecRead(V,c,&v);CHKERRQ(ierr);
+      if (!t) {
+        ierr = MatMult(A_shell,v,y);CHKERRQ(ierr);
+      } else {
+        ierr = MatMultTranspose(A_shell,v,y);CHKERRQ(ierr);
+      }
+      ierr = MatDenseRestoreColumnVecRead(V,c,&v);CHKERRQ(ierr);
+      ierr = VecNorm(y,NORM_2,&nrmy);CHKERRQ(ierr);
+      ierr = MatDenseGetColumnVecRead(W,c,&w);CHKERRQ(ierr);
+      ierr = VecAXPY(y,-1.,w);CHKERRQ(ierr);
+      ierr = MatDenseRestoreColumnVecRead(W,c,&w);CHKERRQ(ierr);
+      ierr = VecNorm(y,NORM_2,&nrm);CHKERRQ(ierr);
+      *err = PetscMax(*err,nrm/PetscMax(nrmy,PETSC_SMALL));
+    }
+    ierr = MatDestroy(&W);CHKERRQ(ierr);
+  }
+  ierr = VecDestroy(&y);CHKERRQ(ierr);
+  ierr = MatDestroy(&V);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+#endif
+
+/*
+  ADOL-C implementation for extracting the diagonal of an implicit Jacobian, using the
+  diagonal-only compression set up by AdolcDiagonalSetUp. Intended to overload MatGetDiagonal in
+  matrix-free methods where implicit timestepping has been used, so that Jacobi preconditioning
+  is available without assembling the Jacobian.
+
+  Input parameters:
+  A_shell - Jacobian matrix of MatShell type
+
+  Output parameters:
+  diag    - diagonal of A_shell
+*/
+PetscErrorCode JacobianDiagonal(Mat A_shell,Vec diag)
+{
+  MatCtx            *mctx;
+  PetscErrorCode    ierr;
+  const PetscScalar *x0;
+  PetscScalar       *d;
+  Vec               localDiag;
+  DM                da;
+
+  PetscFunctionBegin;
+
+  /* Get matrix-free context info */
+  ierr = MatShellGetContext(A_shell,(void**)&mctx);CHKERRQ(ierr);
+  ierr = TSGetDM(mctx->ts,&da);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(da,&localDiag);CHKERRQ(ierr);
+  ierr = VecGetArrayRead(mctx->localX0,&x0);CHKERRQ(ierr);
+  ierr = VecGetArray(localDiag,&d);CHKERRQ(ierr);
+
+  /* Propagate diagonal seed through both tapes and recover diagonal of dF/dx + a * dF/d(xdot) */
+  ierr = AdolcComputeIJacobianDiagonal(mctx->tag1,mctx->tag2,d,(PetscScalar*)x0,mctx->shift,mctx->adctx);CHKERRQ(ierr);
+
+  /* Restore local vector, keeping only the owned entries */
+  ierr = VecRestoreArray(localDiag,&d);CHKERRQ(ierr);
+  ierr = VecRestoreArrayRead(mctx->localX0,&x0);CHKERRQ(ierr);
+  ierr = DMLocalToGlobalBegin(da,localDiag,INSERT_VALUES,diag);CHKERRQ(ierr);
+  ierr = DMLocalToGlobalEnd(da,localDiag,INSERT_VALUES,diag);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(da,&localDiag);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Special case where mass matrix is identity
+*/
+PetscErrorCode JacobianDiagonalIDMass(Mat A_shell,Vec diag)
+{
+  MatCtx            *mctx;
+  PetscErrorCode    ierr;
+  const PetscScalar *x0;
+  PetscScalar       *d;
+  Vec               localDiag;
+  DM                da;
+
+  PetscFunctionBegin;
+
+  /* Get matrix-free context info */
+  ierr = MatShellGetContext(A_shell,(void**)&mctx);CHKERRQ(ierr);
+  ierr = TSGetDM(mctx->ts,&da);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(da,&localDiag);CHKERRQ(ierr);
+  ierr = VecGetArrayRead(mctx->localX0,&x0);CHKERRQ(ierr);
+  ierr = VecGetArray(localDiag,&d);CHKERRQ(ierr);
+
+  /* Propagate diagonal seed through dF/dx tape and add shift to recovered diagonal */
+  ierr = AdolcComputeIJacobianDiagonal(mctx->tag1,-1,d,(PetscScalar*)x0,mctx->shift,mctx->adctx);CHKERRQ(ierr);
+
+  /* Restore local vector, keeping only the owned entries */
+  ierr = VecRestoreArray(localDiag,&d);CHKERRQ(ierr);
+  ierr = VecRestoreArrayRead(mctx->localX0,&x0);CHKERRQ(ierr);
+  ierr = DMLocalToGlobalBegin(da,localDiag,INSERT_VALUES,diag);CHKERRQ(ierr);
+  ierr = DMLocalToGlobalEnd(da,localDiag,INSERT_VALUES,diag);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(da,&localDiag);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Shell preconditioner applying the inverse of the Jacobian diagonal. When the preconditioning
+  matrix is a MatShell with MATOP_GET_DIAGONAL set (see JacobianDiagonal), the diagonal is
+  refreshed at each setup without ever assembling the Jacobian.
+*/
 
 typedef struct {
   Vec diag;
@@ -332,14 +819,14 @@ PetscErrorCode MatFreeJacobiPCSetUp(PC pc,Mat pmat,Vec x)
 {
   PetscErrorCode  ierr;
   MatFreeJacobiPC *shell;
-  Vec             diag;
 
   PetscFunctionBegin;
   ierr = PCShellGetContext(pc,(void**)&shell);CHKERRQ(ierr);
-  ierr = VecDuplicate(x,&diag);CHKERRQ(ierr);
-  ierr = MatGetDiagonal(pmat,diag);CHKERRQ(ierr);
-  ierr = VecReciprocal(diag);CHKERRQ(ierr);
-  shell->diag = diag;
+  if (!shell->diag) {
+    ierr = VecDuplicate(x,&shell->diag);CHKERRQ(ierr);
+  }
+  ierr = MatGetDiagonal(pmat,shell->diag);CHKERRQ(ierr);
+  ierr = VecReciprocal(shell->diag);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
 
@@ -365,3 +852,4 @@ PetscErrorCode MatFreeJacobiPCDestroy(PC pc)
   ierr = PetscFree(shell);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
+#endif
@@ -1,4 +1,8 @@
 #include <petscdm.h>
+#include "contexts.cxx"
+#if defined(PETSC_HAVE_COLPACK)
+#include <ColPack/ColPackHeaders.h>
+#endif
 
 
 // TODO: Most of the arguments here can be stored in AdolcCtx
@@ -67,7 +71,8 @@ PetscErrorCode PrintSparsity(MPI_Comm comm,PetscInt m,unsigned int **sparsity)
   Notes:
   Implementation works fine for DM_BOUNDARY_NONE or DM_BOUNDARY_GHOSTED. If DM_BOUNDARY_PERIODIC is
   used then implementation only currently works in parallel, where processors should not own two
-  opposite boundaries which have been identified by the periodicity.
+  opposite boundaries which have been identified by the periodicity. GetStencilColoring does not
+  have this restriction.
 */
 PetscErrorCode GetColoring(DM da,ISColoring *iscoloring)
 {
@@ -79,6 +84,55 @@ PetscErrorCode GetColoring(DM da,ISColoring *iscoloring)
   PetscFunctionReturn(0);
 }
 
+/*
+  Colour the local (ghosted) patch of a DMDA directly from the stencil, for use with tapes of local
+  functions. Points are coloured by their unwrapped local coordinates, so that ghost images across
+  a periodic boundary are treated as independents in their own right, rather than sharing the
+  colour of the point they are identified with. This is valid for any number of ranks (including
+  one rank owning both of two opposite boundaries) and places no divisibility requirements on the
+  grid size. The number of colours is the minimum the stencil requires:
+
+    box stencil          (2s+1)^dim colours per component
+    star stencil, s = 1  2*dim+1 colours per component, via (i+2j+3k) mod (2*dim+1)
+
+  Star stencils of greater width are coloured as box stencils.
+
+  Input parameter:
+  da      - distributed array
+
+  Output parameters:
+  colours - array with length equal to the size of a local vector, holding the colour of each
+            local (ghosted) entry
+  p       - the number of colours used
+*/
+PetscErrorCode GetStencilColoring(DM da,PetscInt *colours,PetscInt *p)
+{
+  PetscErrorCode ierr;
+  DMDALocalInfo  info;
+  PetscInt       i,j,k,c,w,wy,wz,ncol,colour,row;
+
+  PetscFunctionBegin;
+  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+  w  = 2*info.sw+1;
+  wy = (info.dim > 1) ? w : 1;
+  wz = (info.dim > 2) ? w : 1;
+  if ((info.st == DMDA_STENCIL_STAR) && (info.sw == 1) && (info.dim > 1)) ncol = 2*info.dim+1;
+  else ncol = w*wy*wz;
+  for (k=info.gzs; k<info.gzs+info.gzm; k++) {
+    for (j=info.gys; j<info.gys+info.gym; j++) {
+      for (i=info.gxs; i<info.gxs+info.gxm; i++) {
+        if (ncol == 2*info.dim+1) colour = ((i+2*j+3*k)%ncol + ncol)%ncol;
+        else colour = ((i%w + w)%w) + w*((j%wy + wy)%wy) + w*wy*((k%wz + wz)%wz);
+        row = (((k-info.gzs)*info.gym + j-info.gys)*info.gxm + i-info.gxs)*info.dof;
+        for (c=0; c<info.dof; c++)
+          colours[row+c] = colour*info.dof + c;
+      }
+    }
+  }
+  *p = ncol*info.dof;
+  PetscFunctionReturn(0);
+}
+
 /*
   Simple function to count the number of colors used in an index set coloring
 
@@ -99,37 +153,176 @@ PetscErrorCode CountColors(ISColoring iscoloring,PetscInt *p)
   PetscFunctionReturn(0);
 }
 
-// FIXME: Generate sparsity pattern using PETSc alone
+/*
+  Convert an index set coloring into a colour vector, which is a far more compact representation
+  of the corresponding seed matrix
+
+  Input parameter:
+  iscoloring - the index set coloring to be used
+
+  Output parameter:
+  colours    - array with length equal to the number of columns coloured, holding the colour of
+               each column
+*/
+PetscErrorCode GetColors(ISColoring iscoloring,PetscInt *colours)
+{
+  PetscErrorCode ierr;
+  IS             *is;
+  PetscInt       p,size,colour,j;
+  const PetscInt *indices;
+
+  PetscFunctionBegin;
+  ierr = ISColoringGetIS(iscoloring,&p,&is);CHKERRQ(ierr);
+  for (colour=0; colour<p; colour++) {
+    ierr = ISGetLocalSize(is[colour],&size);CHKERRQ(ierr);
+    ierr = ISGetIndices(is[colour],&indices);CHKERRQ(ierr);
+    for (j=0; j<size; j++)
+      colours[indices[j]] = colour;
+    ierr = ISRestoreIndices(is[colour],&indices);CHKERRQ(ierr);
+  }
+  ierr = ISColoringRestoreIS(iscoloring,&is);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Generate the sparsity pattern of a Jacobian on a DMDA from its stencil alone, so that no sweep
+  over the tape is required. As in the preallocation of DMCreateMatrix, each component at each
+  owned point is coupled to every component at every point within the stencil width. Rows are
+  numbered locally, including ghost points, as is the case for the tapes of local functions.
+  Rows corresponding to ghost points are left empty.
+
+  Input parameter:
+  da       - distributed array
+
+  Output parameter:
+  sparsity - sparsity pattern in the format used by jac_pat, which should be allocated with length
+             equal to the size of a local vector on input. Its rows are allocated using malloc, so
+             should be freed using free.
+
+  Note: The resulting pattern is a superset of that of the traced function, so any colouring of it
+        is also valid for the tape. See CheckSparsity for a consistency check.
+*/
 PetscErrorCode DMGetSparsity(DM da,unsigned int **sparsity)
 {
   PetscErrorCode ierr;
-  PetscInt       i,j,nnz;
-  //PetscInt       nrows,ncols;
-  PetscInt       rowstart,rowend;
-  const PetscInt *cols;
-  Mat            A;
+  DMDALocalInfo  info;
+  PetscInt       i,j,k,c,ii,jj,kk,cc,row,sx,sy,sz,nc,maxrow,*buffer;
+  unsigned int   *cols;
 
   PetscFunctionBegin;
-  ierr = DMCreateMatrix(da,&A);CHKERRQ(ierr);
-  //ierr = MatGetSize(A,&nrows,&ncols);CHKERRQ(ierr);
-  //for (i=0; i<nrows; i++) {
-  ierr = MatGetOwnershipRange(A,&rowstart,&rowend);CHKERRQ(ierr);
-  for (i=rowstart; i<rowend; i++) {
-    ierr = MatGetRow(A,i,&nnz,&cols,NULL);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+  sx = info.sw;
+  sy = (info.dim > 1) ? info.sw : 0;
+  sz = (info.dim > 2) ? info.sw : 0;
+  maxrow = info.dof*(2*sx+1)*(2*sy+1)*(2*sz+1);
+  ierr = PetscMalloc1(maxrow,&buffer);CHKERRQ(ierr);
 
-    ierr = PetscPrintf(MPI_COMM_WORLD,"%d: ",i);CHKERRQ(ierr);
-    for (j=0; j<nnz; j++) {
-      ierr = PetscPrintf(MPI_COMM_WORLD,"%d, ",cols[j]);CHKERRQ(ierr);
-    }
-    ierr = PetscPrintf(MPI_COMM_WORLD,"\n");CHKERRQ(ierr);
+  /* Ghost rows are empty */
+  for (row=0; row<info.gxm*info.gym*info.gzm*info.dof; row++) {
+    sparsity[row]    = (unsigned int *) malloc(sizeof(unsigned int));
+    sparsity[row][0] = 0;
+  }
 
-    ierr = MatRestoreRow(A,i,&nnz,&cols,NULL);CHKERRQ(ierr);
+  /* Couple each owned point to the points of its stencil which lie within the local patch */
+  for (k=info.zs; k<info.zs+info.zm; k++) {
+    for (j=info.ys; j<info.ys+info.ym; j++) {
+      for (i=info.xs; i<info.xs+info.xm; i++) {
+        nc = 0;
+        for (kk=k-sz; kk<=k+sz; kk++) {
+          if ((kk < info.gzs) || (kk >= info.gzs+info.gzm)) continue;
+          for (jj=j-sy; jj<=j+sy; jj++) {
+            if ((jj < info.gys) || (jj >= info.gys+info.gym)) continue;
+            for (ii=i-sx; ii<=i+sx; ii++) {
+              if ((ii < info.gxs) || (ii >= info.gxs+info.gxm)) continue;
+              if ((info.st == DMDA_STENCIL_STAR) && ((ii != i)+(jj != j)+(kk != k) > 1)) continue;
+              for (cc=0; cc<info.dof; cc++)
+                buffer[nc++] = (((kk-info.gzs)*info.gym + jj-info.gys)*info.gxm + ii-info.gxs)*info.dof + cc;
+            }
+          }
+        }
+        for (c=0; c<info.dof; c++) {
+          row = (((k-info.gzs)*info.gym + j-info.gys)*info.gxm + i-info.gxs)*info.dof + c;
+          cols = (unsigned int *) realloc(sparsity[row],(nc+1)*sizeof(unsigned int));
+          cols[0] = nc;
+          for (cc=0; cc<nc; cc++) cols[cc+1] = buffer[cc];
+          sparsity[row] = cols;
+        }
+      }
+    }
   }
-  ierr = MatDestroy(&A);CHKERRQ(ierr);
+  ierr = PetscFree(buffer);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Get the local (ghosted) row index of each component at each owned point of a DMDA, in the order
+  in which they are marked as dependents by tracing routines which only mark owned points (i.e. in
+  natural ordering over the owned patch, with components interlaced).
+
+  Input parameter:
+  da   - distributed array
+
+  Output parameters:
+  rows - array holding the local row index of each dependent, to be freed using PetscFree
+  m    - number of dependents, i.e. the number of owned points multiplied by the number of
+         degrees of freedom
+*/
+PetscErrorCode DMGetOwnedRows(DM da,PetscInt **rows,PetscInt *m)
+{
+  PetscErrorCode ierr;
+  DMDALocalInfo  info;
+  PetscInt       i,j,k,c,l = 0;
 
+  PetscFunctionBegin;
+  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+  *m = info.xm*info.ym*info.zm*info.dof;
+  ierr = PetscMalloc1(PetscMax(*m,1),rows);CHKERRQ(ierr);
+  for (k=info.zs; k<info.zs+info.zm; k++) {
+    for (j=info.ys; j<info.ys+info.ym; j++) {
+      for (i=info.xs; i<info.xs+info.xm; i++) {
+        for (c=0; c<info.dof; c++)
+          (*rows)[l++] = (((k-info.gzs)*info.gym + j-info.gys)*info.gxm + i-info.gxs)*info.dof + c;
+      }
+    }
+  }
   PetscFunctionReturn(0);
 }
 
+/*
+  Check that one sparsity pattern is contained within another, e.g. that the pattern of a traced
+  function is contained within the pattern generated from the stencil of a DMDA, so that
+  colourings and recovery plans generated from the latter are valid.
+
+  Input parameters:
+  m           - number of rows
+  n           - number of columns
+  sparsity    - sparsity pattern which should contain subsparsity
+  subsparsity - sparsity pattern to be checked
+
+  Output parameter:
+  row         - the first row of subsparsity with an entry outside sparsity, or -1 if none
+*/
+PetscErrorCode CheckSparsity(PetscInt m,PetscInt n,unsigned int **sparsity,unsigned int **subsparsity,PetscInt *row)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,k,*stamp;
+
+  PetscFunctionBegin;
+  ierr = PetscMalloc1(PetscMax(n,1),&stamp);CHKERRQ(ierr);
+  for (k=0; k<n; k++) stamp[k] = -1;
+  *row = -1;
+  for (i=0; (i<m) && (*row < 0); i++) {
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++) stamp[sparsity[i][k]] = i;
+    for (k=1; k<=(PetscInt) subsparsity[i][0]; k++) {
+      if (stamp[subsparsity[i][k]] != i) {
+        *row = i;
+        break;
+      }
+    }
+  }
+  ierr = PetscFree(stamp);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
 
 /*
   Generate a seed matrix defining the partition of columns of a matrix by a particular coloring,
@@ -178,7 +371,7 @@ PetscErrorCode GenerateSeedMatrix(ISColoring iscoloring,PetscScalar **S)
   Output parameter:
   R        - the recovery vector to be used for de-compression
 */
-PetscErrorCode GenerateSeedMatrixPlusRecovery(ISColoring iscoloring,PetscScalar **S,PetscScalar *R)
+PetscErrorCode GenerateSeedMatrixPlusRecovery(ISColoring iscoloring,PetscScalar **S,PetscInt *R)
 {
   PetscErrorCode ierr;
   IS             *is;
@@ -201,115 +394,1582 @@ PetscErrorCode GenerateSeedMatrixPlusRecovery(ISColoring iscoloring,PetscScalar
 }
 
 /*
-  Establish a look-up matrix whose entries contain the column coordinates of the corresponding entry
-  in a matrix which has been compressed using the coloring defined by some seed matrix
+  Transpose a sparsity pattern, as computed by jac_pat, into compressed sparse column format
 
   Input parameters:
-  S        - the seed matrix defining the coloring
-  sparsity - the sparsity pattern of the matrix to be recovered, typically computed using an ADOL-C
-             function, such as jac_pat or hess_pat
-  m        - the number of rows of Seed (and the matrix to be recovered)
-  p        - the number of colors used (also the number of columns in Seed)
+  sparsity - the sparsity pattern
+  m        - the number of rows
+  n        - the number of columns
 
-  Output parameter:
-  R        - the recovery matrix to be used for de-compression
+  Output parameters:
+  colptr   - array of length n+1, holding the start of each column in rows
+  rows     - rows of the nonzeros, by column
+
+  Note: colptr and rows should be freed using PetscFree.
 */
-PetscErrorCode GetRecoveryMatrix(PetscScalar **S,unsigned int **sparsity,PetscInt m,PetscInt p,PetscScalar **R)
+static PetscErrorCode SparsityTranspose(unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt **colptr,PetscInt **rows)
 {
-  PetscInt i,j,k,colour;
+  PetscErrorCode ierr;
+  PetscInt       i,j,k,*ptr,*fill;
 
   PetscFunctionBegin;
+  ierr = PetscCalloc1(n+1,&ptr);CHKERRQ(ierr);
+  ierr = PetscCalloc1(PetscMax(n,1),&fill);CHKERRQ(ierr);
   for (i=0; i<m; i++) {
-    for (colour=0; colour<p; colour++) {
-      R[i][colour] = -1.;
-      for (k=1; k<=(PetscInt) sparsity[i][0]; k++) {
-        j = (PetscInt) sparsity[i][k];
-        if (S[j][colour] == 1.) {
-          R[i][colour] = j;
-          break;
-        }
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++)
+      ptr[sparsity[i][k]+1]++;
+  }
+  for (j=0; j<n; j++) ptr[j+1] += ptr[j];
+  ierr = PetscMalloc1(PetscMax(ptr[n],1),rows);CHKERRQ(ierr);
+  for (i=0; i<m; i++) {
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++) {
+      j = sparsity[i][k];
+      (*rows)[ptr[j]+fill[j]++] = i;
+    }
+  }
+  ierr = PetscFree(fill);CHKERRQ(ierr);
+  *colptr = ptr;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute a greedy distance-2 column colouring of a sparsity pattern, so that columns which share
+  a row are assigned different colours. Columns are coloured in natural order. This is useful
+  where no DM is available to provide a colouring.
+
+  Input parameters:
+  sparsity - the sparsity pattern, typically computed using jac_pat
+  m        - the number of rows
+  n        - the number of columns
+
+  Output parameters:
+  colours  - array of length n, holding the colour of each column
+  p        - the number of colours used
+*/
+PetscErrorCode GreedyColoring(unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *colours,PetscInt *p)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,j,k,l,colour,*colptr,*rows,*forbidden;
+
+  PetscFunctionBegin;
+  ierr = SparsityTranspose(sparsity,m,n,&colptr,&rows);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(n,1),&forbidden);CHKERRQ(ierr);
+
+  /* Assign each column the smallest colour not used by a previous column sharing a row */
+  for (j=0; j<n; j++) forbidden[j] = -1;
+  *p = 0;
+  for (j=0; j<n; j++) {
+    for (k=colptr[j]; k<colptr[j+1]; k++) {
+      i = rows[k];
+      for (l=1; l<=(PetscInt) sparsity[i][0]; l++) {
+        if ((PetscInt) sparsity[i][l] < j) forbidden[colours[sparsity[i][l]]] = j;
       }
     }
+    for (colour=0; forbidden[colour] == j; colour++);
+    colours[j] = colour;
+    *p = PetscMax(*p,colour+1);
   }
+  ierr = PetscFree(rows);CHKERRQ(ierr);
+  ierr = PetscFree(colptr);CHKERRQ(ierr);
+  ierr = PetscFree(forbidden);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
 
 /*
-  Recover the values of a sparse matrix from a compressed format and insert these into a matrix
+  Compute a greedy distance-2 row colouring of a sparsity pattern, so that rows which share a
+  column are assigned different colours. Rows are coloured in natural order. Rows of the same
+  colour may then be propagated together in vector reverse mode, which is preferable to column
+  compression for Jacobians with fewer rows than columns, or with a few dense rows.
 
   Input parameters:
-  mode - use INSERT_VALUES or ADD_VALUES, as required
-  m    - number of rows of matrix.
-  p    - number of colors used in the compression of J (also the number of columns of R)
-  R    - recovery matrix to use in the decompression procedure
-  C    - compressed matrix to recover values from
-  a    - shift value for implicit problems (select NULL or unity for explicit problems)
+  sparsity - the sparsity pattern, typically computed using jac_pat
+  m        - the number of rows
+  n        - the number of columns
 
-  Output parameter:
-  A    - Mat to be populated with values from compressed matrix
+  Output parameters:
+  colours  - array of length m, holding the colour of each row
+  p        - the number of colours used
 */
-PetscErrorCode RecoverJacobian(Mat A,InsertMode mode,PetscInt m,PetscInt p,PetscScalar **R,PetscScalar **C,PetscReal *a)
+PetscErrorCode GreedyRowColoring(unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *colours,PetscInt *p)
 {
   PetscErrorCode ierr;
-  PetscInt       i,j,colour;
+  PetscInt       i,j,k,l,colour,*colptr,*rows,*forbidden;
 
   PetscFunctionBegin;
+  ierr = SparsityTranspose(sparsity,m,n,&colptr,&rows);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(m,1),&forbidden);CHKERRQ(ierr);
+
+  /* Assign each row the smallest colour not used by a previous row sharing a column */
+  for (i=0; i<m; i++) forbidden[i] = -1;
+  *p = 0;
   for (i=0; i<m; i++) {
-    for (colour=0; colour<p; colour++) {
-      j = (PetscInt) R[i][colour];
-      if (j != -1) {
-        if (a)
-          C[i][colour] *= *a;
-        ierr = MatSetValues(A,1,&i,1,&j,&C[i][colour],mode);CHKERRQ(ierr);
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++) {
+      j = sparsity[i][k];
+      for (l=colptr[j]; l<colptr[j+1]; l++) {
+        if (rows[l] < i) forbidden[colours[rows[l]]] = i;
       }
     }
+    for (colour=0; forbidden[colour] == i; colour++);
+    colours[i] = colour;
+    *p = PetscMax(*p,colour+1);
   }
+  ierr = PetscFree(rows);CHKERRQ(ierr);
+  ierr = PetscFree(colptr);CHKERRQ(ierr);
+  ierr = PetscFree(forbidden);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
 
-PetscErrorCode RecoverJacobianLocal(Mat A,InsertMode mode,PetscInt m,PetscInt p,PetscScalar **R,PetscScalar **C,PetscReal *a)
+/*
+  Compute a star bicolouring of a sparsity pattern using ColPack, i.e. a partial colouring of
+  both rows and columns such that every nonzero may be recovered directly, either from the
+  column-compressed matrix (vector forward mode) or from the row-compressed matrix (vector
+  reverse mode). A few dense rows or columns no longer force a large number of colours, since
+  they may be dealt with from the other side.
+
+  Input parameters:
+  sparsity   - the sparsity pattern, typically computed using jac_pat
+  m          - the number of rows
+  n          - the number of columns
+
+  Output parameters:
+  rowcolours - array of length m, holding the colour of each row, or -1 if uncoloured
+  pr         - the number of row colours used
+  colcolours - array of length n, holding the colour of each column, or -1 if uncoloured
+  pc         - the number of column colours used
+
+  Note: Requires PETSc to be configured with ColPack.
+*/
+PetscErrorCode GetStarBicoloring(unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *rowcolours,PetscInt *pr,PetscInt *colcolours,PetscInt *pc)
 {
-  PetscErrorCode ierr;
-  PetscInt       i,j,colour;
+#if defined(PETSC_HAVE_COLPACK)
+  ColPack::BipartiteGraphBicoloringInterface *g;
+  double                                     **left,**right;
+  int                                        lrows = 0,lcols = 0,rrows = 0,rcols = 0;
+  PetscInt                                   i,j,c;
 
   PetscFunctionBegin;
+  g = new ColPack::BipartiteGraphBicoloringInterface(SRC_MEM_ADOLC,sparsity,(int) m,(int) n);
+  g->Bicoloring("SMALLEST_LAST","IMPLICIT_COVERING__STAR_BICOLORING");
+
+  /* Read colours off the (lrows x m) left and (n x rcols) right seed matrices */
+  left  = g->GetLeftSeedMatrix(&lrows,&lcols);
+  right = g->GetRightSeedMatrix(&rrows,&rcols);
   for (i=0; i<m; i++) {
-    for (colour=0; colour<p; colour++) {
-      j = (PetscInt) R[i][colour];
-      if (j != -1) {
-        if (a)
-          C[i][colour] *= *a;
-        ierr = MatSetValuesLocal(A,1,&i,1,&j,&C[i][colour],mode);CHKERRQ(ierr);
+    rowcolours[i] = -1;
+    for (c=0; c<lrows; c++) {
+      if (left[c][i] != 0.) rowcolours[i] = c;
+    }
+  }
+  for (j=0; j<n; j++) {
+    colcolours[j] = -1;
+    for (c=0; c<rcols; c++) {
+      if (right[j][c] != 0.) colcolours[j] = c;
+    }
+  }
+  *pr = lrows;
+  *pc = rcols;
+  delete g;
+  PetscFunctionReturn(0);
+#else
+  PetscFunctionBegin;
+  SETERRQ(PETSC_COMM_SELF,PETSC_ERR_SUP,"Star bicolouring requires PETSc to be configured with ColPack");
+#endif
+}
+
+/*
+  Compute a distance-2 column colouring of a sparsity pattern using ColPack
+
+  Input parameters:
+  sparsity - the sparsity pattern, typically computed using jac_pat
+  m        - the number of rows
+  n        - the number of columns
+  ordering - vertex ordering to colour in, i.e. "NATURAL", "LARGEST_FIRST", "SMALLEST_LAST" or
+             "INCIDENCE_DEGREE"
+
+  Output parameters:
+  colours  - array of length n, holding the colour of each column
+  p        - the number of colours used
+*/
+PetscErrorCode ColPackColoring(unsigned int **sparsity,PetscInt m,PetscInt n,const char *ordering,PetscInt *colours,PetscInt *p)
+{
+#if defined(PETSC_HAVE_COLPACK)
+  ColPack::BipartiteGraphPartialColoringInterface *g;
+  std::vector<int>                                vertexcolours;
+  PetscInt                                        j,cmin = 0,cmax = -1;
+
+  PetscFunctionBegin;
+  g = new ColPack::BipartiteGraphPartialColoringInterface(SRC_MEM_ADOLC,sparsity,(int) m,(int) n);
+  g->PartialDistanceTwoColoring(ordering,"COLUMN_PARTIAL_DISTANCE_TWO");
+  g->GetRightVertexColors(vertexcolours);
+  if ((PetscInt) vertexcolours.size() != n) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_LIB,"ColPack did not colour every column");
+  for (j=0; j<n; j++) {
+    cmin = j ? PetscMin(cmin,vertexcolours[j]) : vertexcolours[j];
+    cmax = PetscMax(cmax,vertexcolours[j]);
+  }
+  for (j=0; j<n; j++) colours[j] = vertexcolours[j]-cmin;
+  *p = n ? cmax-cmin+1 : 0;
+  delete g;
+  PetscFunctionReturn(0);
+#else
+  PetscFunctionBegin;
+  SETERRQ(PETSC_COMM_SELF,PETSC_ERR_SUP,"ColPack colouring requires PETSc to be configured with ColPack");
+#endif
+}
+
+/*
+  Compute a star colouring of a symmetric sparsity pattern using ColPack, i.e. a distance-1
+  colouring of the adjacency graph in which every path on four vertices uses at least three
+  colours. Every nonzero (i,j) of a symmetric matrix compressed with this colouring may then be
+  recovered directly, either from row i (if column j is the only column of its colour in row i)
+  or, by symmetry, from row j. Far fewer colours are typically required than for a distance-2
+  colouring, which ignores symmetry.
+
+  Input parameters:
+  sparsity - the symmetric sparsity pattern, typically computed using hess_pat
+  n        - the number of rows (and columns)
+
+  Output parameters:
+  colours  - array of length n, holding the colour of each column
+  p        - the number of colours used
+
+  Note: Requires PETSc to be configured with ColPack.
+*/
+PetscErrorCode ColPackStarColoring(unsigned int **sparsity,PetscInt n,PetscInt *colours,PetscInt *p)
+{
+#if defined(PETSC_HAVE_COLPACK)
+  ColPack::GraphColoringInterface *g;
+  std::vector<int>                vertexcolours;
+  PetscInt                        j;
+
+  PetscFunctionBegin;
+  g = new ColPack::GraphColoringInterface(SRC_MEM_ADOLC,sparsity,(int) n);
+  g->Coloring("SMALLEST_LAST","STAR");
+  g->GetVertexColors(vertexcolours);
+  if ((PetscInt) vertexcolours.size() != n) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_LIB,"ColPack did not colour every column");
+  *p = 0;
+  for (j=0; j<n; j++) {
+    colours[j] = vertexcolours[j];
+    *p = PetscMax(*p,colours[j]+1);
+  }
+  delete g;
+  PetscFunctionReturn(0);
+#else
+  PetscFunctionBegin;
+  SETERRQ(PETSC_COMM_SELF,PETSC_ERR_SUP,"Star colouring requires PETSc to be configured with ColPack");
+#endif
+}
+
+/*
+  Compute a greedy colouring of a square sparsity pattern which is restricted to the recovery of
+  the diagonal. Column j need only be coloured differently from those columns l which share row
+  j, or whose row l contains column j, i.e. a distance-1 colouring of the symmetrised adjacency
+  graph. This typically requires far fewer colours than a full (distance-2) colouring.
+
+  Input parameters:
+  sparsity - the sparsity pattern, typically computed using jac_pat
+  n        - the number of rows (and columns)
+
+  Output parameters:
+  colours  - array of length n, holding the colour of each column
+  p        - the number of colours used
+*/
+PetscErrorCode GetDiagonalColoring(unsigned int **sparsity,PetscInt n,PetscInt *colours,PetscInt *p)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,j,k,l,colour,*colptr,*rows,*forbidden;
+
+  PetscFunctionBegin;
+  ierr = SparsityTranspose(sparsity,n,n,&colptr,&rows);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(n,1),&forbidden);CHKERRQ(ierr);
+
+  /* Assign each column the smallest colour not used by a previously coloured neighbour */
+  for (j=0; j<n; j++) forbidden[j] = -1;
+  *p = 0;
+  for (j=0; j<n; j++) {
+    for (k=1; k<=(PetscInt) sparsity[j][0]; k++) {
+      l = sparsity[j][k];
+      if (l < j) forbidden[colours[l]] = j;
+    }
+    for (k=colptr[j]; k<colptr[j+1]; k++) {
+      l = rows[k];
+      if (l < j) forbidden[colours[l]] = j;
+    }
+    for (colour=0; forbidden[colour] == j; colour++);
+    colours[j] = colour;
+    *p = PetscMax(*p,colour+1);
+  }
+  ierr = PetscFree(rows);CHKERRQ(ierr);
+  ierr = PetscFree(colptr);CHKERRQ(ierr);
+  ierr = PetscFree(forbidden);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute a block colouring of a sparsity pattern whose rows and columns are grouped into blocks of
+  bs consecutive entries, as for a DMDA with bs degrees of freedom. A greedy distance-2 colouring
+  of the block pattern is computed, and the columns of each block are then assigned consecutive
+  colours, so that every column of a block shares its block colour. This uses up to bs times as
+  many colours as the block colouring, but the compressed entries of each block are then found in
+  a contiguous set of columns.
+
+  Input parameters:
+  sparsity - the sparsity pattern, typically computed using jac_pat
+  m        - the number of rows, a multiple of bs
+  n        - the number of columns, a multiple of bs
+  bs       - the block size
+
+  Output parameters:
+  colours  - array of length n, holding the colour of each column
+  p        - the number of colours used
+*/
+PetscErrorCode GetBlockColoring(unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt bs,PetscInt *colours,PetscInt *p)
+{
+  PetscErrorCode ierr;
+  PetscInt       ib,jb,i,j,k,mb = m/bs,nb = n/bs,nnzb = 0,pb,*stamp,*blockcolours;
+  unsigned int   **blocksparsity,*buf;
+
+  PetscFunctionBegin;
+  if ((m % bs) || (n % bs)) SETERRQ3(PETSC_COMM_SELF,PETSC_ERR_ARG_SIZ,"Dimensions %D x %D are not multiples of the block size %D",m,n,bs);
+  ierr = PetscMalloc3(PetscMax(nb,1),&stamp,PetscMax(nb,1),&blockcolours,PetscMax(mb,1),&blocksparsity);CHKERRQ(ierr);
+
+  /* Count, then gather, the block columns of each block row */
+  for (jb=0; jb<nb; jb++) stamp[jb] = -1;
+  for (ib=0; ib<mb; ib++) {
+    for (i=ib*bs; i<(ib+1)*bs; i++) {
+      for (k=1; k<=(PetscInt) sparsity[i][0]; k++) {
+        jb = sparsity[i][k]/bs;
+        if (stamp[jb] != ib) {
+          stamp[jb] = ib;
+          nnzb++;
+        }
+      }
+    }
+  }
+  ierr = PetscMalloc1(mb+nnzb+1,&buf);CHKERRQ(ierr);
+  for (jb=0; jb<nb; jb++) stamp[jb] = -1;
+  for (ib=0,j=0; ib<mb; ib++) {
+    blocksparsity[ib]    = buf+j;
+    blocksparsity[ib][0] = 0;
+    for (i=ib*bs; i<(ib+1)*bs; i++) {
+      for (k=1; k<=(PetscInt) sparsity[i][0]; k++) {
+        jb = sparsity[i][k]/bs;
+        if (stamp[jb] != ib) {
+          stamp[jb] = ib;
+          blocksparsity[ib][++blocksparsity[ib][0]] = jb;
+        }
+      }
+    }
+    j += 1+blocksparsity[ib][0];
+  }
+
+  /* Colour the blocks and expand to the columns within them */
+  ierr = GreedyColoring(blocksparsity,mb,nb,blockcolours,&pb);CHKERRQ(ierr);
+  for (j=0; j<n; j++) colours[j] = blockcolours[j/bs]*bs + j%bs;
+  *p = pb*bs;
+  ierr = PetscFree(buf);CHKERRQ(ierr);
+  ierr = PetscFree3(stamp,blockcolours,blocksparsity);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Compute a colouring of a periodic tile of a structured grid, which may be tiled over the local
+  patch of any DMDA with the same dimension, degrees of freedom and stencil (see StencilTileApply).
+  The distance-2 colouring of the stencil graph on a torus of period t in each direction is also
+  valid for the unbounded grid, provided t > 2s, since the offsets between coupled columns then
+  remain distinct modulo t. A greedy colouring is computed for each period between 2s+1 and
+  2(2s+1) and the tile with the fewest colours is kept. Since the tile is small, this is cheap, and
+  tiling costs O(n), so no graph colouring is required when the grid is refined or repartitioned.
+
+  Input parameter:
+  da   - distributed array, from which the dimension, degrees of freedom and stencil are taken
+
+  Output parameter:
+  tile - colouring of the tile, which should be freed using StencilTileDestroy
+*/
+PetscErrorCode StencilTileCreate(DM da,StencilTile **tile)
+{
+  PetscErrorCode ierr;
+  DMDALocalInfo  info;
+  PetscInt       t,tx,ty,tz,sy,sz,i,j,k,c,ii,jj,kk,cc,nc,row,n,q,*colours;
+  unsigned int   **sparsity;
+  StencilTile    *newtile;
+
+  PetscFunctionBegin;
+  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+  sy = (info.dim > 1) ? info.sw : 0;
+  sz = (info.dim > 2) ? info.sw : 0;
+  ierr = PetscNew(&newtile);CHKERRQ(ierr);
+  newtile->dim = info.dim;newtile->dof = info.dof;newtile->sw = info.sw;newtile->st = info.st;
+  for (t=2*info.sw+1; t<=2*(2*info.sw+1); t++) {
+    tx = t;
+    ty = (info.dim > 1) ? t : 1;
+    tz = (info.dim > 2) ? t : 1;
+    n  = tx*ty*tz*info.dof;
+
+    /* Sparsity pattern of the stencil on the torus */
+    sparsity = (unsigned int **) malloc(n*sizeof(unsigned int*));
+    for (k=0; k<tz; k++) {
+      for (j=0; j<ty; j++) {
+        for (i=0; i<tx; i++) {
+          for (c=0; c<info.dof; c++) {
+            row = ((k*ty + j)*tx + i)*info.dof + c;
+            sparsity[row] = (unsigned int *) malloc((1+info.dof*(2*info.sw+1)*(2*sy+1)*(2*sz+1))*sizeof(unsigned int));
+            nc = 0;
+            for (kk=k-sz; kk<=k+sz; kk++) {
+              for (jj=j-sy; jj<=j+sy; jj++) {
+                for (ii=i-info.sw; ii<=i+info.sw; ii++) {
+                  if ((info.st == DMDA_STENCIL_STAR) && ((ii != i)+(jj != j)+(kk != k) > 1)) continue;
+                  for (cc=0; cc<info.dof; cc++)
+                    sparsity[row][++nc] = ((((kk+tz)%tz)*ty + (jj+ty)%ty)*tx + (ii+tx)%tx)*info.dof + cc;
+                }
+              }
+            }
+            sparsity[row][0] = nc;
+          }
+        }
       }
     }
+    ierr = PetscMalloc1(n,&colours);CHKERRQ(ierr);
+    ierr = GreedyColoring(sparsity,n,n,colours,&q);CHKERRQ(ierr);
+    for (row=0; row<n; row++) free(sparsity[row]);
+    free(sparsity);
+    if ((!newtile->colours) || (q < newtile->p)) {
+      ierr = PetscFree(newtile->colours);CHKERRQ(ierr);
+      newtile->colours = colours;
+      newtile->p  = q;
+      newtile->tx = tx;newtile->ty = ty;newtile->tz = tz;
+    } else {
+      ierr = PetscFree(colours);CHKERRQ(ierr);
+    }
   }
+  ierr = PetscInfo5(NULL,"Stencil tile of period %D x %D x %D with %D colours for %D components\n",newtile->tx,newtile->ty,newtile->tz,newtile->p,newtile->dof);CHKERRQ(ierr);
+  *tile = newtile;
   PetscFunctionReturn(0);
 }
 
 /*
-  Recover the diagonal of the Jacobian from its compressed matrix format
+  Check whether a stencil tile may be applied to a DMDA
 
   Input parameters:
-  mode - use INSERT_VALUES or ADD_VALUES, as required
-  m    - number of rows of matrix.
-  R    - recovery vector to use in the decompression procedure
-  C    - compressed matrix to recover values from
-  a    - shift value for implicit problems (select NULL or unity for explicit problems)
+  da    - distributed array
+  tile  - colouring of a periodic tile, as computed by StencilTileCreate
 
   Output parameter:
-  diag - Vec to be populated with values from compressed matrix
+  match - PETSC_TRUE if the dimension, degrees of freedom and stencil agree
 */
-PetscErrorCode RecoverDiagonalLocal(Vec diag,InsertMode mode,PetscInt m,PetscScalar *R,PetscScalar **C,PetscReal *a)
+PetscErrorCode StencilTileMatch(DM da,StencilTile *tile,PetscBool *match)
 {
   PetscErrorCode ierr;
-  PetscInt       i,colour;
+  DMDALocalInfo  info;
 
   PetscFunctionBegin;
-  for (i=0; i<m; i++) {
-    colour = (PetscInt)R[i];
-    if (a)
-      C[i][colour] *= *a;
-    ierr = VecSetValuesLocal(diag,1,&i,&C[i][colour],mode);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+  *match = ((tile->dim == info.dim) && (tile->dof == info.dof) && (tile->sw == info.sw) && (tile->st == (PetscInt) info.st)) ? PETSC_TRUE : PETSC_FALSE;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Colour the local (ghosted) patch of a DMDA by tiling a precomputed colouring of a periodic tile.
+  As for GetStencilColoring, points are coloured by their unwrapped local coordinates, so this is
+  valid for any grid size, boundary type and number of ranks.
+
+  Input parameters:
+  da      - distributed array
+  tile    - colouring of a periodic tile with the same stencil, as computed by StencilTileCreate
+
+  Output parameters:
+  colours - array with length equal to the size of a local vector, holding the colour of each
+            local (ghosted) entry
+  p       - the number of colours used
+*/
+PetscErrorCode StencilTileApply(DM da,StencilTile *tile,PetscInt *colours,PetscInt *p)
+{
+  PetscErrorCode ierr;
+  DMDALocalInfo  info;
+  PetscInt       i,j,k,c,ii,jj,kk,row,entry;
+  PetscBool      match;
+
+  PetscFunctionBegin;
+  ierr = StencilTileMatch(da,tile,&match);CHKERRQ(ierr);
+  if (!match) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_ARG_INCOMP,"Stencil tile does not match the dimension, degrees of freedom or stencil of the DMDA");
+  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+  for (k=info.gzs; k<info.gzs+info.gzm; k++) {
+    for (j=info.gys; j<info.gys+info.gym; j++) {
+      for (i=info.gxs; i<info.gxs+info.gxm; i++) {
+        ii    = (i%tile->tx + tile->tx)%tile->tx;
+        jj    = (j%tile->ty + tile->ty)%tile->ty;
+        kk    = (k%tile->tz + tile->tz)%tile->tz;
+        row   = (((k-info.gzs)*info.gym + j-info.gys)*info.gxm + i-info.gxs)*info.dof;
+        entry = ((kk*tile->ty + jj)*tile->tx + ii)*info.dof;
+        for (c=0; c<info.dof; c++)
+          colours[row+c] = tile->colours[entry+c];
+      }
+    }
+  }
+  *p = tile->p;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Free memory associated with a stencil tile
+
+  Input parameter:
+  tile - stencil tile to destroy
+*/
+PetscErrorCode StencilTileDestroy(StencilTile **tile)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  if (!*tile) PetscFunctionReturn(0);
+  ierr = PetscFree((*tile)->colours);CHKERRQ(ierr);
+  ierr = PetscFree(*tile);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* Adaptors for the column colouring backends, with the common ColoringFunction signature */
+PetscErrorCode ColoringStencil(DM da,unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *colours,PetscInt *p)
+{
+  PetscErrorCode ierr;
+  DMDALocalInfo  info;
+
+  PetscFunctionBegin;
+  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+  if (n != info.gxm*info.gym*info.gzm*info.dof) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_ARG_SIZ,"Stencil colouring requires a tape in local numbering");
+  ierr = GetStencilColoring(da,colours,p);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+PetscErrorCode ColoringTile(DM da,unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *colours,PetscInt *p)
+{
+  PetscErrorCode ierr;
+  DMDALocalInfo  info;
+  StencilTile    *tile;
+
+  PetscFunctionBegin;
+  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+  if (n != info.gxm*info.gym*info.gzm*info.dof) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_ARG_SIZ,"Stencil tile colouring requires a tape in local numbering");
+  ierr = StencilTileCreate(da,&tile);CHKERRQ(ierr);
+  ierr = StencilTileApply(da,tile,colours,p);CHKERRQ(ierr);
+  ierr = StencilTileDestroy(&tile);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+PetscErrorCode ColoringBlock(DM da,unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *colours,PetscInt *p)
+{
+  PetscErrorCode ierr;
+  DMDALocalInfo  info;
+
+  PetscFunctionBegin;
+  ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+  ierr = GetBlockColoring(sparsity,m,n,info.dof,colours,p);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+PetscErrorCode ColoringDM(DM da,unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *colours,PetscInt *p)
+{
+  PetscErrorCode ierr;
+  ISColoring     iscoloring;
+
+  PetscFunctionBegin;
+  ierr = GetColoring(da,&iscoloring);CHKERRQ(ierr);
+  ierr = CountColors(iscoloring,p);CHKERRQ(ierr);
+  ierr = GetColors(iscoloring,colours);CHKERRQ(ierr);
+  ierr = ISColoringDestroy(&iscoloring);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+PetscErrorCode ColoringGreedy(DM da,unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *colours,PetscInt *p)
+{
+  return GreedyColoring(sparsity,m,n,colours,p);
+}
+
+PetscErrorCode ColoringColPackNatural(DM da,unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *colours,PetscInt *p)
+{
+  return ColPackColoring(sparsity,m,n,"NATURAL",colours,p);
+}
+
+PetscErrorCode ColoringColPackLargestFirst(DM da,unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *colours,PetscInt *p)
+{
+  return ColPackColoring(sparsity,m,n,"LARGEST_FIRST",colours,p);
+}
+
+PetscErrorCode ColoringColPackSmallestLast(DM da,unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *colours,PetscInt *p)
+{
+  return ColPackColoring(sparsity,m,n,"SMALLEST_LAST",colours,p);
+}
+
+PetscErrorCode ColoringColPackIncidenceDegree(DM da,unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *colours,PetscInt *p)
+{
+  return ColPackColoring(sparsity,m,n,"INCIDENCE_DEGREE",colours,p);
+}
+
+static const ColoringBackend ColoringBackends[] = {
+  {"stencil",                  ColoringStencil,                PETSC_TRUE,  PETSC_TRUE},
+  {"tile",                     ColoringTile,                   PETSC_TRUE,  PETSC_TRUE},
+  {"dm",                       ColoringDM,                     PETSC_TRUE,  PETSC_FALSE},
+  {"block",                    ColoringBlock,                  PETSC_TRUE,  PETSC_FALSE},
+  {"greedy",                   ColoringGreedy,                 PETSC_FALSE, PETSC_FALSE},
+#if defined(PETSC_HAVE_COLPACK)
+  {"colpack_natural",          ColoringColPackNatural,         PETSC_FALSE, PETSC_FALSE},
+  {"colpack_largest_first",    ColoringColPackLargestFirst,    PETSC_FALSE, PETSC_FALSE},
+  {"colpack_smallest_last",    ColoringColPackSmallestLast,    PETSC_FALSE, PETSC_FALSE},
+  {"colpack_incidence_degree", ColoringColPackIncidenceDegree, PETSC_FALSE, PETSC_FALSE},
+#endif
+};
+static const PetscInt NColoringBackends = sizeof(ColoringBackends)/sizeof(ColoringBackend);
+
+/*
+  Compute a column colouring using a given backend or, in autotune mode, using each backend
+  available and keeping whichever uses the fewest colours. The number of colours and time taken
+  are logged for each candidate. In autotune mode, backends whose preconditions do not hold are
+  skipped rather than raising an error: the stencil and tile colourings are only tried if the tape
+  is in the local (ghosted) numbering of the DMDA, and the DMDA colouring only if there are no
+  periodic boundaries, since DMCreateColoring does not give a valid colouring of a local patch
+  whose opposite boundaries are owned by the same rank. Since the candidates are coloured on each
+  rank independently, the view is printed by each rank in turn.
+
+  Input parameters:
+  da       - distributed array upon which the traced function is defined (may be NULL)
+  sparsity - the sparsity pattern, typically computed using jac_pat
+  m        - the number of rows
+  n        - the number of columns
+  backend  - name of the backend, as listed in ColoringBackends, or "auto" to autotune
+  view     - print the number of colours and time taken for each candidate
+
+  Output parameters:
+  colours  - array of length n, holding the colour of each column
+  p        - the number of colours used
+*/
+PetscErrorCode GetColumnColoring(DM da,unsigned int **sparsity,PetscInt m,PetscInt n,const char *backend,PetscBool view,PetscInt *colours,PetscInt *p)
+{
+  PetscErrorCode ierr;
+  PetscInt       b,j,q,*trial;
+  PetscBool      autotune,match,periodic = PETSC_FALSE,local = PETSC_FALSE;
+  PetscMPIInt    rank;
+  PetscLogDouble t0,t1;
+  DMDALocalInfo  info;
+
+  PetscFunctionBegin;
+  ierr = PetscStrcmp(backend,"auto",&autotune);CHKERRQ(ierr);
+  if (!autotune) {
+    for (b=0; b<NColoringBackends; b++) {
+      ierr = PetscStrcmp(backend,ColoringBackends[b].name,&match);CHKERRQ(ierr);
+      if (match) break;
+    }
+    if (b == NColoringBackends) SETERRQ1(PETSC_COMM_SELF,PETSC_ERR_ARG_UNKNOWN_TYPE,"Unknown (or unavailable) colouring backend %s",backend);
+    if ((ColoringBackends[b].needs_dm) && (!da)) SETERRQ1(PETSC_COMM_SELF,PETSC_ERR_ARG_WRONG,"Colouring backend %s requires a DMDA",backend);
+    ierr = (*ColoringBackends[b].colour)(da,sparsity,m,n,colours,p);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+  }
+
+  if (da) {
+    ierr = DMDAGetLocalInfo(da,&info);CHKERRQ(ierr);
+    periodic = ((info.bx == DM_BOUNDARY_PERIODIC) || (info.by == DM_BOUNDARY_PERIODIC) || (info.bz == DM_BOUNDARY_PERIODIC)) ? PETSC_TRUE : PETSC_FALSE;
+    local    = (n == info.gxm*info.gym*info.gzm*info.dof) ? PETSC_TRUE : PETSC_FALSE;
+  }
+  ierr = MPI_Comm_rank(PETSC_COMM_WORLD,&rank);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(n,1),&trial);CHKERRQ(ierr);
+  *p = -1;
+  for (b=0; b<NColoringBackends; b++) {
+    if ((ColoringBackends[b].needs_dm) && (!da)) continue;
+    if ((ColoringBackends[b].local) && (!local)) continue;
+    if ((ColoringBackends[b].colour == ColoringDM) && (periodic)) continue;
+    ierr = PetscTime(&t0);CHKERRQ(ierr);
+    ierr = (*ColoringBackends[b].colour)(da,sparsity,m,n,trial,&q);CHKERRQ(ierr);
+    ierr = PetscTime(&t1);CHKERRQ(ierr);
+    ierr = PetscInfo3(NULL,"Colouring backend %s: %D colours in %g s\n",ColoringBackends[b].name,q,t1-t0);CHKERRQ(ierr);
+    if (view) {
+      ierr = PetscSynchronizedPrintf(PETSC_COMM_WORLD,"  [%d] Colouring backend %-24s %4D colours in %g s\n",rank,ColoringBackends[b].name,q,t1-t0);CHKERRQ(ierr);
+    }
+    if ((*p < 0) || (q < *p)) {
+      *p = q;
+      for (j=0; j<n; j++) colours[j] = trial[j];
+    }
+  }
+  if (view) {
+    ierr = PetscSynchronizedFlush(PETSC_COMM_WORLD,PETSC_STDOUT);CHKERRQ(ierr);
+  }
+  ierr = PetscFree(trial);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Generate a seed matrix from a colour vector, as computed by GreedyColoring
+
+  Input parameters:
+  n       - the number of columns coloured
+  colours - array of length n, holding the colour of each column
+
+  Output parameter:
+  S       - the n x p seed matrix, which should be zero on input
+
+  Note: Columns with negative colour are left unseeded, as in partial colourings.
+*/
+PetscErrorCode GenerateSeedMatrixFromColors(PetscInt n,PetscInt *colours,PetscScalar **S)
+{
+  PetscInt j;
+
+  PetscFunctionBegin;
+  for (j=0; j<n; j++) {
+    if (colours[j] >= 0) S[j][colours[j]] = 1.;
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Generate the block of columns c0,...,c0+b-1 of the seed matrix defined by a colour vector, so
+  that the Jacobian may be propagated in blocks of b directions without storing the full n x p
+  seed matrix. Row j of the seed matrix has a single nonzero, in column colours[j], so that in any
+  block it may only be nonzero in column colours[j] mod b. Only that entry is updated, so the
+  cost is O(n) per block, provided S is zero on the first call for a given colour vector.
+
+  Input parameters:
+  n       - the number of columns of the Jacobian
+  colours - array of length n, holding the colour of each column, or -1 if uncoloured
+  c0      - first colour of the block
+  b       - width of the block
+
+  Output parameter:
+  S       - n x b block of the seed matrix
+*/
+PetscErrorCode GenerateSeedBlockFromColors(PetscInt n,PetscInt *colours,PetscInt c0,PetscInt b,PetscScalar **S)
+{
+  PetscInt j,colour;
+
+  PetscFunctionBegin;
+  for (j=0; j<n; j++) {
+    colour = colours[j];
+    if (colour >= 0) S[j][colour%b] = ((colour >= c0) && (colour < c0+b)) ? 1. : 0.;
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Generate a seed matrix for row compression from a colour vector, as computed by
+  GreedyRowColoring
+
+  Input parameters:
+  m       - the number of rows coloured
+  colours - array of length m, holding the colour of each row
+
+  Output parameter:
+  W       - the p x m seed matrix, which should be zero on input
+
+  Note: Rows with negative colour are left unseeded, as in partial colourings.
+*/
+PetscErrorCode GenerateRowSeedMatrixFromColors(PetscInt m,PetscInt *colours,PetscScalar **W)
+{
+  PetscInt i;
+
+  PetscFunctionBegin;
+  for (i=0; i<m; i++) {
+    if (colours[i] >= 0) W[colours[i]][i] = 1.;
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Establish a look-up matrix whose entries contain the column coordinates of the corresponding entry
+  in a matrix which has been compressed using a given column colouring. The recovery matrix is
+  stored in compressed sparse row (CSR) format, so that de-compression may be done one row at a
+  time, and is built in a single pass over the sparsity pattern.
+
+  Input parameters:
+  colours  - array of length n, holding the colour of each column (as computed by GetColors or
+             GreedyColoring), or -1 if uncoloured
+  sparsity - the sparsity pattern of the matrix to be recovered, typically computed using an ADOL-C
+             function, such as jac_pat or hess_pat
+  m        - the number of rows of the matrix to be recovered
+  p        - the number of colors used
+
+  Output parameter:
+  plan     - recovery plan, holding the column indices of each row and the offsets of the
+             corresponding entries in a contiguously allocated m x p compressed matrix
+
+  Notes:
+  If two columns in a row share a colour (i.e. the colouring is not valid for the sparsity pattern)
+  then, as in the compressed matrix, only the first of them is recovered. The plan should be freed
+  using RecPlanDestroy.
+*/
+PetscErrorCode GetRecoveryMatrix(PetscInt *colours,unsigned int **sparsity,PetscInt m,PetscInt p,RecPlan **plan)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,j,k,l = 0,colour,nnz = 0,maxrow = 0,*stamp;
+  RecPlan        *newplan;
+
+  PetscFunctionBegin;
+  ierr = PetscNew(&newplan);CHKERRQ(ierr);
+  ierr = PetscMalloc1(m+1,&newplan->rowptr);CHKERRQ(ierr);
+  for (i=0; i<m; i++) nnz += (PetscInt) sparsity[i][0];
+  ierr = PetscMalloc2(PetscMax(nnz,1),&newplan->cols,PetscMax(nnz,1),&newplan->offsets);CHKERRQ(ierr);
+
+  /* The stamp of a colour records the last row in which it was used */
+  ierr = PetscMalloc1(PetscMax(p,1),&stamp);CHKERRQ(ierr);
+  for (colour=0; colour<p; colour++) stamp[colour] = -1;
+  newplan->rowptr[0] = 0;
+  for (i=0; i<m; i++) {
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++) {
+      j      = (PetscInt) sparsity[i][k];
+      colour = colours[j];
+      if ((colour < 0) || (stamp[colour] == i)) continue;
+      stamp[colour]       = i;
+      newplan->cols[l]    = j;
+      newplan->offsets[l] = i*p+colour;
+      l++;
+    }
+    newplan->rowptr[i+1] = l;
+    maxrow = PetscMax(maxrow,newplan->rowptr[i+1]-newplan->rowptr[i]);
+  }
+  ierr = PetscFree(stamp);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(maxrow,1),&newplan->vals);CHKERRQ(ierr);
+  newplan->m   = m;
+  newplan->nnz = l;
+  *plan = newplan;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Establish a recovery plan for a symmetric matrix, such as a Hessian, which has been compressed
+  using a star (or distance-2) colouring. Entry (i,j) is read from row i of the compressed matrix
+  if column j is the only column of its colour in row i, and otherwise from row j, in the column
+  of the colour of i. The star colouring guarantees that one of these holds. Since offsets into
+  the compressed matrix are stored, the plan may be used with RecoverJacobian as usual.
+
+  Input parameters:
+  colours  - array of length n, holding the colour of each column
+  sparsity - the symmetric sparsity pattern, typically computed using hess_pat
+  n        - the number of rows (and columns)
+  p        - the number of colours used
+
+  Output parameter:
+  plan     - recovery plan, to be used with RecoverJacobian or RecoverJacobianLocal
+
+  Note: The plan should be freed using RecPlanDestroy.
+*/
+PetscErrorCode GetSymmetricRecoveryMatrix(PetscInt *colours,unsigned int **sparsity,PetscInt n,PetscInt p,RecPlan **plan)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,j,k,l = 0,colour,nnz = 0,maxrow = 0,*stamp,*count;
+  RecPlan        *newplan;
+
+  PetscFunctionBegin;
+  ierr = PetscNew(&newplan);CHKERRQ(ierr);
+  ierr = PetscMalloc1(n+1,&newplan->rowptr);CHKERRQ(ierr);
+  for (i=0; i<n; i++) nnz += (PetscInt) sparsity[i][0];
+  ierr = PetscMalloc2(PetscMax(nnz,1),&newplan->cols,PetscMax(nnz,1),&newplan->offsets);CHKERRQ(ierr);
+
+  /* Count the columns of each colour in the current row, using stamps to avoid resetting */
+  ierr = PetscMalloc2(PetscMax(p,1),&stamp,PetscMax(p,1),&count);CHKERRQ(ierr);
+  for (colour=0; colour<p; colour++) stamp[colour] = -1;
+  newplan->rowptr[0] = 0;
+  for (i=0; i<n; i++) {
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++) {
+      colour = colours[sparsity[i][k]];
+      if (stamp[colour] != i) {
+        stamp[colour] = i;
+        count[colour] = 0;
+      }
+      count[colour]++;
+    }
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++) {
+      j      = (PetscInt) sparsity[i][k];
+      colour = colours[j];
+      newplan->cols[l]    = j;
+      newplan->offsets[l] = (count[colour] == 1) ? i*p+colour : j*p+colours[i];
+      l++;
+    }
+    newplan->rowptr[i+1] = l;
+    maxrow = PetscMax(maxrow,newplan->rowptr[i+1]-newplan->rowptr[i]);
+  }
+  ierr = PetscFree2(stamp,count);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(maxrow,1),&newplan->vals);CHKERRQ(ierr);
+  newplan->m   = n;
+  newplan->nnz = l;
+  *plan = newplan;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Build a recovery plan for a row-compressed matrix, as propagated in vector reverse mode using a
+  seed matrix generated by GenerateRowSeedMatrixFromColors. Entry (i,j) is found in row c(i) of
+  the contiguously allocated p x n compressed matrix, where c(i) is the colour of row i.
+
+  Input parameters:
+  sparsity - the sparsity pattern of the matrix to be recovered, typically computed using jac_pat
+  m        - the number of rows of the matrix to be recovered
+  n        - the number of columns of the matrix to be recovered
+  colours  - array of length m, holding the colour of each row
+
+  Output parameter:
+  plan     - recovery plan, to be used with RecoverJacobian or RecoverJacobianLocal
+
+  Note: The plan should be freed using RecPlanDestroy.
+*/
+PetscErrorCode GetRowRecoveryPlan(unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *colours,RecPlan **plan)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,j,k,l = 0,nnz = 0,maxrow = 0;
+  RecPlan        *newplan;
+
+  PetscFunctionBegin;
+  ierr = PetscNew(&newplan);CHKERRQ(ierr);
+  ierr = PetscMalloc1(m+1,&newplan->rowptr);CHKERRQ(ierr);
+  newplan->rowptr[0] = 0;
+  for (i=0; i<m; i++) {
+    nnz += (PetscInt) sparsity[i][0];
+    newplan->rowptr[i+1] = nnz;
+    maxrow = PetscMax(maxrow,(PetscInt) sparsity[i][0]);
+  }
+  ierr = PetscMalloc2(nnz,&newplan->cols,nnz,&newplan->offsets);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(maxrow,1),&newplan->vals);CHKERRQ(ierr);
+  for (i=0; i<m; i++) {
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++) {
+      j = (PetscInt) sparsity[i][k];
+      newplan->cols[l]    = j;
+      newplan->offsets[l] = colours[i]*n+j;
+      l++;
+    }
+  }
+  newplan->m   = m;
+  newplan->nnz = nnz;
+  *plan = newplan;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Build the pair of recovery plans for a Jacobian compressed from both sides using a partial row
+  and column colouring, as computed by GetStarBicoloring. Entry (i,j) is recovered from the
+  contiguously allocated m x pc column-compressed matrix if no other column in row i shares the
+  colour of column j, and otherwise from the pr x n row-compressed matrix, which requires that no
+  other row in column j shares the colour of row i. Both plans are built in O(nnz).
+
+  Input parameters:
+  sparsity   - the sparsity pattern of the matrix to be recovered, typically computed using jac_pat
+  m          - the number of rows of the matrix to be recovered
+  n          - the number of columns of the matrix to be recovered
+  rowcolours - array of length m, holding the colour of each row, or -1 if uncoloured
+  colcolours - array of length n, holding the colour of each column, or -1 if uncoloured
+  pc         - the number of column colours
+
+  Output parameters:
+  plan       - recovery plan for the column-compressed matrix
+  planR      - recovery plan for the row-compressed matrix
+
+  Note: The plans should be freed using RecPlanDestroy.
+*/
+PetscErrorCode GetBidirectionalRecoveryPlans(unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt *rowcolours,PetscInt *colcolours,PetscInt pc,RecPlan **plan,RecPlan **planR)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,j,k,l,c,nnz = 0,nf = 0,nr = 0,maxrow = 0,*colptr,*rows,*pos,*fill,*count,*stamp;
+  PetscBool      *forward,*reverse;
+  RecPlan        *newplan,*newplanR;
+
+  PetscFunctionBegin;
+  for (i=0; i<m; i++) nnz += (PetscInt) sparsity[i][0];
+  ierr = PetscMalloc2(PetscMax(nnz,1),&forward,PetscMax(nnz,1),&reverse);CHKERRQ(ierr);
+  ierr = PetscCalloc3(n+1,&colptr,n,&fill,PetscMax(PetscMax(m,n),1),&count);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(PetscMax(m,n),1),&stamp);CHKERRQ(ierr);
+
+  /* Entries recoverable from the column-compressed matrix: column colour unique within the row */
+  for (c=0; c<PetscMax(m,n); c++) stamp[c] = -1;
+  l = 0;
+  for (i=0; i<m; i++) {
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++) {
+      c = colcolours[sparsity[i][k]];
+      if (c < 0) continue;
+      if (stamp[c] != i) {stamp[c] = i;count[c] = 0;}
+      count[c]++;
+    }
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++,l++) {
+      c = colcolours[sparsity[i][k]];
+      forward[l] = ((c >= 0) && (count[c] == 1)) ? PETSC_TRUE : PETSC_FALSE;
+    }
+  }
+
+  /* Remaining entries must be recoverable from the row-compressed matrix, so check using CSC */
+  for (i=0; i<m; i++) {
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++)
+      colptr[sparsity[i][k]+1]++;
+  }
+  for (j=0; j<n; j++) colptr[j+1] += colptr[j];
+  ierr = PetscMalloc2(PetscMax(nnz,1),&rows,PetscMax(nnz,1),&pos);CHKERRQ(ierr);
+  for (i=0,l=0; i<m; i++) {
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++,l++) {
+      j = sparsity[i][k];
+      rows[colptr[j]+fill[j]] = i;
+      pos[colptr[j]+fill[j]]  = l;
+      fill[j]++;
+    }
+  }
+  for (c=0; c<PetscMax(m,n); c++) stamp[c] = -1;
+  for (j=0; j<n; j++) {
+    for (k=colptr[j]; k<colptr[j+1]; k++) {
+      c = rowcolours[rows[k]];
+      if (c < 0) continue;
+      if (stamp[c] != j) {stamp[c] = j;count[c] = 0;}
+      count[c]++;
+    }
+    for (k=colptr[j]; k<colptr[j+1]; k++) {
+      c = rowcolours[rows[k]];
+      reverse[pos[k]] = ((c >= 0) && (count[c] == 1)) ? PETSC_TRUE : PETSC_FALSE;
+    }
+  }
+  for (i=0,l=0; i<m; i++) {
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++,l++) {
+      if ((!forward[l]) && (!reverse[l])) SETERRQ2(PETSC_COMM_SELF,PETSC_ERR_PLIB,"Entry (%D,%D) cannot be recovered directly from bicolouring",i,(PetscInt) sparsity[i][k]);
+    }
+  }
+
+  /* Build recovery plans, row by row */
+  ierr = PetscNew(&newplan);CHKERRQ(ierr);
+  ierr = PetscNew(&newplanR);CHKERRQ(ierr);
+  ierr = PetscMalloc1(m+1,&newplan->rowptr);CHKERRQ(ierr);
+  ierr = PetscMalloc1(m+1,&newplanR->rowptr);CHKERRQ(ierr);
+  newplan->rowptr[0] = newplanR->rowptr[0] = 0;
+  for (i=0,l=0; i<m; i++) {
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++,l++) {
+      if (forward[l]) nf++;
+      else nr++;
+    }
+    newplan->rowptr[i+1]  = nf;
+    newplanR->rowptr[i+1] = nr;
+    maxrow = PetscMax(maxrow,(PetscInt) sparsity[i][0]);
+  }
+  ierr = PetscMalloc2(nf,&newplan->cols,nf,&newplan->offsets);CHKERRQ(ierr);
+  ierr = PetscMalloc2(nr,&newplanR->cols,nr,&newplanR->offsets);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(maxrow,1),&newplan->vals);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(maxrow,1),&newplanR->vals);CHKERRQ(ierr);
+  nf = nr = 0;
+  for (i=0,l=0; i<m; i++) {
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++,l++) {
+      j = (PetscInt) sparsity[i][k];
+      if (forward[l]) {
+        newplan->cols[nf]    = j;
+        newplan->offsets[nf] = i*pc+colcolours[j];
+        nf++;
+      } else {
+        newplanR->cols[nr]    = j;
+        newplanR->offsets[nr] = rowcolours[i]*n+j;
+        nr++;
+      }
+    }
+  }
+  newplan->m  = newplanR->m = m;
+  newplan->nnz  = nf;
+  newplanR->nnz = nr;
+  *plan  = newplan;
+  *planR = newplanR;
+  ierr = PetscFree2(rows,pos);CHKERRQ(ierr);
+  ierr = PetscFree(stamp);CHKERRQ(ierr);
+  ierr = PetscFree3(colptr,fill,count);CHKERRQ(ierr);
+  ierr = PetscFree2(forward,reverse);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Colour the columns of a Jacobian w.r.t. k parameters, so that parameters which influence
+  disjoint sets of dependents share a seed direction. Colours are assigned greedily.
+
+  Input parameters:
+  sparsity - the sparsity pattern of the m x (n+k) Jacobian w.r.t. both independent variables
+             and parameters (in that order), typically computed using jac_pat
+  m        - the number of dependent variables
+  n        - the number of independent variables, excluding parameters
+  k        - the number of parameters
+
+  Output parameters:
+  colours  - array of length k, holding the colour assigned to each parameter
+  q        - the number of colours used
+*/
+PetscErrorCode GetParameterColoring(unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt k,PetscInt *colours,PetscInt *q)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,j,l,nr,colour,*row;
+  PetscBool      *conflict,*used;
+
+  PetscFunctionBegin;
+  ierr = PetscCalloc1(k*k,&conflict);CHKERRQ(ierr);
+  ierr = PetscMalloc2(k,&row,k,&used);CHKERRQ(ierr);
+  for (i=0; i<m; i++) {
+    nr = 0;
+    for (l=1; l<=(PetscInt) sparsity[i][0]; l++) {
+      j = (PetscInt) sparsity[i][l];
+      if (j >= n) row[nr++] = j-n;
+    }
+    for (j=0; j<nr; j++) {
+      for (l=0; l<nr; l++)
+        conflict[row[j]*k+row[l]] = PETSC_TRUE;
+    }
+  }
+  *q = 0;
+  for (j=0; j<k; j++) {
+    ierr = PetscMemzero(used,k*sizeof(PetscBool));CHKERRQ(ierr);
+    for (l=0; l<j; l++) {
+      if (conflict[j*k+l]) used[colours[l]] = PETSC_TRUE;
+    }
+    for (colour=0; used[colour]; colour++);
+    colours[j] = colour;
+    *q = PetscMax(*q,colour+1);
+  }
+  ierr = PetscFree2(row,used);CHKERRQ(ierr);
+  ierr = PetscFree(conflict);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Generate the seed matrix for a compressed Jacobian w.r.t. parameters. Rows corresponding to
+  independent variables are left as zero, so that only parameter directions are propagated.
+
+  Input parameters:
+  n       - the number of independent variables, excluding parameters
+  k       - the number of parameters
+  colours - colours of the parameters, as computed by GetParameterColoring
+
+  Output parameter:
+  S       - the (n+k) x q seed matrix, which should be zero on input
+*/
+PetscErrorCode GenerateParameterSeedMatrix(PetscInt n,PetscInt k,PetscInt *colours,PetscScalar **S)
+{
+  PetscInt j;
+
+  PetscFunctionBegin;
+  for (j=0; j<k; j++)
+    S[n+j][colours[j]] = 1.;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Establish a look-up matrix for de-compression of a Jacobian w.r.t. parameters, analogously
+  to GetRecoveryMatrix. Column coordinates are parameter indices.
+
+  Input parameters:
+  sparsity - the sparsity pattern of the m x (n+k) Jacobian w.r.t. both independent variables
+             and parameters, typically computed using jac_pat
+  m        - the number of dependent variables
+  n        - the number of independent variables, excluding parameters
+  q        - the number of colours used for the parameters
+  colours  - colours of the parameters, as computed by GetParameterColoring
+
+  Output parameter:
+  plan     - recovery plan for the contiguously allocated m x q compressed matrix
+*/
+PetscErrorCode GetParameterRecoveryMatrix(unsigned int **sparsity,PetscInt m,PetscInt n,PetscInt q,PetscInt *colours,RecPlan **plan)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,j,k,nk = 0,*shifted;
+
+  PetscFunctionBegin;
+  for (i=0; i<m; i++) {
+    for (k=1; k<=(PetscInt) sparsity[i][0]; k++)
+      nk = PetscMax(nk,(PetscInt) sparsity[i][k]+1);
+  }
+
+  /* Columns of independent variables are treated as uncoloured */
+  ierr = PetscMalloc1(PetscMax(nk,1),&shifted);CHKERRQ(ierr);
+  for (j=0; j<nk; j++)
+    shifted[j] = (j < n) ? -1 : colours[j-n];
+  ierr = GetRecoveryMatrix(shifted,sparsity,m,q,plan);CHKERRQ(ierr);
+  for (k=0; k<(*plan)->nnz; k++) (*plan)->cols[k] -= n;
+  ierr = PetscFree(shifted);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Group the entries of a recovery plan into bs x bs blocks, so that the matrix may be recovered
+  into a BAIJ or SBAIJ matrix one block row at a time (see RecoverJacobianBlockedLocal). Each block
+  row lists the block columns of the union of its bs rows, and the offsets of the entries of a
+  block row are stored in the row-oriented order expected by MatSetValuesBlocked. Entries of a
+  block outside the sparsity pattern are given offset -1 and are recovered as zero. The plan may
+  have been built for column or row compression, since only its offsets are used.
+
+  Input parameters:
+  plan  - scalar recovery plan, with a number of rows which is a multiple of bs
+  bs    - the block size, typically the number of degrees of freedom of a DMDA
+
+  Output parameter:
+  bplan - blocked recovery plan, which borrows the row map of plan, if any
+
+  Note: The plan should be freed using RecPlanDestroy.
+*/
+PetscErrorCode GetBlockRecoveryPlan(RecPlan *plan,PetscInt bs,RecPlan **bplan)
+{
+  PetscErrorCode ierr;
+  PetscInt       ib,jb,i,j,k,l,r,base,ncb,mb = plan->m/bs,nb = 0,nnzb = 0,maxrow = 0,*stamp,*pos;
+  RecPlan        *newplan;
+
+  PetscFunctionBegin;
+  if (plan->m % bs) SETERRQ2(PETSC_COMM_SELF,PETSC_ERR_ARG_SIZ,"Number of rows %D is not a multiple of the block size %D",plan->m,bs);
+  for (k=0; k<plan->nnz; k++) nb = PetscMax(nb,plan->cols[k]/bs+1);
+  ierr = PetscMalloc2(PetscMax(nb,1),&stamp,PetscMax(nb,1),&pos);CHKERRQ(ierr);
+  ierr = PetscNew(&newplan);CHKERRQ(ierr);
+  ierr = PetscMalloc1(mb+1,&newplan->rowptr);CHKERRQ(ierr);
+
+  /* Number the block columns of each block row in order of appearance */
+  for (jb=0; jb<nb; jb++) stamp[jb] = -1;
+  newplan->rowptr[0] = 0;
+  for (ib=0; ib<mb; ib++) {
+    ncb = 0;
+    for (i=ib*bs; i<(ib+1)*bs; i++) {
+      for (k=plan->rowptr[i]; k<plan->rowptr[i+1]; k++) {
+        jb = plan->cols[k]/bs;
+        if (stamp[jb] != ib) {
+          stamp[jb] = ib;
+          ncb++;
+        }
+      }
+    }
+    newplan->rowptr[ib+1] = newplan->rowptr[ib] + ncb;
+    maxrow = PetscMax(maxrow,ncb);
+  }
+  nnzb = newplan->rowptr[mb];
+  ierr = PetscMalloc2(PetscMax(nnzb,1),&newplan->cols,PetscMax(nnzb*bs*bs,1),&newplan->offsets);CHKERRQ(ierr);
+  for (l=0; l<nnzb*bs*bs; l++) newplan->offsets[l] = -1;
+
+  /* Scatter the offset of each entry to its place in the row-oriented values of its block row */
+  for (jb=0; jb<nb; jb++) stamp[jb] = -1;
+  for (ib=0; ib<mb; ib++) {
+    base = newplan->rowptr[ib];
+    ncb  = 0;
+    for (i=ib*bs; i<(ib+1)*bs; i++) {
+      for (k=plan->rowptr[i]; k<plan->rowptr[i+1]; k++) {
+        jb = plan->cols[k]/bs;
+        if (stamp[jb] != ib) {
+          stamp[jb] = ib;
+          pos[jb]   = ncb;
+          newplan->cols[base+ncb++] = jb;
+        }
+      }
+    }
+    for (i=ib*bs; i<(ib+1)*bs; i++) {
+      r = i-ib*bs;
+      for (k=plan->rowptr[i]; k<plan->rowptr[i+1]; k++) {
+        j = plan->cols[k];
+        newplan->offsets[base*bs*bs + (r*ncb + pos[j/bs])*bs + j%bs] = plan->offsets[k];
+      }
+    }
+  }
+  ierr = PetscFree2(stamp,pos);CHKERRQ(ierr);
+  ierr = PetscMalloc1(PetscMax(maxrow*bs*bs,1),&newplan->vals);CHKERRQ(ierr);
+  newplan->m    = mb;
+  newplan->nnz  = nnzb;
+  newplan->bs   = bs;
+  newplan->rows = plan->rows;
+  *bplan = newplan;
+  PetscFunctionReturn(0);
+}
+
+/*
+  Free memory associated with a recovery plan
+
+  Input parameter:
+  plan - recovery plan to destroy
+*/
+PetscErrorCode RecPlanDestroy(RecPlan **plan)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  if (!*plan) PetscFunctionReturn(0);
+  ierr = PetscFree2((*plan)->cols,(*plan)->offsets);CHKERRQ(ierr);
+  ierr = PetscFree((*plan)->vals);CHKERRQ(ierr);
+  ierr = PetscFree((*plan)->rowptr);CHKERRQ(ierr);
+  ierr = PetscFree(*plan);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Write integer data to a binary viewer. The final argument of PetscViewerBinaryWrite was removed
+  in PETSc 3.14.
+
+  Input parameters:
+  viewer - binary viewer
+  data   - data to write
+  count  - number of entries to write
+*/
+PetscErrorCode BinaryWriteInt(PetscViewer viewer,const PetscInt *data,PetscInt count)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+#if PETSC_VERSION_LT(3,14,0)
+  ierr = PetscViewerBinaryWrite(viewer,(void*) data,count,PETSC_INT,PETSC_FALSE);CHKERRQ(ierr);
+#else
+  ierr = PetscViewerBinaryWrite(viewer,data,count,PETSC_INT);CHKERRQ(ierr);
+#endif
+  PetscFunctionReturn(0);
+}
+
+/*
+  Read integer data from a binary viewer, checking that all of it is present
+
+  Input parameters:
+  viewer - binary viewer
+  count  - number of entries to read
+
+  Output parameter:
+  data   - array of length count to read into
+*/
+PetscErrorCode BinaryReadInt(PetscViewer viewer,PetscInt *data,PetscInt count)
+{
+  PetscErrorCode ierr;
+  PetscInt       got;
+
+  PetscFunctionBegin;
+  ierr = PetscViewerBinaryRead(viewer,data,count,&got,PETSC_INT);CHKERRQ(ierr);
+  if (got != count) SETERRQ2(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Expected %D entries but read %D",count,got);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Write a recovery plan to a binary viewer
+
+  Input parameters:
+  viewer - binary viewer
+  plan   - recovery plan to write
+*/
+PetscErrorCode RecPlanWrite(PetscViewer viewer,RecPlan *plan)
+{
+  PetscErrorCode ierr;
+  PetscInt       header[2];
+
+  PetscFunctionBegin;
+  header[0] = plan->m;
+  header[1] = plan->nnz;
+  ierr = BinaryWriteInt(viewer,header,2);CHKERRQ(ierr);
+  ierr = BinaryWriteInt(viewer,plan->rowptr,plan->m+1);CHKERRQ(ierr);
+  ierr = BinaryWriteInt(viewer,plan->cols,plan->nnz);CHKERRQ(ierr);
+  ierr = BinaryWriteInt(viewer,plan->offsets,plan->nnz);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Read a recovery plan from a binary viewer, as written by RecPlanWrite, checking that it is
+  consistent with the expected dimensions, so that a corrupt file is never used to index the
+  compressed Jacobian out of range
+
+  Input parameters:
+  viewer - binary viewer
+  m      - expected number of rows
+  n      - number of columns, which bounds the column indices
+  size   - size of the compressed Jacobian, which bounds the offsets
+
+  Output parameter:
+  plan   - recovery plan, which should be freed using RecPlanDestroy (even if an error occurs
+           part way through reading)
+*/
+PetscErrorCode RecPlanRead(PetscViewer viewer,PetscInt m,PetscInt n,PetscInt size,RecPlan **plan)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,k,header[2],maxrow = 0;
+  RecPlan        *newplan;
+
+  PetscFunctionBegin;
+  ierr = BinaryReadInt(viewer,header,2);CHKERRQ(ierr);
+  if ((header[0] != m) || (header[1] < 0)) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Invalid recovery plan header");
+  ierr = PetscNew(&newplan);CHKERRQ(ierr);
+  *plan = newplan;
+  newplan->m   = header[0];
+  newplan->nnz = header[1];
+  ierr = PetscMalloc1(newplan->m+1,&newplan->rowptr);CHKERRQ(ierr);
+  ierr = PetscMalloc2(PetscMax(newplan->nnz,1),&newplan->cols,PetscMax(newplan->nnz,1),&newplan->offsets);CHKERRQ(ierr);
+  ierr = BinaryReadInt(viewer,newplan->rowptr,newplan->m+1);CHKERRQ(ierr);
+  ierr = BinaryReadInt(viewer,newplan->cols,newplan->nnz);CHKERRQ(ierr);
+  ierr = BinaryReadInt(viewer,newplan->offsets,newplan->nnz);CHKERRQ(ierr);
+  if ((newplan->rowptr[0] != 0) || (newplan->rowptr[newplan->m] != newplan->nnz)) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Invalid recovery plan row pointers");
+  for (i=0; i<newplan->m; i++) {
+    if (newplan->rowptr[i+1] < newplan->rowptr[i]) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Invalid recovery plan row pointers");
+    maxrow = PetscMax(maxrow,newplan->rowptr[i+1]-newplan->rowptr[i]);
+  }
+  for (k=0; k<newplan->nnz; k++) {
+    if ((newplan->cols[k] < 0) || (newplan->cols[k] >= n)) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Recovery plan column out of range");
+    if ((newplan->offsets[k] < 0) || (newplan->offsets[k] >= size)) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Recovery plan offset out of range");
+  }
+  ierr = PetscMalloc1(PetscMax(maxrow,1),&newplan->vals);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Write a stencil tile to a binary viewer
+
+  Input parameters:
+  viewer - binary viewer
+  tile   - stencil tile to write
+*/
+PetscErrorCode StencilTileWrite(PetscViewer viewer,StencilTile *tile)
+{
+  PetscErrorCode ierr;
+  PetscInt       header[8];
+
+  PetscFunctionBegin;
+  header[0] = tile->dim;header[1] = tile->dof;header[2] = tile->sw;header[3] = tile->st;
+  header[4] = tile->tx;header[5] = tile->ty;header[6] = tile->tz;header[7] = tile->p;
+  ierr = BinaryWriteInt(viewer,header,8);CHKERRQ(ierr);
+  ierr = BinaryWriteInt(viewer,tile->colours,tile->tx*tile->ty*tile->tz*tile->dof);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+  Read a stencil tile from a binary viewer, as written by StencilTileWrite, checking that its
+  periods are valid for its stencil (see StencilTileCreate) and that every colour is in range, so
+  that a corrupt file is never used to colour a DMDA
+
+  Input parameter:
+  viewer - binary viewer
+
+  Output parameter:
+  tile   - stencil tile, which should be freed using StencilTileDestroy (even if an error occurs
+           part way through reading)
+*/
+PetscErrorCode StencilTileRead(PetscViewer viewer,StencilTile **tile)
+{
+  PetscErrorCode ierr;
+  PetscInt       header[8],size,t,i;
+  StencilTile    *newtile;
+
+  PetscFunctionBegin;
+  ierr = BinaryReadInt(viewer,header,8);CHKERRQ(ierr);
+  if ((header[0] < 1) || (header[0] > 3) || (header[1] < 1) || (header[2] < 0))
+    SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Invalid stencil tile header");
+  for (i=0; i<3; i++) {
+    t = header[4+i];
+    if (i < header[0]) {
+      if ((t < 2*header[2]+1) || (t > 2*(2*header[2]+1))) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Invalid stencil tile period");
+    } else if (t != 1) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Invalid stencil tile period");
+  }
+  size = header[4]*header[5]*header[6]*header[1];
+  if ((header[7] < 1) || (header[7] > size)) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Stencil tile holds an invalid number of colours");
+  ierr = PetscNew(&newtile);CHKERRQ(ierr);
+  *tile = newtile;
+  newtile->dim = header[0];newtile->dof = header[1];newtile->sw = header[2];newtile->st = header[3];
+  newtile->tx  = header[4];newtile->ty  = header[5];newtile->tz = header[6];newtile->p   = header[7];
+  ierr = PetscMalloc1(size,&newtile->colours);CHKERRQ(ierr);
+  ierr = BinaryReadInt(viewer,newtile->colours,size);CHKERRQ(ierr);
+  for (i=0; i<size; i++) {
+    if ((newtile->colours[i] < 0) || (newtile->colours[i] >= newtile->p)) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_FILE_UNEXPECTED,"Stencil tile colour out of range");
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Recover the values of a sparse matrix from a compressed format and insert these into a matrix,
+  one row at a time
+
+  Input parameters:
+  mode - use INSERT_VALUES or ADD_VALUES, as required
+  plan - recovery plan to use in the decompression procedure
+  C    - compressed matrix to recover values from, allocated contiguously (e.g. using AdolcMalloc2)
+  a    - shift value for implicit problems (select NULL or unity for explicit problems)
+
+  Output parameter:
+  A    - Mat to be populated with values from compressed matrix
+
+  Note: Row i of the plan is inserted into row plan->rows[i] of A, if a row map is set.
+*/
+PetscErrorCode RecoverJacobian(Mat A,InsertMode mode,RecPlan *plan,PetscScalar **C,PetscReal *a)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,k,ncols,row;
+  PetscScalar    *c = C[0];
+
+  PetscFunctionBegin;
+  for (i=0; i<plan->m; i++) {
+    ncols = plan->rowptr[i+1]-plan->rowptr[i];
+    if (!ncols) continue;
+    for (k=0; k<ncols; k++)
+      plan->vals[k] = c[plan->offsets[plan->rowptr[i]+k]];
+    if (a) {
+      for (k=0; k<ncols; k++)
+        plan->vals[k] *= *a;
+    }
+    row  = plan->rows ? plan->rows[i] : i;
+    ierr = MatSetValues(A,1,&row,ncols,&plan->cols[plan->rowptr[i]],plan->vals,mode);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+PetscErrorCode RecoverJacobianLocal(Mat A,InsertMode mode,RecPlan *plan,PetscScalar **C,PetscReal *a)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,k,ncols,row;
+  PetscScalar    *c = C[0];
+
+  PetscFunctionBegin;
+  for (i=0; i<plan->m; i++) {
+    ncols = plan->rowptr[i+1]-plan->rowptr[i];
+    if (!ncols) continue;
+    for (k=0; k<ncols; k++)
+      plan->vals[k] = c[plan->offsets[plan->rowptr[i]+k]];
+    if (a) {
+      for (k=0; k<ncols; k++)
+        plan->vals[k] *= *a;
+    }
+    row  = plan->rows ? plan->rows[i] : i;
+    ierr = MatSetValuesLocal(A,1,&row,ncols,&plan->cols[plan->rowptr[i]],plan->vals,mode);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+  Recover a Jacobian from its compressed matrix format one block row at a time, using a blocked
+  recovery plan (see GetBlockRecoveryPlan), and insert it into a BAIJ or SBAIJ matrix using
+  MatSetValuesBlocked. For SBAIJ matrices, MAT_IGNORE_LOWER_TRIANGULAR should be set.
+
+  Input parameters:
+  mode - use INSERT_VALUES or ADD_VALUES, as required
+  plan - blocked recovery plan
+  C    - compressed matrix to recover values from
+  a    - shift value for implicit problems (select NULL or unity for explicit problems)
+
+  Output parameter:
+  A    - Mat to be populated with values from compressed matrix
+*/
+PetscErrorCode RecoverJacobianBlocked(Mat A,InsertMode mode,RecPlan *plan,PetscScalar **C,PetscReal *a)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,k,ncols,nvals,row,off,bs = plan->bs;
+  PetscScalar    *c = C[0];
+
+  PetscFunctionBegin;
+  for (i=0; i<plan->m; i++) {
+    ncols = plan->rowptr[i+1]-plan->rowptr[i];
+    if (!ncols) continue;
+    nvals = ncols*bs*bs;
+    for (k=0; k<nvals; k++) {
+      off = plan->offsets[plan->rowptr[i]*bs*bs+k];
+      plan->vals[k] = (off >= 0) ? c[off] : 0.;
+    }
+    if (a) {
+      for (k=0; k<nvals; k++)
+        plan->vals[k] *= *a;
+    }
+    row  = plan->rows ? plan->rows[i*bs]/bs : i;
+    ierr = MatSetValuesBlocked(A,1,&row,ncols,&plan->cols[plan->rowptr[i]],plan->vals,mode);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+PetscErrorCode RecoverJacobianBlockedLocal(Mat A,InsertMode mode,RecPlan *plan,PetscScalar **C,PetscReal *a)
+{
+  PetscErrorCode ierr;
+  PetscInt       i,k,ncols,nvals,row,off,bs = plan->bs;
+  PetscScalar    *c = C[0];
+
+  PetscFunctionBegin;
+  for (i=0; i<plan->m; i++) {
+    ncols = plan->rowptr[i+1]-plan->rowptr[i];
+    if (!ncols) continue;
+    nvals = ncols*bs*bs;
+    for (k=0; k<nvals; k++) {
+      off = plan->offsets[plan->rowptr[i]*bs*bs+k];
+      plan->vals[k] = (off >= 0) ? c[off] : 0.;
+    }
+    if (a) {
+      for (k=0; k<nvals; k++)
+        plan->vals[k] *= *a;
+    }
+    row  = plan->rows ? plan->rows[i*bs]/bs : i;
+    ierr = MatSetValuesBlockedLocal(A,1,&row,ncols,&plan->cols[plan->rowptr[i]],plan->vals,mode);CHKERRQ(ierr);
   }
   PetscFunctionReturn(0);
 }